@@ -1,6 +1,91 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <pthread.h>
+
+/* Number of keys scored at once by the fused attention kernel */
+#define ATTENTION_TILE 64
+
+/* Number of rows handed to the elementwise kernels at a time */
+#define ELEMENTWISE_BLOCK_ROWS 32
+
+/* Size of the register tile computed by the GEMM micro-kernel */
+#define GEMM_TILE_ROWS 4
+#define GEMM_TILE_COLS 8
+
+/* Width of the pieces of B rows reused by the Kronecker product writer */
+#define KRONECKER_BLOCK 512
+
+/* Number of rows per block in the one-pass statistics kernels */
+#define STATISTICS_BLOCK_ROWS 256
+
+/* Default block of the distance matrix produced at a time */
+#define DISTANCE_BLOCK_ROWS 64
+#define DISTANCE_BLOCK_COLS 1024
+
+/* Rows per partial sum in the k-means centroid update */
+#define KMEANS_BLOCK_ROWS 4096
+
+/* Floor of the NMF factors and guard of its divisions */
+#define NMF_EPSILON 1e-12
+
+/* Moduli of ModularMatrix must stay below 2^26 */
+#define MODULAR_MAX_MODULUS 67108864
+
+/* Sparse traversals pull once the frontier reaches nnz / ratio edges */
+#define SPARSE_PULL_RATIO 14
+
+/* How many rows ahead the gather kernels prefetch */
+#define GATHER_PREFETCH_DISTANCE 8
+
+#if defined(__GNUC__)
+#define PREFETCH_READ(address) __builtin_prefetch((address), 0, 1)
+#else
+#define PREFETCH_READ(address) ((void)(address))
+#endif
+
+/* Output elements kept in cache by the N-ary sum (16 KB) */
+#define SUM_TILE_ELEMENTS 2048
+
+/* Elements per tile in the concurrent accumulator */
+#define ACCUMULATOR_TILE_ELEMENTS 4096
+
+/* Rows per block in column scans */
+#define SCAN_BLOCK_ROWS 256
+
+/* Rows per block in the tall and skinny QR kernels */
+#define TSQR_BLOCK_ROWS 1024
+
+/* Columns per panel of the blocked pivoted QR */
+#define PIVOTED_QR_PANEL 32
+
+/* Columns per block of the two sided reduction in the generalized eigensolver */
+#define REDUCTION_BLOCK 32
+
+/* Extra sketch rows used by the randomized interpolative decomposition */
+#define ID_OVERSAMPLE 10
+
+/* Average QR steps allowed per eigenvalue in the Schur and symmetric eigensolvers */
+#define SCHUR_MAX_ITERATIONS 30
+
+/* Relative residual of the shifted solves inside low rank ADI */
+#define ADI_INNER_TOLERANCE 1e-12
+
+/* Relative determinant below which closed form inverses flag a matrix as near singular */
+#define SMALL_INVERSE_TOLERANCE 1e-12
+
+/* Constants for the polynomial exp and log */
+#define LOG2_E 1.4426950408889634
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define SQRT_2 1.4142135623730951
+#define ROUND_MAGIC 6755399441055744.0
+#define EXP_OVERFLOW 709.782712893384
+#define EXP_UNDERFLOW -745.1332191019411
 
 /*
  * Struct:  Matrix 
@@ -192,93 +277,8994 @@ bool multiplyMatrices(const Matrix *matrix_a, const Matrix *matrix_b, Matrix *re
 }
 
 /*
- * Function: (void) printMatrix
+ * Function: (bool) multiplyMatricesStridedBatched
  * --------------------
- *  Prints a matrix in a 2D fashion
- *  Useful for debugging
+ * Multiplies batch_count independent pairs of matrices that are laid out one
+ * after the other in memory, such as the heads of an attention layer
+ * matrix_a, matrix_b and result describe the shape and the first element of
+ * each batch. The i-th element of the batch starts at data + i * stride
+ * A stride of 0 for an operand reuses the same matrix for every product
  *
- *  matrix (pointer): a pointer to a Matrix struct
+ * The loops follow multiplyMatrices but run r, k, c instead of r, c, k so that
+ * the innermost loop walks rows of B and of the result contiguously
+ *
+ *  matrix_a (pointer): first left operand of the batch
+ *  stride_a (int): number of doubles between consecutive left operands
+ *  matrix_b (pointer): first right operand of the batch
+ *  stride_b (int): number of doubles between consecutive right operands
+ *  result (pointer): first result of the batch, data must be preallocated
+ *  stride_result (int): number of doubles between consecutive results
+ *  batch_count (int): number of products in the batch
+ *
+ *  Returns true if successful, false if the dimensions or strides do not match
 */
-void printMatrix(const Matrix *matrix){
+bool multiplyMatricesStridedBatched(const Matrix *matrix_a, int stride_a,
+                                    const Matrix *matrix_b, int stride_b,
+                                    Matrix *result, int stride_result, int batch_count){
+    /* Check compatible dimensions*/
+    if (matrix_a->cols != matrix_b->rows){
+        printf("Incompatible dimensions in batched matrix multiplication\n");
+        return false;
+    }
+    /* Results must not overlap each other */
+    if (batch_count > 1 && stride_result < matrix_a->rows * matrix_b->cols){
+        printf("Result stride too small in batched matrix multiplication\n");
+        return false;
+    }
+    /* Enforce dimensions for result matrix */
+    result->rows = matrix_a->rows;
+    result->cols = matrix_b->cols;
+    int batch;
     int r;
     int c;
-    for(r = 0; r < matrix->rows;r++){
-        for(c=0;c < matrix->cols;c++){
-            /*Print corresponding element*/
-            printf("%f ", *(matrix->data + r * matrix->cols + c));
+    int k;
+    for(batch = 0; batch < batch_count; batch++){
+        const double *a = matrix_a->data + (size_t)batch * stride_a;
+        const double *b = matrix_b->data + (size_t)batch * stride_b;
+        double *out = result->data + (size_t)batch * stride_result;
+        for(r = 0; r < matrix_a->rows; r++){
+            double *out_row = out + r * result->cols;
+            for(c = 0; c < result->cols; c++){
+                out_row[c] = 0;
+            }
+            for(k = 0; k < matrix_a->cols; k++){
+                /* Broadcast A_{r,k} against the k-th row of B */
+                double a_rk = a[r * matrix_a->cols + k];
+                const double *b_row = b + k * matrix_b->cols;
+                for(c = 0; c < result->cols; c++){
+                    out_row[c] += a_rk * b_row[c];
+                }
+            }
         }
-        /*Skip a line*/
-        printf("\n");
     }
+    return true;
 }
 
 /*
- * Function: (int) main
+ * Enum: ElementwiseFunction
  * --------------------
- *  Executes the routine of summing two matrices
- *  Placeholder values for now
+ * Selects the function applied by applyElementwise and by the fused
+ * multiplication write-back
+*/
+typedef enum {
+    ELEMENTWISE_NONE,
+    ELEMENTWISE_EXP,
+    ELEMENTWISE_LOG,
+    ELEMENTWISE_TANH,
+    ELEMENTWISE_SIGMOID,
+    ELEMENTWISE_SQRT,
+    ELEMENTWISE_RELU,
+    ELEMENTWISE_GELU
+} ElementwiseFunction;
+
+/*
+ * Callback: GemmTileCallback
+ * --------------------
+ * Custom operation run on each tile of a product before it is written back
+ * tile points at the tile's first value and consecutive rows of the tile are
+ * tile_stride doubles apart. row and col locate the tile in the result
+*/
+typedef void (*GemmTileCallback)(double *tile, int tile_stride, int row, int col,
+                                 int tile_rows, int tile_cols, void *context);
+
+/*
+ * Struct: GemmEpilogue
+ * --------------------
+ * Operations fused into the write-back of multiplyMatricesEpilogue
+ * Each element becomes clamp(activation(alpha * (AB)_{r,c} + row_bias[r] + col_bias[c]))
  *
- *  No arguments
+ *  alpha (double): scale applied to the product
+ *  row_bias (pointer): one value per result row, or NULL
+ *  col_bias (pointer): one value per result column, or NULL
+ *  activation (ElementwiseFunction): ELEMENTWISE_NONE to skip
+ *  clamp (bool): whether to clamp to [clamp_min, clamp_max]
+ *  clamp_min, clamp_max (double): clamping bounds
+ *  callback (GemmTileCallback): extra operation per tile, or NULL
+ *  context (pointer): passed through to the callback
 */
-int main(){
-    /* Define data for example */
-    double matrixAData[2][3] = {{1.1,2.2,3.3},{4.3,5.2,6.1}};
-    double matrixBData[2][3] = {{0.4,3.7,8.9},{4.5,2.7,6.9}};
-    double matrixCData[3][2] = {{1.3,4.3},{5.2,0.0},{6.7,8.8}};
-    /* Initialize result matrix */
-    double resultData[2][3];
-    double resultMultData[2][2];
-    /* Generate matrix structs */
-    Matrix matrixA = {2,3, (double *)matrixAData};
-    Matrix matrixB = {2,3, (double *)matrixBData};
-    Matrix matrixC = {3,2, (double *)matrixCData};
-    Matrix resultSum = {2,3, (double *)resultData};
-    Matrix resultMinus = {2,3, (double *)resultData};
-    Matrix resultMult = {2,2, (double *)resultMultData};
-    /* Perform sum */
-    if (sumMatrices(&matrixA, &matrixB, false, &resultSum)) {
-        printf("Sum of matrices:\n");
-        printMatrix(&resultSum);
+typedef struct{
+    double alpha;
+    const double *row_bias;
+    const double *col_bias;
+    ElementwiseFunction activation;
+    bool clamp;
+    double clamp_min;
+    double clamp_max;
+    GemmTileCallback callback;
+    void *context;
+} GemmEpilogue;
+
+/*
+ * Function: (double) powerOfTwo
+ * --------------------
+ * Builds 2^n directly from its bit pattern, valid for -1022 <= n <= 1023
+ *
+ *  n (int): the exponent
+*/
+double powerOfTwo(int n){
+    uint64_t bits = (uint64_t)(n + 1023) << 52;
+    double value;
+    memcpy(&value, &bits, sizeof(double));
+    return value;
+}
+
+/*
+ * Function: (double) expm1Reduced
+ * --------------------
+ * Shared core of fastExp and fastExpm1
+ * Writes x = n ln2 + r with |r| <= ln2/2 (ln2 split in two parts so the
+ * reduction is exact) and returns exp(r) - 1 from its Taylor series, which
+ * at this range is accurate to well under one ULP after 13 terms
+ *
+ *  x (double): the argument, must be finite and within the exp range
+ *  n (pointer): receives the power of two of the reduction
+*/
+double expm1Reduced(double x, int *n){
+    /* Round x / ln2 to the nearest integer without calling libm */
+    double k = (x * LOG2_E + ROUND_MAGIC) - ROUND_MAGIC;
+    double r = (x - k * LN2_HI) - k * LN2_LO;
+    *n = (int)k;
+    return r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120
+         + r * (1.0 / 720 + r * (1.0 / 5040 + r * (1.0 / 40320 + r * (1.0 / 362880
+         + r * (1.0 / 3628800 + r * (1.0 / 39916800 + r * (1.0 / 479001600
+         + r * (1.0 / 6227020800.0)))))))))))));
+}
+
+/*
+ * Function: (double) fastExp
+ * --------------------
+ * exp(x) within about one ULP using range reduction and a polynomial
+ * The power of two is applied in two halves so subnormal results work
+ *
+ *  x (double): the argument
+*/
+double fastExp(double x){
+    if(x != x){
+        return x;
     }
-    if (sumMatrices(&matrixA, &matrixB, true, &resultMinus)) {
-        printf("Subtraction of matrices:\n");
-        printMatrix(&resultMinus);
+    if(x > EXP_OVERFLOW){
+        return INFINITY;
     }
-    /* Perform multiplication */
-    if (multiplyMatrices(&matrixA, &matrixC, &resultMult)) {
-        printf("Multiplication of matrices:\n");
-        printMatrix(&resultMinus);
+    if(x < EXP_UNDERFLOW){
+        return 0.0;
     }
-    /* Test cases for transposing */
-    // Define a result matrix for the transpose
-    double vectorData[1][3] = {1.1,2.2,3.3};
-    Matrix vector = {1,3,(double *)vectorData};
-    Matrix resultTrans;
-    Matrix vectorTrans;
+    int n;
+    double p = expm1Reduced(x, &n);
+    return (1.0 + p) * powerOfTwo(n / 2) * powerOfTwo(n - n / 2);
+}
 
-    // Transpose the matrix
-    if (transposeMatrix(&matrixA, &resultTrans)) {
-        printf("Original matrix:\n");
-        printMatrix(&matrixA);
-        printf("Transposed matrix:\n");
-        printMatrix(&resultTrans);
-        
-        // Free memory if the transpose was out-of-place (rectangular)
-        if (matrixA.data != resultTrans.data) {
-            free(resultTrans.data);
+/*
+ * Function: (double) fastExpm1
+ * --------------------
+ * exp(x) - 1 without the cancellation of computing fastExp(x) - 1 near zero
+ *
+ *  x (double): the argument
+*/
+double fastExpm1(double x){
+    if(x != x){
+        return x;
+    }
+    if(x > EXP_OVERFLOW){
+        return INFINITY;
+    }
+    if(x < -40.0){
+        return -1.0;
+    }
+    int n;
+    double p = expm1Reduced(x, &n);
+    if(n == 0){
+        return p;
+    }
+    double scale = powerOfTwo(n / 2) * powerOfTwo(n - n / 2);
+    return scale * p + (scale - 1.0);
+}
+
+/*
+ * Function: (double) fastLog
+ * --------------------
+ * Natural logarithm within about one ULP
+ * The exponent is read from the bits, the mantissa is brought into
+ * [sqrt(1/2), sqrt(2)) and log(1 + f) is evaluated through the odd series of
+ * s = f / (2 + f), arranged as f - s (f - R) so the leading term is exact
+ *
+ *  x (double): the argument
+*/
+double fastLog(double x){
+    if(x != x || x == INFINITY){
+        return x;
+    }
+    if(x < 0){
+        return NAN;
+    }
+    if(x == 0){
+        return -INFINITY;
+    }
+    int exponent = 0;
+    /* Normalize subnormals */
+    if(x < 2.2250738585072014e-308){
+        x *= 18014398509481984.0;
+        exponent = -54;
+    }
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(double));
+    exponent += (int)((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(double));
+    if(m > SQRT_2){
+        m *= 0.5;
+        exponent += 1;
+    }
+    double f = m - 1.0;
+    double s = f / (2.0 + f);
+    double z = s * s;
+    double big_r = z * (2.0 / 3 + z * (2.0 / 5 + z * (2.0 / 7 + z * (2.0 / 9 + z * (2.0 / 11
+                 + z * (2.0 / 13 + z * (2.0 / 15 + z * (2.0 / 17 + z * (2.0 / 19
+                 + z * (2.0 / 21 + z * (2.0 / 23)))))))))));
+    return exponent * LN2_HI + ((f - s * (f - big_r)) + exponent * LN2_LO);
+}
+
+/*
+ * Function: (double) fastTanh
+ * --------------------
+ * tanh(x) = -expm1(-2|x|) / (2 + expm1(-2|x|)) with the sign of x restored
+ * Going through expm1 keeps full relative accuracy for small |x|
+ *
+ *  x (double): the argument
+*/
+double fastTanh(double x){
+    double a = x < 0 ? -x : x;
+    double t;
+    if(a > 22.0){
+        t = 1.0;
+    } else {
+        double e = fastExpm1(-2.0 * a);
+        t = -e / (2.0 + e);
+    }
+    return x < 0 ? -t : t;
+}
+
+/*
+ * Function: (double) fastSigmoid
+ * --------------------
+ * Logistic function 1 / (1 + exp(-x))
+ *
+ *  x (double): the argument
+*/
+double fastSigmoid(double x){
+    return 1.0 / (1.0 + fastExp(-x));
+}
+
+/*
+ * Function: (double) fastSqrt
+ * --------------------
+ * Square root from a bit-level reciprocal square root estimate refined with
+ * three Newton steps, followed by one correction of the root itself
+ * The result is within one ULP of the correctly rounded value
+ *
+ *  x (double): the argument
+*/
+double fastSqrt(double x){
+    if(x != x || x == 0 || x == INFINITY){
+        return x;
+    }
+    if(x < 0){
+        return NAN;
+    }
+    double rescale = 1.0;
+    /* Normalize subnormals so the bit estimate stays close */
+    if(x < 2.2250738585072014e-308){
+        x *= 18014398509481984.0;
+        rescale = 1.0 / 134217728.0;
+    }
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(double));
+    bits = 0x5fe6eb50c7b537a9ULL - (bits >> 1);
+    double y;
+    memcpy(&y, &bits, sizeof(double));
+    double half_x = 0.5 * x;
+    y = y * (1.5 - half_x * y * y);
+    y = y * (1.5 - half_x * y * y);
+    y = y * (1.5 - half_x * y * y);
+    double root = x * y;
+    root += 0.5 * y * (x - root * root);
+    return root * rescale;
+}
+
+/*
+ * Function: (double) fastGelu
+ * --------------------
+ * GELU activation in its usual tanh form
+ * 0.5 x (1 + tanh(sqrt(2/pi) (x + 0.044715 x^3)))
+ *
+ *  x (double): the argument
+*/
+double fastGelu(double x){
+    return 0.5 * x * (1.0 + fastTanh(0.7978845608028654 * (x + 0.044715 * x * x * x)));
+}
+
+/*
+ * Function: (void) runParallel
+ * --------------------
+ * Runs work on every element of an array of tasks, one thread per task,
+ * and waits for all of them. The first task runs on the calling thread,
+ * as does any task whose thread cannot be created, so the work always
+ * completes
+ *
+ *  work (pointer): the function run on each task
+ *  tasks (pointer): first of count tasks
+ *  task_size (size_t): size of one task in bytes
+ *  count (int): number of tasks
+*/
+void runParallel(void *(*work)(void *), void *tasks, size_t task_size, int count){
+    pthread_t *threads = count > 1 ? (pthread_t *)malloc(sizeof(pthread_t) * (size_t)count) : NULL;
+    bool *started = count > 1 ? (bool *)calloc((size_t)count, sizeof(bool)) : NULL;
+    int i;
+    for(i = 1; i < count && threads != NULL && started != NULL; i++){
+        started[i] = pthread_create(&threads[i], NULL, work, (char *)tasks + (size_t)i * task_size) == 0;
+    }
+    for(i = 0; i < count; i++){
+        if(i == 0 || threads == NULL || started == NULL){
+            work((char *)tasks + (size_t)i * task_size);
+        } else if(started[i]){
+            pthread_join(threads[i], NULL);
+        } else {
+            work((char *)tasks + (size_t)i * task_size);
         }
     }
-    
-    // Transpose the vector
-    if (transposeMatrix(&vector, &vectorTrans)) {
-        printf("Original vectpr:\n");
-        printMatrix(&vector);
-        printf("Transposed vector:\n");
-        printMatrix(&vectorTrans);
-        
-        // Free memory if the transpose was out-of-place (rectangular)
-        if (vector.data != vectorTrans.data) {
-            free(vectorTrans.data);
+    free(threads);
+    free(started);
+}
+
+/*
+ * Function: (void) applyElementwiseRow
+ * --------------------
+ * Applies an elementwise function to a contiguous run of values
+ * The switch sits outside the loops so each loop is a straight-line body
+ * the compiler can vectorize. in and out may be the same pointer
+ *
+ *  in (pointer): the input values
+ *  out (pointer): where the results are written
+ *  count (int): number of values
+ *  function (ElementwiseFunction): the function to apply
+*/
+void applyElementwiseRow(const double *in, double *out, int count, ElementwiseFunction function){
+    int i;
+    switch(function){
+        case ELEMENTWISE_NONE:
+            if(in != out){
+                memcpy(out, in, count * sizeof(double));
+            }
+            break;
+        case ELEMENTWISE_EXP:
+            for(i = 0; i < count; i++){
+                out[i] = fastExp(in[i]);
+            }
+            break;
+        case ELEMENTWISE_LOG:
+            for(i = 0; i < count; i++){
+                out[i] = fastLog(in[i]);
+            }
+            break;
+        case ELEMENTWISE_TANH:
+            for(i = 0; i < count; i++){
+                out[i] = fastTanh(in[i]);
+            }
+            break;
+        case ELEMENTWISE_SIGMOID:
+            for(i = 0; i < count; i++){
+                out[i] = fastSigmoid(in[i]);
+            }
+            break;
+        case ELEMENTWISE_SQRT:
+            for(i = 0; i < count; i++){
+                out[i] = fastSqrt(in[i]);
+            }
+            break;
+        case ELEMENTWISE_RELU:
+            for(i = 0; i < count; i++){
+                out[i] = in[i] > 0 ? in[i] : 0.0;
+            }
+            break;
+        case ELEMENTWISE_GELU:
+            for(i = 0; i < count; i++){
+                out[i] = fastGelu(in[i]);
+            }
+            break;
+    }
+}
+
+/*
+ * Struct: ElementwiseTask
+ * --------------------
+ * The rows handled by one thread of applyElementwise
+ *
+ *  matrix (pointer): the input matrix
+ *  result (pointer): the result
+ *  function (ElementwiseFunction): the function to apply
+ *  first_row (int): first row of the task
+ *  end_row (int): one past the last row of the task
+*/
+typedef struct{
+    const Matrix *matrix;
+    Matrix *result;
+    ElementwiseFunction function;
+    int first_row;
+    int end_row;
+} ElementwiseTask;
+
+/*
+ * Function: (void *) runElementwiseTask
+ * --------------------
+ * Thread entry point of applyElementwise, walks its rows
+ * ELEMENTWISE_BLOCK_ROWS at a time
+ *
+ *  argument (pointer): the ElementwiseTask
+ *
+ *  Returns NULL
+*/
+void *runElementwiseTask(void *argument){
+    ElementwiseTask *task = (ElementwiseTask *)argument;
+    int cols = task->matrix->cols;
+    int block;
+    for(block = task->first_row; block < task->end_row; block += ELEMENTWISE_BLOCK_ROWS){
+        int block_rows = task->end_row - block < ELEMENTWISE_BLOCK_ROWS ?
+                         task->end_row - block : ELEMENTWISE_BLOCK_ROWS;
+        applyElementwiseRow(task->matrix->data + (size_t)block * cols,
+                            task->result->data + (size_t)block * cols,
+                            block_rows * cols, task->function);
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) applyElementwise
+ * --------------------
+ * Applies an elementwise function to every entry of a matrix
+ * The matrix is processed in blocks of ELEMENTWISE_BLOCK_ROWS rows, and
+ * the blocks are dealt out to the threads in contiguous runs
+ * matrix and result may be the same struct to work in place
+ *
+ *  matrix (pointer): a pointer to the input matrix
+ *  function (ElementwiseFunction): the function to apply
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool applyElementwise(const Matrix *matrix, ElementwiseFunction function, int thread_count, Matrix *result){
+    int blocks = (matrix->rows + ELEMENTWISE_BLOCK_ROWS - 1) / ELEMENTWISE_BLOCK_ROWS;
+    int t;
+    result->rows = matrix->rows;
+    result->cols = matrix->cols;
+    if(thread_count > blocks){
+        thread_count = blocks;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    ElementwiseTask *tasks = (ElementwiseTask *)malloc(sizeof(ElementwiseTask) * (size_t)thread_count);
+    if(tasks == NULL){
+        printf("Memory allocation failed for elementwise tasks.\n");
+        return false;
+    }
+    for(t = 0; t < thread_count; t++){
+        int first = blocks * t / thread_count * ELEMENTWISE_BLOCK_ROWS;
+        int end = blocks * (t + 1) / thread_count * ELEMENTWISE_BLOCK_ROWS;
+        ElementwiseTask task = {matrix, result, function, first, end < matrix->rows ? end : matrix->rows};
+        tasks[t] = task;
+    }
+    runParallel(runElementwiseTask, tasks, sizeof(ElementwiseTask), thread_count);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Function: (void) multiplyMicroTile
+ * --------------------
+ * Computes one GEMM_TILE_ROWS x GEMM_TILE_COLS block of a product into a
+ * local tile, which the compiler keeps in registers for the full-size case
+ * Operands are addressed through strides so the same kernel serves A B,
+ * A B^T and A^T B: element (r, k) of the left operand is
+ * a[r * a_row_stride + k * a_inner_stride] and element (k, c) of the right
+ * operand is b[k * b_inner_stride + c * b_col_stride]
+ *
+ *  a (pointer): first element of the left operand for this tile
+ *  a_row_stride, a_inner_stride (int): strides of the left operand
+ *  b (pointer): first element of the right operand for this tile
+ *  b_inner_stride, b_col_stride (int): strides of the right operand
+ *  inner (int): length of the shared dimension
+ *  tile_rows, tile_cols (int): size of this tile, at most the tile constants
+ *  tile (array): receives the products
+*/
+void multiplyMicroTile(const double *a, int a_row_stride, int a_inner_stride,
+                       const double *b, int b_inner_stride, int b_col_stride,
+                       int inner, int tile_rows, int tile_cols,
+                       double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS]){
+    int i;
+    int j;
+    int k;
+    for(i = 0; i < GEMM_TILE_ROWS; i++){
+        for(j = 0; j < GEMM_TILE_COLS; j++){
+            tile[i][j] = 0;
+        }
+    }
+    if(tile_rows == GEMM_TILE_ROWS && tile_cols == GEMM_TILE_COLS){
+        /* Full tile: constant trip counts so the loops unroll */
+        for(k = 0; k < inner; k++){
+            const double *b_row = b + (size_t)k * b_inner_stride;
+            for(i = 0; i < GEMM_TILE_ROWS; i++){
+                double a_ik = a[(size_t)i * a_row_stride + (size_t)k * a_inner_stride];
+                for(j = 0; j < GEMM_TILE_COLS; j++){
+                    tile[i][j] += a_ik * b_row[j * b_col_stride];
+                }
+            }
+        }
+    } else {
+        /* Edge tile */
+        for(k = 0; k < inner; k++){
+            const double *b_row = b + (size_t)k * b_inner_stride;
+            for(i = 0; i < tile_rows; i++){
+                double a_ik = a[(size_t)i * a_row_stride + (size_t)k * a_inner_stride];
+                for(j = 0; j < tile_cols; j++){
+                    tile[i][j] += a_ik * b_row[j * b_col_stride];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Function: (void) applyEpilogueTile
+ * --------------------
+ * Applies a GemmEpilogue to a tile of the product in this order:
+ * scaling, row bias, column bias, activation, clamping, then the callback
+ *
+ *  epilogue (pointer): the operations to apply
+ *  tile (array): the tile, modified in place
+ *  row, col (int): position of the tile's first element in the result
+ *  tile_rows, tile_cols (int): size of the tile
+*/
+void applyEpilogueTile(const GemmEpilogue *epilogue, double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS],
+                       int row, int col, int tile_rows, int tile_cols){
+    int i;
+    int j;
+    for(i = 0; i < tile_rows; i++){
+        double row_bias = epilogue->row_bias != NULL ? epilogue->row_bias[row + i] : 0.0;
+        for(j = 0; j < tile_cols; j++){
+            double value = epilogue->alpha * tile[i][j] + row_bias;
+            if(epilogue->col_bias != NULL){
+                value += epilogue->col_bias[col + j];
+            }
+            tile[i][j] = value;
+        }
+        if(epilogue->activation != ELEMENTWISE_NONE){
+            applyElementwiseRow(tile[i], tile[i], tile_cols, epilogue->activation);
+        }
+        if(epilogue->clamp){
+            for(j = 0; j < tile_cols; j++){
+                double value = tile[i][j] < epilogue->clamp_min ? epilogue->clamp_min : tile[i][j];
+                tile[i][j] = value > epilogue->clamp_max ? epilogue->clamp_max : value;
+            }
+        }
+    }
+    if(epilogue->callback != NULL){
+        epilogue->callback(&tile[0][0], GEMM_TILE_COLS, row, col, tile_rows, tile_cols,
+                           epilogue->context);
+    }
+}
+
+/*
+ * Function: (bool) multiplyMatricesEpilogue
+ * --------------------
+ * Multiplies two matrices tile by tile and applies the fused operations of
+ * the epilogue to every tile before it is written to the result, so a
+ * neural layer act(alpha A B + bias) costs a single pass over the output
+ * Column strips of B are reused across all row tiles of A
+ *
+ *  matrix_a (pointer): a pointer to the left matrix
+ *  matrix_b (pointer): a pointer to the right matrix
+ *  epilogue (pointer): the fused operations, or NULL for a plain product
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool multiplyMatricesEpilogue(const Matrix *matrix_a, const Matrix *matrix_b,
+                              const GemmEpilogue *epilogue, Matrix *result){
+    /* Check compatible dimensions*/
+    if (matrix_a->cols != matrix_b->rows){
+        printf("Incompatible dimensions in matrix multiplication\n");
+        return false;
+    }
+    /* Enforce dimensions for result matrix */
+    result->rows = matrix_a->rows;
+    result->cols = matrix_b->cols;
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    int row;
+    int col;
+    int i;
+    int j;
+    for(col = 0; col < result->cols; col += GEMM_TILE_COLS){
+        int tile_cols = result->cols - col < GEMM_TILE_COLS ? result->cols - col : GEMM_TILE_COLS;
+        for(row = 0; row < result->rows; row += GEMM_TILE_ROWS){
+            int tile_rows = result->rows - row < GEMM_TILE_ROWS ? result->rows - row : GEMM_TILE_ROWS;
+            multiplyMicroTile(matrix_a->data + row * matrix_a->cols, matrix_a->cols, 1,
+                              matrix_b->data + col, matrix_b->cols, 1,
+                              matrix_a->cols, tile_rows, tile_cols, tile);
+            if(epilogue != NULL){
+                applyEpilogueTile(epilogue, tile, row, col, tile_rows, tile_cols);
+            }
+            /* Write back */
+            for(i = 0; i < tile_rows; i++){
+                for(j = 0; j < tile_cols; j++){
+                    *(result->data + (row + i) * result->cols + col + j) = tile[i][j];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) multiplyMatricesActivation
+ * --------------------
+ * Multiplies two matrices and applies an elementwise function to the result
+ * Shorthand for multiplyMatricesEpilogue with only an activation
+ *
+ *  matrix_a (pointer): a pointer to the left matrix
+ *  matrix_b (pointer): a pointer to the right matrix
+ *  function (ElementwiseFunction): the activation to apply
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool multiplyMatricesActivation(const Matrix *matrix_a, const Matrix *matrix_b,
+                                ElementwiseFunction function, Matrix *result){
+    GemmEpilogue epilogue = {1.0, NULL, NULL, function, false, 0.0, 0.0, NULL, NULL};
+    return multiplyMatricesEpilogue(matrix_a, matrix_b, &epilogue, result);
+}
+
+/*
+ * Function: (bool) softmaxRows
+ * --------------------
+ * Applies a numerically stable softmax to every row of a matrix
+ * Each row is shifted by its maximum before exponentiating so that large
+ * scores do not overflow, then normalized to sum to one
+ * matrix and result may be the same struct to work in place
+ *
+ *  matrix (pointer): a pointer to the input matrix
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful
+*/
+bool softmaxRows(const Matrix *matrix, Matrix *result){
+    result->rows = matrix->rows;
+    result->cols = matrix->cols;
+    int r;
+    int c;
+    for(r = 0; r < matrix->rows; r++){
+        const double *in_row = matrix->data + r * matrix->cols;
+        double *out_row = result->data + r * result->cols;
+        /* Max-subtract */
+        double row_max = -INFINITY;
+        for(c = 0; c < matrix->cols; c++){
+            if(in_row[c] > row_max){
+                row_max = in_row[c];
+            }
+        }
+        /* Exponentiate and accumulate the normalizer */
+        double total = 0;
+        for(c = 0; c < matrix->cols; c++){
+            out_row[c] = fastExp(in_row[c] - row_max);
+            total += out_row[c];
+        }
+        /* Normalize */
+        for(c = 0; c < matrix->cols; c++){
+            out_row[c] /= total;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) attentionHead
+ * --------------------
+ * Computes softmax(scale * Q K^T) V for a single attention head without ever
+ * building the full score matrix
+ * Keys are scored ATTENTION_TILE at a time. Each query row keeps a running
+ * maximum and normalizer (an online softmax), and whenever a tile raises the
+ * maximum the partial output accumulated so far is rescaled to match
+ *
+ *  query (pointer): n x d matrix of queries
+ *  key (pointer): m x d matrix of keys
+ *  value (pointer): m x dv matrix of values
+ *  scale (double): factor applied to the scores, usually 1/sqrt(d)
+ *  result (pointer): n x dv output, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool attentionHead(const Matrix *query, const Matrix *key, const Matrix *value,
+                   double scale, Matrix *result){
+    /* Check compatible dimensions*/
+    if (query->cols != key->cols || key->rows != value->rows){
+        printf("Incompatible dimensions in attention head\n");
+        return false;
+    }
+    /* Enforce dimensions for result matrix */
+    result->rows = query->rows;
+    result->cols = value->cols;
+    double scores[ATTENTION_TILE];
+    int r;
+    int j;
+    int t;
+    int c;
+    for(r = 0; r < query->rows; r++){
+        const double *q_row = query->data + r * query->cols;
+        double *out_row = result->data + r * result->cols;
+        double running_max = -INFINITY;
+        double running_sum = 0;
+        for(c = 0; c < result->cols; c++){
+            out_row[c] = 0;
+        }
+        for(j = 0; j < key->rows; j += ATTENTION_TILE){
+            int tile = key->rows - j < ATTENTION_TILE ? key->rows - j : ATTENTION_TILE;
+            /* Score one tile of keys */
+            double tile_max = -INFINITY;
+            for(t = 0; t < tile; t++){
+                const double *k_row = key->data + (j + t) * key->cols;
+                double dot = 0;
+                for(c = 0; c < key->cols; c++){
+                    dot += q_row[c] * k_row[c];
+                }
+                scores[t] = scale * dot;
+                if(scores[t] > tile_max){
+                    tile_max = scores[t];
+                }
+            }
+            /* Rescale what has been accumulated if the maximum moved */
+            if(tile_max > running_max){
+                double correction = fastExp(running_max - tile_max);
+                running_sum *= correction;
+                for(c = 0; c < result->cols; c++){
+                    out_row[c] *= correction;
+                }
+                running_max = tile_max;
+            }
+            /* Accumulate the weighted values of the tile */
+            for(t = 0; t < tile; t++){
+                double weight = fastExp(scores[t] - running_max);
+                const double *v_row = value->data + (j + t) * value->cols;
+                running_sum += weight;
+                for(c = 0; c < result->cols; c++){
+                    out_row[c] += weight * v_row[c];
+                }
+            }
+        }
+        /* Normalize */
+        if(running_sum > 0){
+            for(c = 0; c < result->cols; c++){
+                out_row[c] /= running_sum;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) attentionHeadsStridedBatched
+ * --------------------
+ * Runs attentionHead over batch_count heads laid out at fixed strides, in the
+ * same fashion as multiplyMatricesStridedBatched
+ * query, key, value and result describe the shape and the first head
+ *
+ *  query (pointer), stride_query (int): first n x d query block and its stride
+ *  key (pointer), stride_key (int): first m x d key block and its stride
+ *  value (pointer), stride_value (int): first m x dv value block and its stride
+ *  scale (double): factor applied to the scores, usually 1/sqrt(d)
+ *  result (pointer), stride_result (int): first n x dv output and its stride
+ *  batch_count (int): number of heads
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool attentionHeadsStridedBatched(const Matrix *query, int stride_query,
+                                  const Matrix *key, int stride_key,
+                                  const Matrix *value, int stride_value,
+                                  double scale, Matrix *result, int stride_result,
+                                  int batch_count){
+    if (batch_count > 1 && stride_result < query->rows * value->cols){
+        printf("Result stride too small in batched attention\n");
+        return false;
+    }
+    int batch;
+    for(batch = 0; batch < batch_count; batch++){
+        /* Views on the current head */
+        Matrix q = {query->rows, query->cols, query->data + (size_t)batch * stride_query};
+        Matrix k = {key->rows, key->cols, key->data + (size_t)batch * stride_key};
+        Matrix v = {value->rows, value->cols, value->data + (size_t)batch * stride_value};
+        Matrix out = {result->rows, result->cols, result->data + (size_t)batch * stride_result};
+        if(!attentionHead(&q, &k, &v, scale, &out)){
+            return false;
+        }
+    }
+    result->rows = query->rows;
+    result->cols = value->cols;
+    return true;
+}
+
+/*
+ * Function: (bool) multiplyMatricesTransposed
+ * --------------------
+ * Multiplies op(A) op(B) where op transposes its operand when asked to,
+ * without building the transposed copy that transposeMatrix would allocate
+ * Runs on the same register tiles as multiplyMatricesEpilogue
+ *
+ *  matrix_a (pointer): a pointer to the left matrix
+ *  transpose_a (bool): whether to use A^T
+ *  matrix_b (pointer): a pointer to the right matrix
+ *  transpose_b (bool): whether to use B^T
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool multiplyMatricesTransposed(const Matrix *matrix_a, bool transpose_a,
+                                const Matrix *matrix_b, bool transpose_b, Matrix *result){
+    int rows = transpose_a ? matrix_a->cols : matrix_a->rows;
+    int inner = transpose_a ? matrix_a->rows : matrix_a->cols;
+    int inner_b = transpose_b ? matrix_b->cols : matrix_b->rows;
+    int cols = transpose_b ? matrix_b->rows : matrix_b->cols;
+    /* Check compatible dimensions*/
+    if (inner != inner_b){
+        printf("Incompatible dimensions in matrix multiplication\n");
+        return false;
+    }
+    /* Strides of op(A) and op(B) */
+    int a_row_stride = transpose_a ? 1 : matrix_a->cols;
+    int a_inner_stride = transpose_a ? matrix_a->cols : 1;
+    int b_inner_stride = transpose_b ? 1 : matrix_b->cols;
+    int b_col_stride = transpose_b ? matrix_b->cols : 1;
+    result->rows = rows;
+    result->cols = cols;
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    int row;
+    int col;
+    int i;
+    int j;
+    for(col = 0; col < cols; col += GEMM_TILE_COLS){
+        int tile_cols = cols - col < GEMM_TILE_COLS ? cols - col : GEMM_TILE_COLS;
+        for(row = 0; row < rows; row += GEMM_TILE_ROWS){
+            int tile_rows = rows - row < GEMM_TILE_ROWS ? rows - row : GEMM_TILE_ROWS;
+            multiplyMicroTile(matrix_a->data + (size_t)row * a_row_stride, a_row_stride, a_inner_stride,
+                              matrix_b->data + (size_t)col * b_col_stride, b_inner_stride, b_col_stride,
+                              inner, tile_rows, tile_cols, tile);
+            for(i = 0; i < tile_rows; i++){
+                for(j = 0; j < tile_cols; j++){
+                    *(result->data + (row + i) * cols + col + j) = tile[i][j];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) hadamardProduct
+ * --------------------
+ * Multiplies two matrices elementwise
+ * Fails if both matrices have different dimensions
+ *
+ *  matrix_a (pointer): a pointer to the first matrix struct
+ *  matrix_b (pointer): a pointer to the second matrix struct
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool hadamardProduct(const Matrix *matrix_a, const Matrix *matrix_b, Matrix *result){
+    /* Check same dimensions*/
+    if(!checkDimensions(matrix_a, matrix_b)){
+        printf("Mismatch in the dimensions in Hadamard product\n");
+        return false;
+    }
+    result->rows = matrix_a->rows;
+    result->cols = matrix_a->cols;
+    /* Flattened so the loop vectorizes */
+    int i;
+    for(i = 0; i < matrix_a->rows * matrix_a->cols; i++){
+        *(result->data + i) = *(matrix_a->data + i) * *(matrix_b->data + i);
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) outerProduct
+ * --------------------
+ * Computes u v^T for two vectors
+ * Vectors can be given either as rows or as columns, only their number of
+ * elements matters
+ *
+ *  vector_u (pointer): a pointer to the first vector (length m)
+ *  vector_v (pointer): a pointer to the second vector (length n)
+ *  result (pointer): the m x n result, data must be preallocated
+ *
+ *  Returns true if successful
+*/
+bool outerProduct(const Matrix *vector_u, const Matrix *vector_v, Matrix *result){
+    int m = vector_u->rows * vector_u->cols;
+    int n = vector_v->rows * vector_v->cols;
+    result->rows = m;
+    result->cols = n;
+    int r;
+    int c;
+    for(r = 0; r < m; r++){
+        double u_r = *(vector_u->data + r);
+        double *out_row = result->data + r * n;
+        for(c = 0; c < n; c++){
+            out_row[c] = u_r * *(vector_v->data + c);
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) kroneckerProduct
+ * --------------------
+ * Writes the Kronecker product of A (m x n) and B (p x q), a (m p) x (n q)
+ * matrix made of the blocks A_{i,j} B
+ * Every output row is a run of scaled copies of one row of B. Long rows of
+ * B are cut into KRONECKER_BLOCK wide pieces that are reused from cache for
+ * all n copies before moving on
+ *
+ *  matrix_a (pointer): a pointer to the left factor
+ *  matrix_b (pointer): a pointer to the right factor
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful
+*/
+bool kroneckerProduct(const Matrix *matrix_a, const Matrix *matrix_b, Matrix *result){
+    int p = matrix_b->rows;
+    int q = matrix_b->cols;
+    result->rows = matrix_a->rows * p;
+    result->cols = matrix_a->cols * q;
+    int i;
+    int j;
+    int k;
+    int l;
+    int block;
+    for(i = 0; i < matrix_a->rows; i++){
+        const double *a_row = matrix_a->data + i * matrix_a->cols;
+        for(k = 0; k < p; k++){
+            const double *b_row = matrix_b->data + k * q;
+            double *out_row = result->data + (size_t)(i * p + k) * result->cols;
+            for(block = 0; block < q; block += KRONECKER_BLOCK){
+                int block_end = q - block < KRONECKER_BLOCK ? q : block + KRONECKER_BLOCK;
+                for(j = 0; j < matrix_a->cols; j++){
+                    double a_ij = a_row[j];
+                    double *out = out_row + j * q;
+                    for(l = block; l < block_end; l++){
+                        out[l] = a_ij * b_row[l];
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) kroneckerMatVec
+ * --------------------
+ * Computes (A kron B) x without building the Kronecker product
+ * With the row-major storage of this file, reading x as an n x q matrix X
+ * gives (A kron B) x = A X B^T read back row by row, which is the
+ * column-major identity (A kron B) vec(X) = vec(B X A^T) in this layout
+ * Cost is O(n q p + m n p) instead of O(m n p q)
+ *
+ *  matrix_a (pointer): the m x n left factor
+ *  matrix_b (pointer): the p x q right factor
+ *  vector_x (pointer): vector with n q elements
+ *  result (pointer): vector with m p elements, data must be preallocated;
+ *                    any shape holding m p elements is accepted and kept
+ *
+ *  Returns true if successful, false on dimension mismatch or allocation failure
+*/
+bool kroneckerMatVec(const Matrix *matrix_a, const Matrix *matrix_b,
+                     const Matrix *vector_x, Matrix *result){
+    int n = matrix_a->cols;
+    int q = matrix_b->cols;
+    if(vector_x->rows * vector_x->cols != n * q ||
+       result->rows * result->cols != matrix_a->rows * matrix_b->rows){
+        printf("Incompatible dimensions in Kronecker matrix-vector product\n");
+        return false;
+    }
+    /* Workspace for X B^T */
+    Matrix workspace = {n, matrix_b->rows, (double *)malloc((size_t)n * matrix_b->rows * sizeof(double))};
+    if(workspace.data == NULL){
+        printf("Memory allocation failed for Kronecker workspace.\n");
+        return false;
+    }
+    Matrix x_view = {n, q, vector_x->data};
+    Matrix y_view = {matrix_a->rows, matrix_b->rows, result->data};
+    multiplyMatricesTransposed(&x_view, false, matrix_b, true, &workspace);
+    multiplyMatricesTransposed(matrix_a, false, &workspace, false, &y_view);
+    free(workspace.data);
+    return true;
+}
+
+/*
+ * Function: (bool) symmetricRankKUpdate
+ * --------------------
+ * Computes result = beta * result + A^T A for an n x k matrix A
+ * Only register tiles touching the upper triangle are computed, the lower
+ * triangle is mirrored afterwards, so this costs about half of
+ * multiplyMatricesTransposed(A, true, A, false, ...)
+ *
+ *  matrix (pointer): a pointer to A
+ *  beta (double): scale of the previous contents, 0 to overwrite
+ *  result (pointer): the k x k result, data must be preallocated
+ *
+ *  Returns true if successful
+*/
+bool symmetricRankKUpdate(const Matrix *matrix, double beta, Matrix *result){
+    int n = matrix->cols;
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    int row;
+    int col;
+    int i;
+    int j;
+    result->rows = n;
+    result->cols = n;
+    for(col = 0; col < n; col += GEMM_TILE_COLS){
+        int tile_cols = n - col < GEMM_TILE_COLS ? n - col : GEMM_TILE_COLS;
+        /* Stop at the last row tile that reaches the upper triangle */
+        for(row = 0; row < col + tile_cols; row += GEMM_TILE_ROWS){
+            int tile_rows = n - row < GEMM_TILE_ROWS ? n - row : GEMM_TILE_ROWS;
+            multiplyMicroTile(matrix->data + row, 1, matrix->cols,
+                              matrix->data + col, matrix->cols, 1,
+                              matrix->rows, tile_rows, tile_cols, tile);
+            for(i = 0; i < tile_rows; i++){
+                for(j = 0; j < tile_cols; j++){
+                    if(row + i <= col + j){
+                        double *out = result->data + (row + i) * n + col + j;
+                        *out = (beta == 0 ? 0.0 : beta * *out) + tile[i][j];
+                    }
+                }
+            }
+        }
+    }
+    /* Mirror the upper triangle */
+    for(i = 0; i < n; i++){
+        for(j = 0; j < i; j++){
+            *(result->data + i * n + j) = *(result->data + j * n + i);
+        }
+    }
+    return true;
+}
+
+/*
+ * Struct: StatisticsTask
+ * --------------------
+ * The run of row blocks summarized by one thread of columnStatistics
+ *
+ *  matrix (pointer): the data, one observation per row
+ *  first_block (int): first block of STATISTICS_BLOCK_ROWS rows
+ *  end_block (int): one past the last block
+ *  partials (pointer): per block, cols means followed by cols sums of
+ *                      squared deviations, for every block of the matrix
+*/
+typedef struct{
+    const Matrix *matrix;
+    int first_block;
+    int end_block;
+    double *partials;
+} StatisticsTask;
+
+/*
+ * Function: (void *) runStatisticsTask
+ * --------------------
+ * Thread entry point of columnStatistics, computes the mean and sum of
+ * squared deviations of each of its blocks while the block is in cache
+ *
+ *  argument (pointer): the StatisticsTask
+ *
+ *  Returns NULL
+*/
+void *runStatisticsTask(void *argument){
+    StatisticsTask *task = (StatisticsTask *)argument;
+    const Matrix *matrix = task->matrix;
+    int cols = matrix->cols;
+    int block;
+    int r;
+    int c;
+    for(block = task->first_block; block < task->end_block; block++){
+        int first_row = block * STATISTICS_BLOCK_ROWS;
+        int block_rows = matrix->rows - first_row < STATISTICS_BLOCK_ROWS ?
+                         matrix->rows - first_row : STATISTICS_BLOCK_ROWS;
+        const double *data = matrix->data + (size_t)first_row * cols;
+        double *block_mean = task->partials + (size_t)block * 2 * cols;
+        double *block_m2 = block_mean + cols;
+        /* Rows walked contiguously */
+        for(c = 0; c < cols; c++){
+            block_mean[c] = 0;
+            block_m2[c] = 0;
+        }
+        for(r = 0; r < block_rows; r++){
+            for(c = 0; c < cols; c++){
+                block_mean[c] += data[r * cols + c];
+            }
+        }
+        for(c = 0; c < cols; c++){
+            block_mean[c] /= block_rows;
+        }
+        for(r = 0; r < block_rows; r++){
+            for(c = 0; c < cols; c++){
+                double deviation = data[r * cols + c] - block_mean[c];
+                block_m2[c] += deviation * deviation;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) columnStatistics
+ * --------------------
+ * Computes the mean and sample variance of every column in one pass
+ * Rows are consumed STATISTICS_BLOCK_ROWS at a time: the block's own mean
+ * and sum of squared deviations are computed while it is in cache, then
+ * merged into the running totals with the pairwise update of Chan et al.,
+ * the blocked form of Welford's algorithm. The threads summarize contiguous
+ * runs of blocks into per block storage and the calling thread merges the
+ * blocks in row order, so the result is the same for any thread count
+ *
+ *  matrix (pointer): a pointer to the data, one observation per row
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  means (pointer): receives one mean per column
+ *  variances (pointer): receives one sample variance per column, or NULL
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool columnStatistics(const Matrix *matrix, int thread_count, double *means, double *variances){
+    int cols = matrix->cols;
+    int blocks = (matrix->rows + STATISTICS_BLOCK_ROWS - 1) / STATISTICS_BLOCK_ROWS;
+    if(thread_count > blocks){
+        thread_count = blocks;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    double *partials = (double *)malloc(((size_t)blocks * 2 + 1) * cols * sizeof(double) + sizeof(double));
+    StatisticsTask *tasks = (StatisticsTask *)malloc(sizeof(StatisticsTask) * (size_t)thread_count);
+    if(partials == NULL || tasks == NULL){
+        printf("Memory allocation failed for column statistics.\n");
+        free(partials);
+        free(tasks);
+        return false;
+    }
+    double *m2 = partials + (size_t)blocks * 2 * cols;
+    int count = 0;
+    int block;
+    int t;
+    int c;
+    for(t = 0; t < thread_count; t++){
+        StatisticsTask task = {matrix, blocks * t / thread_count, blocks * (t + 1) / thread_count, partials};
+        tasks[t] = task;
+    }
+    runParallel(runStatisticsTask, tasks, sizeof(StatisticsTask), thread_count);
+    for(c = 0; c < cols; c++){
+        means[c] = 0;
+        m2[c] = 0;
+    }
+    for(block = 0; block < blocks; block++){
+        int first_row = block * STATISTICS_BLOCK_ROWS;
+        int block_rows = matrix->rows - first_row < STATISTICS_BLOCK_ROWS ?
+                         matrix->rows - first_row : STATISTICS_BLOCK_ROWS;
+        const double *block_mean = partials + (size_t)block * 2 * cols;
+        const double *block_m2 = block_mean + cols;
+        /* Merge into the running totals */
+        int merged = count + block_rows;
+        for(c = 0; c < cols; c++){
+            double delta = block_mean[c] - means[c];
+            means[c] += delta * block_rows / merged;
+            m2[c] += block_m2[c] + delta * delta * ((double)count * block_rows / merged);
+        }
+        count = merged;
+    }
+    if(variances != NULL){
+        for(c = 0; c < cols; c++){
+            variances[c] = count > 1 ? m2[c] / (count - 1) : 0.0;
+        }
+    }
+    free(partials);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Struct: CovarianceTask
+ * --------------------
+ * One block of rows folded by a thread of covarianceMatrix
+ *
+ *  matrix (pointer): the data, one observation per row
+ *  block (int): index of the block of STATISTICS_BLOCK_ROWS rows
+ *  mean (pointer): receives the cols means of the block
+ *  centered (pointer): STATISTICS_BLOCK_ROWS x cols scratch
+ *  comoment (pointer): receives the cols x cols co-moments of the block
+*/
+typedef struct{
+    const Matrix *matrix;
+    int block;
+    double *mean;
+    double *centered;
+    double *comoment;
+} CovarianceTask;
+
+/*
+ * Function: (void *) runCovarianceTask
+ * --------------------
+ * Thread entry point of covarianceMatrix, centers its block on its own
+ * mean and forms the co-moments with symmetricRankKUpdate
+ *
+ *  argument (pointer): the CovarianceTask
+ *
+ *  Returns NULL
+*/
+void *runCovarianceTask(void *argument){
+    CovarianceTask *task = (CovarianceTask *)argument;
+    const Matrix *matrix = task->matrix;
+    int cols = matrix->cols;
+    int first_row = task->block * STATISTICS_BLOCK_ROWS;
+    int block_rows = matrix->rows - first_row < STATISTICS_BLOCK_ROWS ?
+                     matrix->rows - first_row : STATISTICS_BLOCK_ROWS;
+    const double *data = matrix->data + (size_t)first_row * cols;
+    int r;
+    int c;
+    for(c = 0; c < cols; c++){
+        task->mean[c] = 0;
+    }
+    for(r = 0; r < block_rows; r++){
+        for(c = 0; c < cols; c++){
+            task->mean[c] += data[r * cols + c];
+        }
+    }
+    for(c = 0; c < cols; c++){
+        task->mean[c] /= block_rows;
+    }
+    for(r = 0; r < block_rows; r++){
+        for(c = 0; c < cols; c++){
+            task->centered[r * cols + c] = data[r * cols + c] - task->mean[c];
+        }
+    }
+    Matrix centered_block = {block_rows, cols, task->centered};
+    Matrix comoment = {cols, cols, task->comoment};
+    symmetricRankKUpdate(&centered_block, 0.0, &comoment);
+    return NULL;
+}
+
+/*
+ * Function: (bool) covarianceMatrix
+ * --------------------
+ * Builds the sample covariance (or correlation) matrix of the columns of a
+ * data matrix in a single pass over the data
+ * Each block of rows is centered on its own mean into a small buffer and
+ * folded in with symmetricRankKUpdate. The block co-moments are merged with
+ * the running ones through the rank-one correction
+ * C += C_block + (n n_block / (n + n_block)) d d^T, d = mean_block - mean
+ * which replaces the separate mean, centering, transpose and multiply passes
+ * Blocks go to the threads thread_count at a time, each into its own slot,
+ * and the calling thread merges every round in row order, so the result is
+ * the same for any thread count and the scratch stays thread_count blocks
+ *
+ *  matrix (pointer): a pointer to the data, one observation per row
+ *  correlation (bool): whether to normalize the result to correlations
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  result (pointer): cols x cols result, data must be preallocated
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool covarianceMatrix(const Matrix *matrix, bool correlation, int thread_count, Matrix *result){
+    int cols = matrix->cols;
+    int blocks = (matrix->rows + STATISTICS_BLOCK_ROWS - 1) / STATISTICS_BLOCK_ROWS;
+    if(thread_count > blocks){
+        thread_count = blocks;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    size_t slot = (size_t)cols * (1 + STATISTICS_BLOCK_ROWS + (size_t)cols);
+    double *means = (double *)calloc((size_t)cols + 1, sizeof(double));
+    double *scratch = (double *)malloc(slot * thread_count * sizeof(double) + sizeof(double));
+    CovarianceTask *tasks = (CovarianceTask *)malloc(sizeof(CovarianceTask) * (size_t)thread_count);
+    if(means == NULL || scratch == NULL || tasks == NULL){
+        printf("Memory allocation failed for covariance matrix.\n");
+        free(means);
+        free(scratch);
+        free(tasks);
+        return false;
+    }
+    int count = 0;
+    int round;
+    int t;
+    int r;
+    int c;
+    int i;
+    result->rows = cols;
+    result->cols = cols;
+    for(i = 0; i < cols * cols; i++){
+        *(result->data + i) = 0;
+    }
+    for(t = 0; t < thread_count; t++){
+        double *base = scratch + slot * t;
+        CovarianceTask task = {matrix, 0, base, base + cols, base + cols + (size_t)STATISTICS_BLOCK_ROWS * cols};
+        tasks[t] = task;
+    }
+    for(round = 0; round < blocks; round += thread_count){
+        int round_tasks = blocks - round < thread_count ? blocks - round : thread_count;
+        for(t = 0; t < round_tasks; t++){
+            tasks[t].block = round + t;
+        }
+        runParallel(runCovarianceTask, tasks, sizeof(CovarianceTask), round_tasks);
+        for(t = 0; t < round_tasks; t++){
+            int first_row = (round + t) * STATISTICS_BLOCK_ROWS;
+            int block_rows = matrix->rows - first_row < STATISTICS_BLOCK_ROWS ?
+                             matrix->rows - first_row : STATISTICS_BLOCK_ROWS;
+            const double *block_mean = tasks[t].mean;
+            const double *block_comoment = tasks[t].comoment;
+            /* Merge with the running co-moments */
+            int merged = count + block_rows;
+            double weight = (double)count * block_rows / merged;
+            for(r = 0; r < cols; r++){
+                double delta_r = block_mean[r] - means[r];
+                for(c = 0; c < cols; c++){
+                    double delta_c = block_mean[c] - means[c];
+                    *(result->data + r * cols + c) += block_comoment[r * cols + c] + weight * delta_r * delta_c;
+                }
+            }
+            for(c = 0; c < cols; c++){
+                means[c] += (block_mean[c] - means[c]) * block_rows / merged;
+            }
+            count = merged;
+        }
+    }
+    /* Sample covariance */
+    for(i = 0; i < cols * cols; i++){
+        *(result->data + i) = count > 1 ? *(result->data + i) / (count - 1) : 0.0;
+    }
+    if(correlation){
+        /* Reuse means as the standard deviations */
+        for(c = 0; c < cols; c++){
+            means[c] = fastSqrt(*(result->data + c * cols + c));
+        }
+        for(r = 0; r < cols; r++){
+            for(c = 0; c < cols; c++){
+                double scale = means[r] * means[c];
+                *(result->data + r * cols + c) = scale > 0 ? *(result->data + r * cols + c) / scale : 0.0;
+            }
+        }
+    }
+    free(means);
+    free(scratch);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Function: (bool) standardizeColumns
+ * --------------------
+ * Rescales every column to zero mean and unit sample variance
+ * Columns with zero variance are set to zero
+ * matrix and result may be the same struct to work in place
+ *
+ *  matrix (pointer): a pointer to the data, one observation per row
+ *  thread_count (int): threads used by columnStatistics
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool standardizeColumns(const Matrix *matrix, int thread_count, Matrix *result){
+    int cols = matrix->cols;
+    double *means = (double *)malloc(2 * (size_t)cols * sizeof(double));
+    if(means == NULL){
+        printf("Memory allocation failed for standardization.\n");
+        return false;
+    }
+    double *scales = means + cols;
+    if(!columnStatistics(matrix, thread_count, means, scales)){
+        free(means);
+        return false;
+    }
+    int r;
+    int c;
+    for(c = 0; c < cols; c++){
+        scales[c] = scales[c] > 0 ? 1.0 / fastSqrt(scales[c]) : 0.0;
+    }
+    result->rows = matrix->rows;
+    result->cols = cols;
+    for(r = 0; r < matrix->rows; r++){
+        for(c = 0; c < cols; c++){
+            *(result->data + r * cols + c) = (*(matrix->data + r * cols + c) - means[c]) * scales[c];
+        }
+    }
+    free(means);
+    return true;
+}
+
+/*
+ * Struct: RandomState
+ * --------------------
+ * State of the xoshiro256** generator used by the randomized routines
+ * The same seed always reproduces the same stream
+*/
+typedef struct{
+    uint64_t state[4];
+} RandomState;
+
+/*
+ * Enum: SketchType
+ * --------------------
+ * Random projection applied by sketchMatrix
+*/
+typedef enum {
+    SKETCH_GAUSSIAN,
+    SKETCH_SRHT,
+    SKETCH_COUNTSKETCH
+} SketchType;
+
+/*
+ * Function: (void) seedRandom
+ * --------------------
+ * Initializes a generator from a 64 bit seed by running splitmix64, so that
+ * nearby seeds still give unrelated streams
+ *
+ *  rng (pointer): the generator
+ *  seed (uint64_t): the seed
+*/
+void seedRandom(RandomState *rng, uint64_t seed){
+    int i;
+    for(i = 0; i < 4; i++){
+        seed += 0x9e3779b97f4a7c15ULL;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rng->state[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * Function: (uint64_t) nextRandom
+ * --------------------
+ * Returns the next 64 random bits (xoshiro256**)
+ *
+ *  rng (pointer): the generator
+*/
+uint64_t nextRandom(RandomState *rng){
+    uint64_t *s = rng->state;
+    uint64_t product = s[1] * 5;
+    uint64_t result = ((product << 7) | (product >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+/*
+ * Function: (double) randomUniform
+ * --------------------
+ * Returns a uniform double in [0, 1) built from the top 53 random bits
+ *
+ *  rng (pointer): the generator
+*/
+double randomUniform(RandomState *rng){
+    return (nextRandom(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * Function: (void) fillGaussian
+ * --------------------
+ * Fills an array with independent standard normal samples
+ * Uses the Marsaglia polar method so each accepted pair only needs the
+ * polynomial log and square root, no trigonometric calls
+ *
+ *  rng (pointer): the generator
+ *  values (pointer): the array to fill
+ *  count (int): number of samples
+*/
+void fillGaussian(RandomState *rng, double *values, int count){
+    int i = 0;
+    while(i < count){
+        double u = 2.0 * randomUniform(rng) - 1.0;
+        double v = 2.0 * randomUniform(rng) - 1.0;
+        double s = u * u + v * v;
+        if(s >= 1.0 || s == 0.0){
+            continue;
+        }
+        double factor = fastSqrt(-2.0 * fastLog(s) / s);
+        values[i++] = u * factor;
+        if(i < count){
+            values[i++] = v * factor;
+        }
+    }
+}
+
+/*
+ * Function: (void) fastWalshHadamard
+ * --------------------
+ * Applies the unnormalized Walsh-Hadamard transform in place along the rows
+ * of a length x width block, i.e. to every column at once
+ * Each butterfly combines two whole rows so the inner loop is contiguous
+ *
+ *  data (pointer): the block, row-major
+ *  length (int): number of rows, must be a power of two
+ *  width (int): number of columns
+*/
+void fastWalshHadamard(double *data, int length, int width){
+    int half;
+    int start;
+    int i;
+    int c;
+    for(half = 1; half < length; half *= 2){
+        for(start = 0; start < length; start += 2 * half){
+            for(i = start; i < start + half; i++){
+                double *top = data + (size_t)i * width;
+                double *bottom = data + (size_t)(i + half) * width;
+                for(c = 0; c < width; c++){
+                    double x = top[c];
+                    double y = bottom[c];
+                    top[c] = x + y;
+                    bottom[c] = x - y;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Function: (bool) sketchMatrix
+ * --------------------
+ * Computes S A for a random sketch_rows x rows matrix S, compressing the rows
+ * of A while approximately preserving norms (E[S^T S] = I)
+ *
+ * SKETCH_GAUSSIAN: S has N(0, 1/sketch_rows) entries, applied with the tiled GEMM
+ * SKETCH_SRHT: rows of A get random signs, are zero padded to a power of two,
+ *              mixed by fastWalshHadamard and sketch_rows of them are sampled
+ * SKETCH_COUNTSKETCH: every row of A is added with a random sign to one
+ *                     random output row, O(rows * cols)
+ *
+ *  matrix (pointer): a pointer to A
+ *  type (SketchType): the kind of sketch
+ *  sketch_rows (int): number of rows of the result
+ *  seed (uint64_t): seed of the random generator, for reproducibility
+ *  result (pointer): sketch_rows x cols result, data must be preallocated
+ *
+ *  Returns true if successful, false on bad arguments or allocation failure
+*/
+bool sketchMatrix(const Matrix *matrix, SketchType type, int sketch_rows, uint64_t seed, Matrix *result){
+    if(sketch_rows <= 0){
+        printf("Sketch must have at least one row\n");
+        return false;
+    }
+    RandomState rng;
+    seedRandom(&rng, seed);
+    int rows = matrix->rows;
+    int cols = matrix->cols;
+    int r;
+    int c;
+    result->rows = sketch_rows;
+    result->cols = cols;
+    if(type == SKETCH_GAUSSIAN){
+        Matrix sketch = {sketch_rows, rows, (double *)malloc((size_t)sketch_rows * rows * sizeof(double))};
+        if(sketch.data == NULL){
+            printf("Memory allocation failed for Gaussian sketch.\n");
+            return false;
+        }
+        fillGaussian(&rng, sketch.data, sketch_rows * rows);
+        GemmEpilogue scaling = {1.0 / fastSqrt(sketch_rows), NULL, NULL, ELEMENTWISE_NONE,
+                                false, 0.0, 0.0, NULL, NULL};
+        multiplyMatricesEpilogue(&sketch, matrix, &scaling, result);
+        free(sketch.data);
+    } else if(type == SKETCH_SRHT){
+        int padded = 1;
+        while(padded < rows){
+            padded *= 2;
+        }
+        if(sketch_rows > padded){
+            printf("SRHT sketch cannot have more rows than the padded input\n");
+            return false;
+        }
+        double *mixed = (double *)calloc((size_t)padded * cols, sizeof(double));
+        int *order = (int *)malloc((size_t)padded * sizeof(int));
+        if(mixed == NULL || order == NULL){
+            printf("Memory allocation failed for SRHT sketch.\n");
+            free(mixed);
+            free(order);
+            return false;
+        }
+        /* Random signs */
+        for(r = 0; r < rows; r++){
+            double sign = (nextRandom(&rng) >> 63) ? -1.0 : 1.0;
+            for(c = 0; c < cols; c++){
+                mixed[(size_t)r * cols + c] = sign * *(matrix->data + (size_t)r * cols + c);
+            }
+        }
+        fastWalshHadamard(mixed, padded, cols);
+        /* Sample rows without replacement with a partial Fisher-Yates shuffle */
+        for(r = 0; r < padded; r++){
+            order[r] = r;
+        }
+        double scale = 1.0 / fastSqrt(sketch_rows);
+        for(r = 0; r < sketch_rows; r++){
+            int pick = r + (int)(randomUniform(&rng) * (padded - r));
+            int swap = order[r];
+            order[r] = order[pick];
+            order[pick] = swap;
+            for(c = 0; c < cols; c++){
+                *(result->data + (size_t)r * cols + c) = scale * mixed[(size_t)order[r] * cols + c];
+            }
+        }
+        free(mixed);
+        free(order);
+    } else {
+        for(r = 0; r < sketch_rows * cols; r++){
+            *(result->data + r) = 0;
+        }
+        for(r = 0; r < rows; r++){
+            uint64_t bits = nextRandom(&rng);
+            int bucket = (int)((bits >> 11) * (1.0 / 9007199254740992.0) * sketch_rows);
+            double sign = (bits & 1) ? -1.0 : 1.0;
+            double *out = result->data + (size_t)bucket * cols;
+            const double *in = matrix->data + (size_t)r * cols;
+            for(c = 0; c < cols; c++){
+                out[c] += sign * in[c];
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Enum: DistanceMetric
+ * --------------------
+ * Distance computed between rows by the pairwise distance kernels
+ * DISTANCE_COSINE is 1 - cos(angle), zero rows are treated as orthogonal
+*/
+typedef enum {
+    DISTANCE_SQUARED_EUCLIDEAN,
+    DISTANCE_EUCLIDEAN,
+    DISTANCE_COSINE
+} DistanceMetric;
+
+/*
+ * Callback: DistanceBlockCallback
+ * --------------------
+ * Receives one block of a distance matrix from pairwiseDistancesTiled
+ * block holds block_rows x block_cols distances, block_stride doubles apart
+ * row by row. row and col locate the block in the full distance matrix.
+ * The block is only valid during the call
+*/
+typedef void (*DistanceBlockCallback)(const double *block, int block_stride, int row, int col,
+                                      int block_rows, int block_cols, void *context);
+
+/*
+ * Function: (void) rowSquaredNorms
+ * --------------------
+ * Computes the squared Euclidean norm of every row of a matrix
+ *
+ *  matrix (pointer): a pointer to the matrix
+ *  norms (pointer): receives one value per row
+*/
+void rowSquaredNorms(const Matrix *matrix, double *norms){
+    int r;
+    int c;
+    for(r = 0; r < matrix->rows; r++){
+        const double *row = matrix->data + (size_t)r * matrix->cols;
+        double total = 0;
+        for(c = 0; c < matrix->cols; c++){
+            total += row[c] * row[c];
+        }
+        norms[r] = total;
+    }
+}
+
+/*
+ * Function: (bool) pairwiseDistancesTiled
+ * --------------------
+ * Streams the distances between every row of X and every row of Y to a
+ * callback, one block_rows x block_cols block at a time, so memory stays at
+ * one block no matter how large the full distance matrix is
+ * Distances come from the expansion ||x||^2 + ||y||^2 - 2 x.y: the dot
+ * products are computed on the GEMM register tiles against Y^T and the norm
+ * terms are added to each tile before it leaves registers
+ *
+ *  matrix_x (pointer): n x d matrix of points
+ *  matrix_y (pointer): m x d matrix of points
+ *  metric (DistanceMetric): the distance to compute
+ *  block_rows, block_cols (int): block size, 0 for DISTANCE_BLOCK_ROWS/COLS
+ *  callback (DistanceBlockCallback): receives every block
+ *  context (pointer): passed through to the callback
+ *
+ *  Returns true if successful, false on dimension mismatch or allocation failure
+*/
+bool pairwiseDistancesTiled(const Matrix *matrix_x, const Matrix *matrix_y, DistanceMetric metric,
+                            int block_rows, int block_cols,
+                            DistanceBlockCallback callback, void *context){
+    if(matrix_x->cols != matrix_y->cols){
+        printf("Points must have the same dimension in pairwise distances\n");
+        return false;
+    }
+    if(block_rows <= 0){
+        block_rows = DISTANCE_BLOCK_ROWS;
+    }
+    if(block_cols <= 0){
+        block_cols = DISTANCE_BLOCK_COLS;
+    }
+    int n = matrix_x->rows;
+    int m = matrix_y->rows;
+    int d = matrix_x->cols;
+    double *norms_x = (double *)malloc(((size_t)n + m) * sizeof(double));
+    double *block = (double *)malloc((size_t)block_rows * block_cols * sizeof(double));
+    if(norms_x == NULL || block == NULL){
+        printf("Memory allocation failed for pairwise distances.\n");
+        free(norms_x);
+        free(block);
+        return false;
+    }
+    double *norms_y = norms_x + n;
+    rowSquaredNorms(matrix_x, norms_x);
+    rowSquaredNorms(matrix_y, norms_y);
+    int i;
+    if(metric == DISTANCE_COSINE){
+        /* Store inverse norms instead */
+        for(i = 0; i < n + m; i++){
+            norms_x[i] = norms_x[i] > 0 ? 1.0 / fastSqrt(norms_x[i]) : 0.0;
+        }
+    }
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    int block_row;
+    int block_col;
+    int row;
+    int col;
+    int j;
+    for(block_row = 0; block_row < n; block_row += block_rows){
+        int rows_here = n - block_row < block_rows ? n - block_row : block_rows;
+        for(block_col = 0; block_col < m; block_col += block_cols){
+            int cols_here = m - block_col < block_cols ? m - block_col : block_cols;
+            for(col = 0; col < cols_here; col += GEMM_TILE_COLS){
+                int tile_cols = cols_here - col < GEMM_TILE_COLS ? cols_here - col : GEMM_TILE_COLS;
+                int y_row = block_col + col;
+                for(row = 0; row < rows_here; row += GEMM_TILE_ROWS){
+                    int tile_rows = rows_here - row < GEMM_TILE_ROWS ? rows_here - row : GEMM_TILE_ROWS;
+                    int x_row = block_row + row;
+                    /* X Y^T: column c of Y^T is row c of Y */
+                    multiplyMicroTile(matrix_x->data + (size_t)x_row * d, d, 1,
+                                      matrix_y->data + (size_t)y_row * d, 1, d,
+                                      d, tile_rows, tile_cols, tile);
+                    /* Fused norm terms */
+                    for(i = 0; i < tile_rows; i++){
+                        double *out = block + (size_t)(row + i) * cols_here + col;
+                        double norm_x = norms_x[x_row + i];
+                        for(j = 0; j < tile_cols; j++){
+                            double value;
+                            if(metric == DISTANCE_COSINE){
+                                value = 1.0 - tile[i][j] * norm_x * norms_y[y_row + j];
+                            } else {
+                                value = norm_x + norms_y[y_row + j] - 2.0 * tile[i][j];
+                                value = value > 0 ? value : 0.0;
+                            }
+                            out[j] = value;
+                        }
+                        if(metric == DISTANCE_EUCLIDEAN){
+                            applyElementwiseRow(out, out, tile_cols, ELEMENTWISE_SQRT);
+                        }
+                    }
+                }
+            }
+            callback(block, cols_here, block_row, block_col, rows_here, cols_here, context);
+        }
+    }
+    free(norms_x);
+    free(block);
+    return true;
+}
+
+/*
+ * Function: (void) copyDistanceBlock
+ * --------------------
+ * DistanceBlockCallback that copies each block into a full Matrix
+ * passed as the context
+*/
+void copyDistanceBlock(const double *block, int block_stride, int row, int col,
+                       int block_rows, int block_cols, void *context){
+    Matrix *result = (Matrix *)context;
+    int i;
+    for(i = 0; i < block_rows; i++){
+        memcpy(result->data + (size_t)(row + i) * result->cols + col,
+               block + (size_t)i * block_stride, block_cols * sizeof(double));
+    }
+}
+
+/*
+ * Function: (bool) pairwiseDistances
+ * --------------------
+ * Computes the full n x m matrix of distances between the rows of X and Y
+ * Use pairwiseDistancesTiled when the full matrix does not fit in memory
+ *
+ *  matrix_x (pointer): n x d matrix of points
+ *  matrix_y (pointer): m x d matrix of points
+ *  metric (DistanceMetric): the distance to compute
+ *  result (pointer): n x m result, data must be preallocated
+ *
+ *  Returns true if successful, false on dimension mismatch or allocation failure
+*/
+bool pairwiseDistances(const Matrix *matrix_x, const Matrix *matrix_y, DistanceMetric metric, Matrix *result){
+    result->rows = matrix_x->rows;
+    result->cols = matrix_y->rows;
+    return pairwiseDistancesTiled(matrix_x, matrix_y, metric, 0, 0, copyDistanceBlock, result);
+}
+
+/*
+ * Struct: KnnHeaps
+ * --------------------
+ * Per-query bounded max-heaps used by knnSearch while distance blocks
+ * stream in. Query r owns slots r * k .. r * k + k - 1 of both arrays
+ *
+ *  k (int): number of neighbors kept per query
+ *  indices (pointer): neighbor indices
+ *  distances (pointer): neighbor distances, the root is the worst kept one
+ *  counts (pointer): number of filled slots per query
+*/
+typedef struct{
+    int k;
+    int *indices;
+    double *distances;
+    int *counts;
+} KnnHeaps;
+
+/*
+ * Function: (void) siftDownHeap
+ * --------------------
+ * Restores the max-heap property below position start of a heap of size
+ * count, moving indices together with their distances
+ *
+ *  distances (pointer): heap keys
+ *  indices (pointer): values attached to the keys
+ *  start (int): position to sift down from
+ *  count (int): heap size
+*/
+void siftDownHeap(double *distances, int *indices, int start, int count){
+    int parent = start;
+    while(2 * parent + 1 < count){
+        int child = 2 * parent + 1;
+        if(child + 1 < count && distances[child + 1] > distances[child]){
+            child++;
+        }
+        if(distances[child] <= distances[parent]){
+            break;
+        }
+        double swap_distance = distances[parent];
+        int swap_index = indices[parent];
+        distances[parent] = distances[child];
+        indices[parent] = indices[child];
+        distances[child] = swap_distance;
+        indices[child] = swap_index;
+        parent = child;
+    }
+}
+
+/*
+ * Function: (void) collectNearest
+ * --------------------
+ * DistanceBlockCallback feeding a block of distances into the KnnHeaps
+ * passed as the context
+ * Each row of the block is first compared against the current worst kept
+ * distance in a tight loop, only candidates that beat it touch the heap
+*/
+void collectNearest(const double *block, int block_stride, int row, int col,
+                    int block_rows, int block_cols, void *context){
+    KnnHeaps *heaps = (KnnHeaps *)context;
+    int k = heaps->k;
+    int i;
+    int j;
+    for(i = 0; i < block_rows; i++){
+        const double *values = block + (size_t)i * block_stride;
+        double *distances = heaps->distances + (size_t)(row + i) * k;
+        int *indices = heaps->indices + (size_t)(row + i) * k;
+        int *count = heaps->counts + row + i;
+        double threshold = *count < k ? INFINITY : distances[0];
+        for(j = 0; j < block_cols; j++){
+            if(values[j] >= threshold && *count == k){
+                continue;
+            }
+            if(*count < k){
+                /* Heap not full yet: append and sift up */
+                int position = (*count)++;
+                while(position > 0 && distances[(position - 1) / 2] < values[j]){
+                    distances[position] = distances[(position - 1) / 2];
+                    indices[position] = indices[(position - 1) / 2];
+                    position = (position - 1) / 2;
+                }
+                distances[position] = values[j];
+                indices[position] = col + j;
+            } else {
+                /* Replace the worst kept neighbor */
+                distances[0] = values[j];
+                indices[0] = col + j;
+                siftDownHeap(distances, indices, 0, k);
+            }
+            threshold = *count < k ? INFINITY : distances[0];
+        }
+    }
+}
+
+/*
+ * Function: (bool) knnSearch
+ * --------------------
+ * Finds the k nearest rows of the database for every query row
+ * Distances are produced block by block by pairwiseDistancesTiled and fed
+ * straight into per-query bounded heaps, so the full query x database
+ * distance matrix is never stored. Results are sorted nearest first;
+ * when the database has fewer than k rows the rest is filled with index -1
+ * and an infinite distance
+ *
+ *  queries (pointer): n x d matrix of query points
+ *  database (pointer): m x d matrix of reference points
+ *  k (int): number of neighbors per query
+ *  metric (DistanceMetric): the distance to rank by
+ *  indices (pointer): n x k array receiving database row indices
+ *  distances (pointer): n x k array receiving the distances
+ *
+ *  Returns true if successful, false on bad arguments or allocation failure
+*/
+bool knnSearch(const Matrix *queries, const Matrix *database, int k, DistanceMetric metric,
+               int *indices, double *distances){
+    if(k <= 0){
+        printf("Number of neighbors must be positive\n");
+        return false;
+    }
+    KnnHeaps heaps = {k, indices, distances, (int *)calloc(queries->rows, sizeof(int))};
+    if(heaps.counts == NULL){
+        printf("Memory allocation failed for nearest neighbor search.\n");
+        return false;
+    }
+    if(!pairwiseDistancesTiled(queries, database, metric, 0, 0, collectNearest, &heaps)){
+        free(heaps.counts);
+        return false;
+    }
+    int r;
+    int i;
+    for(r = 0; r < queries->rows; r++){
+        double *row_distances = distances + (size_t)r * k;
+        int *row_indices = indices + (size_t)r * k;
+        int count = heaps.counts[r];
+        /* Heap sort leaves the row in ascending order */
+        for(i = count - 1; i > 0; i--){
+            double swap_distance = row_distances[0];
+            int swap_index = row_indices[0];
+            row_distances[0] = row_distances[i];
+            row_indices[0] = row_indices[i];
+            row_distances[i] = swap_distance;
+            row_indices[i] = swap_index;
+            siftDownHeap(row_distances, row_indices, 0, i);
+        }
+        for(i = count; i < k; i++){
+            row_distances[i] = INFINITY;
+            row_indices[i] = -1;
+        }
+    }
+    free(heaps.counts);
+    return true;
+}
+
+/*
+ * Struct: NearestCentroid
+ * --------------------
+ * Running argmin of every row over the columns of a distance matrix, filled
+ * by assignNearest as blocks stream in
+ *
+ *  assignments (pointer): index of the closest column so far per row
+ *  best (pointer): distance to it, starts at INFINITY
+*/
+typedef struct{
+    int *assignments;
+    double *best;
+} NearestCentroid;
+
+/*
+ * Function: (void) assignNearest
+ * --------------------
+ * DistanceBlockCallback keeping the argmin of every row, with the
+ * NearestCentroid passed as the context
+*/
+void assignNearest(const double *block, int block_stride, int row, int col,
+                   int block_rows, int block_cols, void *context){
+    NearestCentroid *nearest = (NearestCentroid *)context;
+    int i;
+    int j;
+    for(i = 0; i < block_rows; i++){
+        const double *values = block + (size_t)i * block_stride;
+        double best = nearest->best[row + i];
+        int best_index = nearest->assignments[row + i];
+        for(j = 0; j < block_cols; j++){
+            if(values[j] < best){
+                best = values[j];
+                best_index = col + j;
+            }
+        }
+        nearest->best[row + i] = best;
+        nearest->assignments[row + i] = best_index;
+    }
+}
+
+/*
+ * Struct: CentroidTask
+ * --------------------
+ * The rows whose centroid sums one thread of kmeans accumulates
+ *
+ *  data (pointer): n x d matrix of points
+ *  assignments (pointer): the cluster of every point
+ *  k (int): number of clusters
+ *  first_row (int): first row of the task
+ *  end_row (int): one past the last row of the task
+ *  sums (pointer): receives the k x d sums of the task
+ *  block_sums (pointer): k x d scratch for one block
+ *  counts (pointer): receives the k point counts of the task
+*/
+typedef struct{
+    const Matrix *data;
+    const int *assignments;
+    int k;
+    int first_row;
+    int end_row;
+    double *sums;
+    double *block_sums;
+    int *counts;
+} CentroidTask;
+
+/*
+ * Function: (void *) runCentroidTask
+ * --------------------
+ * Thread entry point of the kmeans update. Sums are accumulated per block
+ * of KMEANS_BLOCK_ROWS rows and the block partials added in row order
+ *
+ *  argument (pointer): the CentroidTask
+ *
+ *  Returns NULL
+*/
+void *runCentroidTask(void *argument){
+    CentroidTask *task = (CentroidTask *)argument;
+    int d = task->data->cols;
+    int size = task->k * d;
+    int r;
+    int i;
+    int c;
+    for(i = 0; i < size; i++){
+        task->sums[i] = 0;
+    }
+    for(i = 0; i < task->k; i++){
+        task->counts[i] = 0;
+    }
+    for(r = task->first_row; r < task->end_row; r += KMEANS_BLOCK_ROWS){
+        int block_end = task->end_row - r < KMEANS_BLOCK_ROWS ? task->end_row : r + KMEANS_BLOCK_ROWS;
+        for(i = 0; i < size; i++){
+            task->block_sums[i] = 0;
+        }
+        for(i = r; i < block_end; i++){
+            const double *point = task->data->data + (size_t)i * d;
+            double *sum = task->block_sums + (size_t)task->assignments[i] * d;
+            for(c = 0; c < d; c++){
+                sum[c] += point[c];
+            }
+            task->counts[task->assignments[i]]++;
+        }
+        for(i = 0; i < size; i++){
+            task->sums[i] += task->block_sums[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) kmeans
+ * --------------------
+ * Clusters the rows of a data matrix with Lloyd's algorithm seeded by
+ * k-means++
+ * The assignment step is pairwiseDistancesTiled against the centroids with
+ * the argmin fused into the block callback, so the n x k distance matrix is
+ * never stored. For the update every thread takes a contiguous run of
+ * blocks of KMEANS_BLOCK_ROWS rows into its own centroid sums and counts,
+ * and the thread partials are reduced in task order, which keeps the
+ * result deterministic and the rounding error small. A cluster that ends up
+ * empty takes over the point farthest from its centroid
+ * Stops after max_iterations, when no assignment changes, or when no
+ * centroid moves by more than tolerance. The assignments and inertia
+ * returned always belong to the centroids returned
+ *
+ *  data (pointer): n x d matrix of points
+ *  k (int): number of clusters
+ *  max_iterations (int): iteration limit
+ *  tolerance (double): centroid movement below which the run stops
+ *  seed (uint64_t): seed of the k-means++ sampling
+ *  thread_count (int): threads of the centroid update, 1 for the calling
+ *                      thread
+ *  centroids (pointer): k x d result, data must be preallocated
+ *  assignments (pointer): receives the cluster of every point
+ *  inertia (pointer): receives the sum of squared distances, or NULL
+ *
+ *  Returns true if successful, false on bad arguments or allocation failure,
+ *  including a failed assignment step
+*/
+bool kmeans(const Matrix *data, int k, int max_iterations, double tolerance, uint64_t seed,
+            int thread_count, Matrix *centroids, int *assignments, double *inertia){
+    int n = data->rows;
+    int d = data->cols;
+    if(k <= 0 || k > n){
+        printf("Number of clusters must be between 1 and the number of points\n");
+        return false;
+    }
+    int blocks = (n + KMEANS_BLOCK_ROWS - 1) / KMEANS_BLOCK_ROWS;
+    if(thread_count > blocks){
+        thread_count = blocks;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    double *best = (double *)malloc((size_t)n * sizeof(double));
+    double *task_sums = (double *)malloc((size_t)k * d * 2 * thread_count * sizeof(double));
+    double *sums = (double *)malloc((size_t)k * d * sizeof(double));
+    int *counts = (int *)malloc((size_t)k * (thread_count + 1) * sizeof(int));
+    int *previous = (int *)malloc((size_t)n * sizeof(int));
+    CentroidTask *tasks = (CentroidTask *)malloc(sizeof(CentroidTask) * (size_t)thread_count);
+    if(best == NULL || task_sums == NULL || sums == NULL || counts == NULL || previous == NULL || tasks == NULL){
+        printf("Memory allocation failed for k-means.\n");
+        free(best);
+        free(task_sums);
+        free(sums);
+        free(counts);
+        free(previous);
+        free(tasks);
+        return false;
+    }
+    centroids->rows = k;
+    centroids->cols = d;
+    RandomState rng;
+    seedRandom(&rng, seed);
+    int i;
+    int j;
+    int c;
+    /* k-means++: sample each new center with probability proportional to D^2 */
+    int first = (int)(randomUniform(&rng) * n);
+    memcpy(centroids->data, data->data + (size_t)first * d, d * sizeof(double));
+    for(i = 0; i < n; i++){
+        best[i] = INFINITY;
+    }
+    for(j = 1; j <= k; j++){
+        const double *center = centroids->data + (size_t)(j - 1) * d;
+        double total = 0;
+        for(i = 0; i < n; i++){
+            const double *point = data->data + (size_t)i * d;
+            double distance = 0;
+            for(c = 0; c < d; c++){
+                double difference = point[c] - center[c];
+                distance += difference * difference;
+            }
+            if(distance < best[i]){
+                best[i] = distance;
+            }
+            total += best[i];
+        }
+        if(j == k){
+            break;
+        }
+        double target = randomUniform(&rng) * total;
+        int pick = n - 1;
+        for(i = 0; i < n; i++){
+            target -= best[i];
+            if(target < 0){
+                pick = i;
+                break;
+            }
+        }
+        memcpy(centroids->data + (size_t)j * d, data->data + (size_t)pick * d, d * sizeof(double));
+    }
+    int iteration;
+    int t;
+    /* Whether assignments and best describe the current centroids */
+    bool current = false;
+    bool ok = true;
+    NearestCentroid nearest = {assignments, best};
+    for(i = 0; i < n; i++){
+        previous[i] = -1;
+    }
+    for(t = 0; t < thread_count; t++){
+        CentroidTask task = {data, assignments, k,
+                             blocks * t / thread_count * KMEANS_BLOCK_ROWS,
+                             blocks * (t + 1) / thread_count * KMEANS_BLOCK_ROWS,
+                             task_sums + (size_t)k * d * 2 * t,
+                             task_sums + (size_t)k * d * (2 * t + 1),
+                             counts + (size_t)k * (t + 1)};
+        task.end_row = task.end_row < n ? task.end_row : n;
+        tasks[t] = task;
+    }
+    for(iteration = 0; iteration < max_iterations; iteration++){
+        /* Assignment: GEMM distances fused with the argmin */
+        for(i = 0; i < n; i++){
+            best[i] = INFINITY;
+            assignments[i] = 0;
+        }
+        if(!pairwiseDistancesTiled(data, centroids, DISTANCE_SQUARED_EUCLIDEAN, 0, 0, assignNearest, &nearest)){
+            ok = false;
+            break;
+        }
+        bool changed = false;
+        for(i = 0; i < n; i++){
+            if(assignments[i] != previous[i]){
+                changed = true;
+            }
+            previous[i] = assignments[i];
+        }
+        if(!changed){
+            current = true;
+            break;
+        }
+        /* Update: per thread partial sums reduced in task order */
+        runParallel(runCentroidTask, tasks, sizeof(CentroidTask), thread_count);
+        for(i = 0; i < k * d; i++){
+            sums[i] = 0;
+        }
+        for(j = 0; j < k; j++){
+            counts[j] = 0;
+        }
+        for(t = 0; t < thread_count; t++){
+            for(i = 0; i < k * d; i++){
+                sums[i] += tasks[t].sums[i];
+            }
+            for(j = 0; j < k; j++){
+                counts[j] += tasks[t].counts[j];
+            }
+        }
+        /* Empty clusters: move over the worst fitted point of a cluster that
+           can spare one, taking it out of that cluster's sums. k <= n, so
+           such a cluster always exists */
+        for(j = 0; j < k; j++){
+            if(counts[j] > 0){
+                continue;
+            }
+            int farthest = -1;
+            for(i = 0; i < n; i++){
+                if(previous[i] >= 0 && counts[assignments[i]] > 1 &&
+                   (farthest < 0 || best[i] > best[farthest])){
+                    farthest = i;
+                }
+            }
+            int donor = assignments[farthest];
+            const double *point = data->data + (size_t)farthest * d;
+            for(c = 0; c < d; c++){
+                sums[(size_t)donor * d + c] -= point[c];
+                sums[(size_t)j * d + c] = point[c];
+            }
+            counts[donor]--;
+            counts[j] = 1;
+            assignments[farthest] = j;
+            /* Marks the point as moved and forces another iteration */
+            previous[farthest] = -1;
+        }
+        double largest_shift = 0;
+        for(j = 0; j < k; j++){
+            double *center = centroids->data + (size_t)j * d;
+            double shift = 0;
+            for(c = 0; c < d; c++){
+                double updated = sums[(size_t)j * d + c] / counts[j];
+                shift += (updated - center[c]) * (updated - center[c]);
+                center[c] = updated;
+            }
+            if(shift > largest_shift){
+                largest_shift = shift;
+            }
+        }
+        if(fastSqrt(largest_shift) <= tolerance){
+            break;
+        }
+    }
+    if(ok && !current){
+        /* Assign against the final centroids, whichever way the loop ended */
+        for(i = 0; i < n; i++){
+            best[i] = INFINITY;
+            assignments[i] = 0;
+        }
+        ok = pairwiseDistancesTiled(data, centroids, DISTANCE_SQUARED_EUCLIDEAN, 0, 0, assignNearest, &nearest);
+    }
+    if(ok && inertia != NULL){
+        *inertia = 0;
+        for(i = 0; i < n; i++){
+            *inertia += best[i];
+        }
+    }
+    free(best);
+    free(task_sums);
+    free(sums);
+    free(counts);
+    free(previous);
+    free(tasks);
+    return ok;
+}
+
+/*
+ * Struct: SparseMatrix
+ * --------------------
+ * Matrix in compressed sparse row (CSR) form
+ * The column indices and values of row r are stored at positions
+ * row_ptr[r] .. row_ptr[r + 1] - 1
+ *
+ *  rows (int): number of rows
+ *  cols (int): number of columns
+ *  nnz (int): number of stored entries
+ *  row_ptr (pointer): rows + 1 offsets into col_index and values
+ *  col_index (pointer): column of every stored entry
+ *  values (pointer): value of every stored entry
+*/
+typedef struct{
+    int rows;
+    int cols;
+    int nnz;
+    int *row_ptr;
+    int *col_index;
+    double *values;
+} SparseMatrix;
+
+/*
+ * Enum: NmfAlgorithm
+ * --------------------
+ * Update rule used by nmfFactorize
+*/
+typedef enum {
+    NMF_MULTIPLICATIVE,
+    NMF_HALS
+} NmfAlgorithm;
+
+/*
+ * Function: (bool) sparseFromDenseWithZero
+ * --------------------
+ * Builds the CSR form of a dense matrix, keeping the entries that differ
+ * from zero, the value marking a missing entry. Graphs meant for a
+ * semiring pass semiringZero, e.g. INFINITY for (min, +), so that edges of
+ * weight 0 are kept and the missing ones are not stored
+ * The arrays of the result are allocated here, release them with
+ * freeSparseMatrix
+ *
+ *  matrix (pointer): a pointer to the dense matrix
+ *  zero (double): the value of the entries left out
+ *  result (pointer): a pointer to the sparse result
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool sparseFromDenseWithZero(const Matrix *matrix, double zero, SparseMatrix *result){
+    int total = matrix->rows * matrix->cols;
+    int nnz = 0;
+    int i;
+    int r;
+    int c;
+    for(i = 0; i < total; i++){
+        if(*(matrix->data + i) != zero){
+            nnz++;
+        }
+    }
+    result->rows = matrix->rows;
+    result->cols = matrix->cols;
+    result->nnz = nnz;
+    result->row_ptr = (int *)malloc(((size_t)matrix->rows + 1) * sizeof(int));
+    result->col_index = (int *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(int));
+    result->values = (double *)malloc((size_t)(nnz > 0 ? nnz : 1) * sizeof(double));
+    if(result->row_ptr == NULL || result->col_index == NULL || result->values == NULL){
+        printf("Memory allocation failed for sparse matrix.\n");
+        free(result->row_ptr);
+        free(result->col_index);
+        free(result->values);
+        return false;
+    }
+    nnz = 0;
+    for(r = 0; r < matrix->rows; r++){
+        result->row_ptr[r] = nnz;
+        for(c = 0; c < matrix->cols; c++){
+            double value = *(matrix->data + r * matrix->cols + c);
+            if(value != zero){
+                result->col_index[nnz] = c;
+                result->values[nnz] = value;
+                nnz++;
+            }
+        }
+    }
+    result->row_ptr[matrix->rows] = nnz;
+    return true;
+}
+
+/*
+ * Function: (bool) sparseFromDense
+ * --------------------
+ * Builds the CSR form of a dense matrix, keeping its nonzero entries
+ * The arrays of the result are allocated here, release them with
+ * freeSparseMatrix
+ *
+ *  matrix (pointer): a pointer to the dense matrix
+ *  result (pointer): a pointer to the sparse result
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool sparseFromDense(const Matrix *matrix, SparseMatrix *result){
+    return sparseFromDenseWithZero(matrix, 0.0, result);
+}
+
+/*
+ * Function: (void) freeSparseMatrix
+ * --------------------
+ * Releases the arrays of a sparse matrix allocated by this file
+ *
+ *  matrix (pointer): a pointer to the sparse matrix
+*/
+void freeSparseMatrix(SparseMatrix *matrix){
+    free(matrix->row_ptr);
+    free(matrix->col_index);
+    free(matrix->values);
+    matrix->row_ptr = NULL;
+    matrix->col_index = NULL;
+    matrix->values = NULL;
+    matrix->nnz = 0;
+}
+
+/*
+ * Function: (bool) sparseMultiplyDense
+ * --------------------
+ * Multiplies a sparse matrix by a dense one, A op(B), in O(nnz(A) * cols)
+ * Every stored A_{i,j} adds a scaled row j of op(B) to row i of the result
+ *
+ *  matrix_a (pointer): a pointer to the sparse left matrix
+ *  matrix_b (pointer): a pointer to the dense right matrix
+ *  transpose_b (bool): whether to use B^T
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool sparseMultiplyDense(const SparseMatrix *matrix_a, const Matrix *matrix_b, bool transpose_b, Matrix *result){
+    int inner = transpose_b ? matrix_b->cols : matrix_b->rows;
+    int cols = transpose_b ? matrix_b->rows : matrix_b->cols;
+    if(matrix_a->cols != inner){
+        printf("Incompatible dimensions in sparse matrix multiplication\n");
+        return false;
+    }
+    int b_row_stride = transpose_b ? 1 : matrix_b->cols;
+    int b_col_stride = transpose_b ? matrix_b->cols : 1;
+    result->rows = matrix_a->rows;
+    result->cols = cols;
+    int r;
+    int p;
+    int c;
+    for(r = 0; r < matrix_a->rows; r++){
+        double *out_row = result->data + (size_t)r * cols;
+        for(c = 0; c < cols; c++){
+            out_row[c] = 0;
+        }
+        for(p = matrix_a->row_ptr[r]; p < matrix_a->row_ptr[r + 1]; p++){
+            double value = matrix_a->values[p];
+            const double *b_row = matrix_b->data + (size_t)matrix_a->col_index[p] * b_row_stride;
+            for(c = 0; c < cols; c++){
+                out_row[c] += value * b_row[c * b_col_stride];
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) multiplyDenseSparse
+ * --------------------
+ * Multiplies a dense matrix by a sparse one, op(A) B, in O(rows * nnz(B))
+ * Every nonzero op(A)_{i,k} adds a scaled sparse row k of B to row i
+ *
+ *  matrix_a (pointer): a pointer to the dense left matrix
+ *  transpose_a (bool): whether to use A^T
+ *  matrix_b (pointer): a pointer to the sparse right matrix
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool multiplyDenseSparse(const Matrix *matrix_a, bool transpose_a, const SparseMatrix *matrix_b, Matrix *result){
+    int rows = transpose_a ? matrix_a->cols : matrix_a->rows;
+    int inner = transpose_a ? matrix_a->rows : matrix_a->cols;
+    if(inner != matrix_b->rows){
+        printf("Incompatible dimensions in sparse matrix multiplication\n");
+        return false;
+    }
+    int a_row_stride = transpose_a ? 1 : matrix_a->cols;
+    int a_inner_stride = transpose_a ? matrix_a->cols : 1;
+    int cols = matrix_b->cols;
+    result->rows = rows;
+    result->cols = cols;
+    int r;
+    int k;
+    int p;
+    for(r = 0; r < rows * cols; r++){
+        *(result->data + r) = 0;
+    }
+    for(r = 0; r < rows; r++){
+        double *out_row = result->data + (size_t)r * cols;
+        for(k = 0; k < inner; k++){
+            double a_rk = *(matrix_a->data + (size_t)r * a_row_stride + (size_t)k * a_inner_stride);
+            if(a_rk == 0){
+                continue;
+            }
+            for(p = matrix_b->row_ptr[k]; p < matrix_b->row_ptr[k + 1]; p++){
+                out_row[matrix_b->col_index[p]] += a_rk * matrix_b->values[p];
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) nmfFactorize
+ * --------------------
+ * Nonnegative matrix factorization V ~ W H of an m x n nonnegative matrix
+ * with W (m x rank) and H (rank x n) nonnegative
+ * V may be given dense or sparse. Each iteration only needs V H^T, W^T V,
+ * the small Gram matrices W^T W and H H^T and their products with W or H,
+ * all of which go through the tiled, SYRK or sparse kernels. Every
+ * temporary is allocated once before the loop
+ *
+ * NMF_MULTIPLICATIVE: Lee-Seung updates H *= W^T V / (W^T W H), then W
+ * NMF_HALS: exact coordinate updates of one row of H (column of W) at a
+ *           time, projected onto the nonnegative orthant, usually much
+ *           faster to converge
+ *
+ *  dense_v (pointer): the matrix to factor, or NULL if sparse_v is given
+ *  sparse_v (pointer): the matrix to factor in CSR form, or NULL
+ *  rank (int): inner dimension of the factorization
+ *  algorithm (NmfAlgorithm): the update rule
+ *  max_iterations (int): number of iterations to run
+ *  seed (uint64_t): seed of the random initialization
+ *  w (pointer): m x rank result, data must be preallocated
+ *  h (pointer): rank x n result, data must be preallocated
+ *
+ *  Returns true if successful, false on bad arguments or allocation failure
+*/
+bool nmfFactorize(const Matrix *dense_v, const SparseMatrix *sparse_v, int rank, NmfAlgorithm algorithm,
+                  int max_iterations, uint64_t seed, Matrix *w, Matrix *h){
+    if((dense_v == NULL) == (sparse_v == NULL) || rank <= 0){
+        printf("NMF needs exactly one input matrix and a positive rank\n");
+        return false;
+    }
+    int m = dense_v != NULL ? dense_v->rows : sparse_v->rows;
+    int n = dense_v != NULL ? dense_v->cols : sparse_v->cols;
+    /* Workspace for the whole run */
+    size_t workspace_size = 2 * (size_t)rank * n + 2 * (size_t)m * rank + 2 * (size_t)rank * rank;
+    double *workspace = (double *)malloc(workspace_size * sizeof(double));
+    if(workspace == NULL){
+        printf("Memory allocation failed for NMF workspace.\n");
+        return false;
+    }
+    Matrix wt_v = {rank, n, workspace};
+    Matrix gram_h_product = {rank, n, wt_v.data + (size_t)rank * n};
+    Matrix v_ht = {m, rank, gram_h_product.data + (size_t)rank * n};
+    Matrix w_gram = {m, rank, v_ht.data + (size_t)m * rank};
+    Matrix gram_w = {rank, rank, w_gram.data + (size_t)m * rank};
+    Matrix gram_h = {rank, rank, gram_w.data + (size_t)rank * rank};
+    w->rows = m;
+    w->cols = rank;
+    h->rows = rank;
+    h->cols = n;
+    /* Random start scaled to the average entry of V */
+    double total = 0;
+    int i;
+    int j;
+    int l;
+    if(dense_v != NULL){
+        for(i = 0; i < m * n; i++){
+            total += *(dense_v->data + i);
+        }
+    } else {
+        for(i = 0; i < sparse_v->nnz; i++){
+            total += sparse_v->values[i];
+        }
+    }
+    double scale = fastSqrt(total / ((double)m * n) / rank);
+    RandomState rng;
+    seedRandom(&rng, seed);
+    for(i = 0; i < m * rank; i++){
+        *(w->data + i) = scale * randomUniform(&rng) + NMF_EPSILON;
+    }
+    for(i = 0; i < rank * n; i++){
+        *(h->data + i) = scale * randomUniform(&rng) + NMF_EPSILON;
+    }
+    int iteration;
+    for(iteration = 0; iteration < max_iterations; iteration++){
+        /* Update H from W^T V and W^T W */
+        if(dense_v != NULL){
+            multiplyMatricesTransposed(w, true, dense_v, false, &wt_v);
+        } else {
+            multiplyDenseSparse(w, true, sparse_v, &wt_v);
+        }
+        symmetricRankKUpdate(w, 0.0, &gram_w);
+        if(algorithm == NMF_MULTIPLICATIVE){
+            multiplyMatricesEpilogue(&gram_w, h, NULL, &gram_h_product);
+            for(i = 0; i < rank * n; i++){
+                *(h->data + i) *= wt_v.data[i] / (gram_h_product.data[i] + NMF_EPSILON);
+            }
+        } else {
+            for(l = 0; l < rank; l++){
+                double *h_row = h->data + (size_t)l * n;
+                double diagonal = gram_w.data[l * rank + l] + NMF_EPSILON;
+                for(j = 0; j < n; j++){
+                    double residual = wt_v.data[(size_t)l * n + j];
+                    int q;
+                    for(q = 0; q < rank; q++){
+                        residual -= gram_w.data[l * rank + q] * *(h->data + (size_t)q * n + j);
+                    }
+                    double updated = h_row[j] + residual / diagonal;
+                    h_row[j] = updated > NMF_EPSILON ? updated : NMF_EPSILON;
+                }
+            }
+        }
+        /* Update W from V H^T and H H^T */
+        if(dense_v != NULL){
+            multiplyMatricesTransposed(dense_v, false, h, true, &v_ht);
+        } else {
+            sparseMultiplyDense(sparse_v, h, true, &v_ht);
+        }
+        multiplyMatricesTransposed(h, false, h, true, &gram_h);
+        if(algorithm == NMF_MULTIPLICATIVE){
+            multiplyMatricesEpilogue(w, &gram_h, NULL, &w_gram);
+            for(i = 0; i < m * rank; i++){
+                *(w->data + i) *= v_ht.data[i] / (w_gram.data[i] + NMF_EPSILON);
+            }
+        } else {
+            /* Rows of W are independent, so each row runs through the columns in turn */
+            for(i = 0; i < m; i++){
+                double *w_row = w->data + (size_t)i * rank;
+                for(l = 0; l < rank; l++){
+                    double residual = v_ht.data[(size_t)i * rank + l];
+                    int q;
+                    for(q = 0; q < rank; q++){
+                        residual -= w_row[q] * gram_h.data[q * rank + l];
+                    }
+                    double updated = w_row[l] + residual / (gram_h.data[l * rank + l] + NMF_EPSILON);
+                    w_row[l] = updated > NMF_EPSILON ? updated : NMF_EPSILON;
+                }
+            }
+        }
+    }
+    free(workspace);
+    return true;
+}
+
+/*
+ * Enum: Semiring
+ * --------------------
+ * Pair of operations (add, multiply) replacing (+, *) in a matrix product
+ *
+ *  SEMIRING_PLUS_TIMES: the usual product
+ *  SEMIRING_MIN_PLUS: (min, +), shortest paths; missing edges are INFINITY
+ *  SEMIRING_MAX_PLUS: (max, +), longest paths and Viterbi in log space
+ *  SEMIRING_MAX_TIMES: (max, *) on nonnegative values, Viterbi with
+ *                      probabilities; missing transitions are 0
+ *  SEMIRING_OR_AND: (or, and) on 0/1 values, reachability and BFS
+*/
+typedef enum {
+    SEMIRING_PLUS_TIMES,
+    SEMIRING_MIN_PLUS,
+    SEMIRING_MAX_PLUS,
+    SEMIRING_MAX_TIMES,
+    SEMIRING_OR_AND
+} Semiring;
+
+#define SEMIRING_MIN(x, y) ((y) < (x) ? (y) : (x))
+#define SEMIRING_MAX(x, y) ((y) > (x) ? (y) : (x))
+#define SEMIRING_SUM(x, y) ((x) + (y))
+#define SEMIRING_PRODUCT(x, y) ((x) * (y))
+#define SEMIRING_OR(x, y) (((x) != 0 || (y) != 0) ? 1.0 : 0.0)
+#define SEMIRING_AND(x, y) (((x) != 0 && (y) != 0) ? 1.0 : 0.0)
+
+/*
+ * Macro: DEFINE_SEMIRING_GEMM
+ * --------------------
+ * Defines bool NAME(matrix_a, matrix_b, result) computing the product of A
+ * and B over the semiring (ADD, MULTIPLY) whose additive identity is ZERO
+ * The loops are those of multiplyMatricesEpilogue, with the register tile
+ * initialized to ZERO and the semiring operations expanded inline, so every
+ * semiring gets its own compiled kernel and min/max become single
+ * instructions rather than a call per element
+*/
+#define DEFINE_SEMIRING_GEMM(NAME, ZERO, ADD, MULTIPLY)                                      \
+bool NAME(const Matrix *matrix_a, const Matrix *matrix_b, Matrix *result){                   \
+    if (matrix_a->cols != matrix_b->rows){                                                   \
+        printf("Incompatible dimensions in semiring matrix multiplication\n");              \
+        return false;                                                                        \
+    }                                                                                        \
+    result->rows = matrix_a->rows;                                                           \
+    result->cols = matrix_b->cols;                                                           \
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];                                             \
+    int inner = matrix_a->cols;                                                              \
+    int row;                                                                                 \
+    int col;                                                                                 \
+    int i;                                                                                   \
+    int j;                                                                                   \
+    int k;                                                                                   \
+    for(col = 0; col < result->cols; col += GEMM_TILE_COLS){                                 \
+        int tile_cols = result->cols - col < GEMM_TILE_COLS ? result->cols - col : GEMM_TILE_COLS; \
+        for(row = 0; row < result->rows; row += GEMM_TILE_ROWS){                             \
+            int tile_rows = result->rows - row < GEMM_TILE_ROWS ? result->rows - row : GEMM_TILE_ROWS; \
+            const double *a = matrix_a->data + (size_t)row * inner;                          \
+            const double *b = matrix_b->data + col;                                          \
+            for(i = 0; i < GEMM_TILE_ROWS; i++){                                             \
+                for(j = 0; j < GEMM_TILE_COLS; j++){                                         \
+                    tile[i][j] = ZERO;                                                       \
+                }                                                                            \
+            }                                                                                \
+            if(tile_rows == GEMM_TILE_ROWS && tile_cols == GEMM_TILE_COLS){                  \
+                for(k = 0; k < inner; k++){                                                  \
+                    const double *b_row = b + (size_t)k * matrix_b->cols;                    \
+                    for(i = 0; i < GEMM_TILE_ROWS; i++){                                     \
+                        double a_ik = a[(size_t)i * inner + k];                              \
+                        for(j = 0; j < GEMM_TILE_COLS; j++){                                 \
+                            tile[i][j] = ADD(tile[i][j], MULTIPLY(a_ik, b_row[j]));          \
+                        }                                                                    \
+                    }                                                                        \
+                }                                                                            \
+            } else {                                                                         \
+                for(k = 0; k < inner; k++){                                                  \
+                    const double *b_row = b + (size_t)k * matrix_b->cols;                    \
+                    for(i = 0; i < tile_rows; i++){                                          \
+                        double a_ik = a[(size_t)i * inner + k];                              \
+                        for(j = 0; j < tile_cols; j++){                                      \
+                            tile[i][j] = ADD(tile[i][j], MULTIPLY(a_ik, b_row[j]));          \
+                        }                                                                    \
+                    }                                                                        \
+                }                                                                            \
+            }                                                                                \
+            for(i = 0; i < tile_rows; i++){                                                  \
+                for(j = 0; j < tile_cols; j++){                                              \
+                    *(result->data + (row + i) * result->cols + col + j) = tile[i][j];       \
+                }                                                                            \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+    return true;                                                                             \
+}
+
+/*
+ * Functions: (bool) multiplyMatricesMinPlus, multiplyMatricesMaxPlus,
+ *            multiplyMatricesMaxTimes, multiplyMatricesOrAnd
+ * --------------------
+ * Products over the tropical semirings, see Semiring
+ * Arguments and return value are those of multiplyMatrices
+*/
+DEFINE_SEMIRING_GEMM(multiplyMatricesMinPlus, INFINITY, SEMIRING_MIN, SEMIRING_SUM)
+DEFINE_SEMIRING_GEMM(multiplyMatricesMaxPlus, -INFINITY, SEMIRING_MAX, SEMIRING_SUM)
+DEFINE_SEMIRING_GEMM(multiplyMatricesMaxTimes, 0.0, SEMIRING_MAX, SEMIRING_PRODUCT)
+DEFINE_SEMIRING_GEMM(multiplyMatricesOrAnd, 0.0, SEMIRING_OR, SEMIRING_AND)
+
+/*
+ * Function: (bool) multiplySemiring
+ * --------------------
+ * Multiplies two matrices over the selected semiring
+ * The selection happens once here, each case runs its specialized kernel
+ *
+ *  matrix_a (pointer): a pointer to the left matrix
+ *  matrix_b (pointer): a pointer to the right matrix
+ *  semiring (Semiring): the pair of operations
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool multiplySemiring(const Matrix *matrix_a, const Matrix *matrix_b, Semiring semiring, Matrix *result){
+    switch(semiring){
+        case SEMIRING_MIN_PLUS:
+            return multiplyMatricesMinPlus(matrix_a, matrix_b, result);
+        case SEMIRING_MAX_PLUS:
+            return multiplyMatricesMaxPlus(matrix_a, matrix_b, result);
+        case SEMIRING_MAX_TIMES:
+            return multiplyMatricesMaxTimes(matrix_a, matrix_b, result);
+        case SEMIRING_OR_AND:
+            return multiplyMatricesOrAnd(matrix_a, matrix_b, result);
+        default:
+            return multiplyMatricesEpilogue(matrix_a, matrix_b, NULL, result);
+    }
+}
+
+/*
+ * Struct: BitMatrix
+ * --------------------
+ * Boolean matrix storing one bit per entry, 64 columns per word
+ * Column c of row r is bit c % 64 of bits[r * words_per_row + c / 64].
+ * Bits past the last column are always zero
+ *
+ *  rows (int): number of rows
+ *  cols (int): number of columns
+ *  words_per_row (int): number of 64 bit words in a row
+ *  bits (pointer): the packed rows
+*/
+typedef struct{
+    int rows;
+    int cols;
+    int words_per_row;
+    uint64_t *bits;
+} BitMatrix;
+
+/*
+ * Function: (bool) createBitMatrix
+ * --------------------
+ * Allocates an all-false Boolean matrix, release it with freeBitMatrix
+ *
+ *  rows (int): number of rows
+ *  cols (int): number of columns
+ *  result (pointer): the matrix to initialize
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool createBitMatrix(int rows, int cols, BitMatrix *result){
+    result->rows = rows;
+    result->cols = cols;
+    result->words_per_row = (cols + 63) / 64;
+    result->bits = (uint64_t *)calloc((size_t)rows * result->words_per_row + 1, sizeof(uint64_t));
+    if(result->bits == NULL){
+        printf("Memory allocation failed for bit matrix.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: (void) freeBitMatrix
+ * --------------------
+ * Releases the storage of a Boolean matrix
+ *
+ *  matrix (pointer): the matrix to release
+*/
+void freeBitMatrix(BitMatrix *matrix){
+    free(matrix->bits);
+    matrix->bits = NULL;
+}
+
+/*
+ * Function: (bool) getBit
+ * --------------------
+ * Reads entry (r, c) of a Boolean matrix
+ *
+ *  matrix (pointer): the matrix
+ *  r, c (int): row and column
+*/
+bool getBit(const BitMatrix *matrix, int r, int c){
+    return (matrix->bits[(size_t)r * matrix->words_per_row + c / 64] >> (c % 64)) & 1;
+}
+
+/*
+ * Function: (bool) bitMatrixFromThreshold
+ * --------------------
+ * Packs a dense matrix into a Boolean one, true where the entry is greater
+ * than the threshold. The result is allocated here
+ *
+ *  matrix (pointer): a pointer to the dense matrix
+ *  threshold (double): entries above it become true
+ *  result (pointer): the Boolean result
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool bitMatrixFromThreshold(const Matrix *matrix, double threshold, BitMatrix *result){
+    if(!createBitMatrix(matrix->rows, matrix->cols, result)){
+        return false;
+    }
+    int r;
+    int c;
+    for(r = 0; r < matrix->rows; r++){
+        uint64_t *row = result->bits + (size_t)r * result->words_per_row;
+        for(c = 0; c < matrix->cols; c++){
+            row[c / 64] |= (uint64_t)(*(matrix->data + r * matrix->cols + c) > threshold) << (c % 64);
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) bitMatrixToDense
+ * --------------------
+ * Unpacks a Boolean matrix into 0.0 / 1.0 entries
+ *
+ *  matrix (pointer): the Boolean matrix
+ *  result (pointer): the dense result, data must be preallocated
+ *
+ *  Returns true if successful
+*/
+bool bitMatrixToDense(const BitMatrix *matrix, Matrix *result){
+    result->rows = matrix->rows;
+    result->cols = matrix->cols;
+    int r;
+    int c;
+    for(r = 0; r < matrix->rows; r++){
+        for(c = 0; c < matrix->cols; c++){
+            *(result->data + r * matrix->cols + c) = getBit(matrix, r, c) ? 1.0 : 0.0;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (void) transposeBitBlock
+ * --------------------
+ * Transposes a 64 x 64 bit block in place, word k being row k, by swapping
+ * off-diagonal sub-blocks of size 32, 16, ..., 1 with masked word operations
+ *
+ *  block (pointer): the 64 words of the block
+*/
+void transposeBitBlock(uint64_t block[64]){
+    uint64_t mask = 0x00000000ffffffffULL;
+    int width;
+    int k;
+    for(width = 32; width != 0; width >>= 1, mask ^= mask << width){
+        for(k = 0; k < 64; k = ((k | width) + 1) & ~width){
+            uint64_t swap = ((block[k] >> width) ^ block[k | width]) & mask;
+            block[k] ^= swap << width;
+            block[k | width] ^= swap;
+        }
+    }
+}
+
+/*
+ * Function: (bool) transposeBitMatrix
+ * --------------------
+ * Transposes a Boolean matrix 64 x 64 bits at a time
+ * The result is allocated here
+ *
+ *  matrix (pointer): the Boolean matrix
+ *  result (pointer): the transposed result
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool transposeBitMatrix(const BitMatrix *matrix, BitMatrix *result){
+    if(!createBitMatrix(matrix->cols, matrix->rows, result)){
+        return false;
+    }
+    uint64_t block[64];
+    int block_row;
+    int block_col;
+    int k;
+    for(block_row = 0; block_row < matrix->rows; block_row += 64){
+        for(block_col = 0; block_col < matrix->words_per_row; block_col++){
+            for(k = 0; k < 64; k++){
+                block[k] = block_row + k < matrix->rows ?
+                           matrix->bits[(size_t)(block_row + k) * matrix->words_per_row + block_col] : 0;
+            }
+            transposeBitBlock(block);
+            for(k = 0; k < 64 && block_col * 64 + k < result->rows; k++){
+                result->bits[(size_t)(block_col * 64 + k) * result->words_per_row + block_row / 64] = block[k];
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) multiplyBitMatrices
+ * --------------------
+ * Boolean product C = A B with OR as addition and AND as multiplication
+ * Uses the method of Four Russians: the rows of B are taken 8 at a time and
+ * all 256 ORs of those rows are tabulated, then every row of A picks the
+ * entry of the table indexed by its 8 bits in that range and ORs it in,
+ * a whole word of output at a time. The result is allocated here
+ *
+ *  matrix_a (pointer): the left Boolean matrix
+ *  matrix_b (pointer): the right Boolean matrix
+ *  result (pointer): the Boolean result
+ *
+ *  Returns true if successful, false on dimension mismatch or allocation failure
+*/
+bool multiplyBitMatrices(const BitMatrix *matrix_a, const BitMatrix *matrix_b, BitMatrix *result){
+    if(matrix_a->cols != matrix_b->rows){
+        printf("Incompatible dimensions in Boolean matrix multiplication\n");
+        return false;
+    }
+    int words = matrix_b->words_per_row;
+    uint64_t *table = (uint64_t *)malloc((size_t)256 * words * sizeof(uint64_t));
+    if(table == NULL){
+        printf("Memory allocation failed for Boolean multiplication table.\n");
+        return false;
+    }
+    if(!createBitMatrix(matrix_a->rows, matrix_b->cols, result)){
+        free(table);
+        return false;
+    }
+    int group;
+    int entry;
+    int r;
+    int w;
+    for(group = 0; group < matrix_b->rows; group += 8){
+        /* Table of all ORs of rows group .. group + 7 of B */
+        for(w = 0; w < words; w++){
+            table[w] = 0;
+        }
+        for(entry = 1; entry < 256; entry++){
+            int lowest = 0;
+            while(!((entry >> lowest) & 1)){
+                lowest++;
+            }
+            const uint64_t *previous = table + (size_t)(entry & (entry - 1)) * words;
+            uint64_t *current = table + (size_t)entry * words;
+            if(group + lowest < matrix_b->rows){
+                const uint64_t *b_row = matrix_b->bits + (size_t)(group + lowest) * words;
+                for(w = 0; w < words; w++){
+                    current[w] = previous[w] | b_row[w];
+                }
+            } else {
+                for(w = 0; w < words; w++){
+                    current[w] = previous[w];
+                }
+            }
+        }
+        /* Every row of A ORs in the table entry selected by its 8 bits */
+        for(r = 0; r < matrix_a->rows; r++){
+            uint64_t word = matrix_a->bits[(size_t)r * matrix_a->words_per_row + group / 64];
+            int index = (int)((word >> (group % 64)) & 0xff);
+            if(index == 0){
+                continue;
+            }
+            const uint64_t *selected = table + (size_t)index * words;
+            uint64_t *out = result->bits + (size_t)r * words;
+            for(w = 0; w < words; w++){
+                out[w] |= selected[w];
+            }
+        }
+    }
+    free(table);
+    return true;
+}
+
+/*
+ * Function: (int) popcount64
+ * --------------------
+ * Counts the set bits of a word. GCC and Clang lower the builtin to the
+ * popcount instruction where the target has one, other compilers get the
+ * branch free SWAR count
+ *
+ *  word (uint64_t): the bits to count
+ *
+ *  Returns the number of ones in word
+*/
+int popcount64(uint64_t word){
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/*
+ * Function: (bool) countBitProducts
+ * --------------------
+ * Counts, for every (i, j), the k with A_{i,k} and B_{k,j} both true, i.e.
+ * the number of length two paths. Takes B^T so both operands are read
+ * along rows and each count is a run of AND + popcount over words
+ *
+ *  matrix_a (pointer): the left Boolean matrix
+ *  matrix_b_transposed (pointer): the right Boolean matrix, transposed
+ *  result (pointer): the dense counts, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool countBitProducts(const BitMatrix *matrix_a, const BitMatrix *matrix_b_transposed, Matrix *result){
+    if(matrix_a->cols != matrix_b_transposed->cols){
+        printf("Incompatible dimensions in Boolean path counting\n");
+        return false;
+    }
+    result->rows = matrix_a->rows;
+    result->cols = matrix_b_transposed->rows;
+    int words = matrix_a->words_per_row;
+    int r;
+    int c;
+    int w;
+    for(r = 0; r < matrix_a->rows; r++){
+        const uint64_t *a_row = matrix_a->bits + (size_t)r * words;
+        for(c = 0; c < matrix_b_transposed->rows; c++){
+            const uint64_t *b_row = matrix_b_transposed->bits + (size_t)c * words;
+            int count = 0;
+            for(w = 0; w < words; w++){
+                count += popcount64(a_row[w] & b_row[w]);
+            }
+            *(result->data + r * result->cols + c) = count;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) transitiveClosure
+ * --------------------
+ * Replaces a square Boolean adjacency matrix by its transitive closure
+ * (i reaches j through one or more edges) with Warshall's algorithm,
+ * updating whole rows with word-level ORs
+ *
+ *  matrix (pointer): the adjacency matrix, modified in place
+ *
+ *  Returns true if successful, false if the matrix is not square
+*/
+bool transitiveClosure(BitMatrix *matrix){
+    if(matrix->rows != matrix->cols){
+        printf("Transitive closure needs a square matrix\n");
+        return false;
+    }
+    int words = matrix->words_per_row;
+    int k;
+    int r;
+    int w;
+    for(k = 0; k < matrix->rows; k++){
+        const uint64_t *k_row = matrix->bits + (size_t)k * words;
+        for(r = 0; r < matrix->rows; r++){
+            if(getBit(matrix, r, k)){
+                uint64_t *row = matrix->bits + (size_t)r * words;
+                for(w = 0; w < words; w++){
+                    row[w] |= k_row[w];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Struct: ModularMatrix
+ * --------------------
+ * Matrix over the integers modulo p, for 2 <= p < 2^26
+ * Entries are the residues 0 .. p - 1 stored as doubles, so products of two
+ * entries are exact and the floating point kernels can be reused
+ *
+ *  rows (int): number of rows
+ *  cols (int): number of columns
+ *  modulus (int64_t): the modulus p
+ *  data (pointer): the residues, laid out like Matrix
+*/
+typedef struct{
+    int rows;
+    int cols;
+    int64_t modulus;
+    double *data;
+} ModularMatrix;
+
+/*
+ * Function: (double) reduceModular
+ * --------------------
+ * Reduces an exactly represented nonnegative integer x < 2^53 modulo p
+ * The quotient comes from a multiplication by the precomputed 1/p and can
+ * be off by one, which the two final corrections absorb
+ *
+ *  x (double): the value to reduce
+ *  modulus (double): p
+ *  inverse (double): 1 / p
+*/
+double reduceModular(double x, double modulus, double inverse){
+    double r = x - (double)(int64_t)(x * inverse) * modulus;
+    r = r < 0 ? r + modulus : r;
+    return r >= modulus ? r - modulus : r;
+}
+
+/*
+ * Function: (int64_t) inverseModular
+ * --------------------
+ * Inverse of a modulo p with the extended Euclidean algorithm, or 0 if a
+ * has no inverse
+ *
+ *  a (int64_t): the residue to invert
+ *  modulus (int64_t): p
+*/
+int64_t inverseModular(int64_t a, int64_t modulus){
+    int64_t old_r = a % modulus;
+    int64_t r = modulus;
+    int64_t old_s = 1;
+    int64_t s = 0;
+    while(r != 0){
+        int64_t quotient = old_r / r;
+        int64_t swap = r;
+        r = old_r - quotient * r;
+        old_r = swap;
+        swap = s;
+        s = old_s - quotient * s;
+        old_s = swap;
+    }
+    if(old_r != 1){
+        return 0;
+    }
+    return old_s < 0 ? old_s + modulus : old_s;
+}
+
+/*
+ * Function: (bool) multiplyModular
+ * --------------------
+ * Exact product of two matrices modulo p
+ * The shared dimension is cut into blocks short enough that a block's sum
+ * of products, plus the reduced value carried from the previous blocks,
+ * stays below 2^53: (p - 1)^2 * block + p <= 2^53. Each block runs on the
+ * double precision GEMM register tiles with no reduction at all, and the
+ * tile is reduced once per block
+ *
+ *  matrix_a (pointer): the left matrix
+ *  matrix_b (pointer): the right matrix, same modulus
+ *  result (pointer): the result, data must be preallocated
+ *
+ *  Returns true if successful, false on dimension or modulus mismatch
+*/
+bool multiplyModular(const ModularMatrix *matrix_a, const ModularMatrix *matrix_b, ModularMatrix *result){
+    if(matrix_a->cols != matrix_b->rows || matrix_a->modulus != matrix_b->modulus){
+        printf("Incompatible dimensions or moduli in modular matrix multiplication\n");
+        return false;
+    }
+    if(matrix_a->modulus < 2 || matrix_a->modulus >= MODULAR_MAX_MODULUS){
+        printf("Modulus must be between 2 and 2^26\n");
+        return false;
+    }
+    double modulus = (double)matrix_a->modulus;
+    double inverse = 1.0 / modulus;
+    double largest = (modulus - 1) * (modulus - 1);
+    double block_limit = (9007199254740992.0 - modulus) / largest;
+    int inner = matrix_a->cols;
+    int block = block_limit < inner ? (int)block_limit : (inner > 0 ? inner : 1);
+    result->rows = matrix_a->rows;
+    result->cols = matrix_b->cols;
+    result->modulus = matrix_a->modulus;
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    double reduced[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    int row;
+    int col;
+    int k;
+    int i;
+    int j;
+    for(col = 0; col < result->cols; col += GEMM_TILE_COLS){
+        int tile_cols = result->cols - col < GEMM_TILE_COLS ? result->cols - col : GEMM_TILE_COLS;
+        for(row = 0; row < result->rows; row += GEMM_TILE_ROWS){
+            int tile_rows = result->rows - row < GEMM_TILE_ROWS ? result->rows - row : GEMM_TILE_ROWS;
+            for(i = 0; i < GEMM_TILE_ROWS; i++){
+                for(j = 0; j < GEMM_TILE_COLS; j++){
+                    reduced[i][j] = 0;
+                }
+            }
+            for(k = 0; k < inner; k += block){
+                int length = inner - k < block ? inner - k : block;
+                multiplyMicroTile(matrix_a->data + (size_t)row * inner + k, inner, 1,
+                                  matrix_b->data + (size_t)k * matrix_b->cols + col, matrix_b->cols, 1,
+                                  length, tile_rows, tile_cols, tile);
+                /* Delayed reduction, once per block */
+                for(i = 0; i < tile_rows; i++){
+                    for(j = 0; j < tile_cols; j++){
+                        reduced[i][j] = reduceModular(reduced[i][j] + tile[i][j], modulus, inverse);
+                    }
+                }
+            }
+            for(i = 0; i < tile_rows; i++){
+                for(j = 0; j < tile_cols; j++){
+                    *(result->data + (row + i) * result->cols + col + j) = reduced[i][j];
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (int) eliminateModular
+ * --------------------
+ * Row reduces a matrix modulo a prime in place and returns its rank
+ * Shared by modularLU and modularRank. Multipliers are kept below the
+ * pivots, so for a square matrix of full rank the result is L and U of
+ * P A = L U with the unit diagonal of L implied. A column without a pivot
+ * is skipped, after which the pivots and their multipliers drift right of
+ * the diagonal: the result is then a row echelon form with the multipliers
+ * mixed in, and only the rank is meaningful
+ *
+ *  matrix (pointer): the matrix, modified in place
+ *  permutation (pointer): receives the row permutation, or NULL
+*/
+int eliminateModular(ModularMatrix *matrix, int *permutation){
+    double modulus = (double)matrix->modulus;
+    double inverse = 1.0 / modulus;
+    int cols = matrix->cols;
+    int rank = 0;
+    int r;
+    int c;
+    int i;
+    if(permutation != NULL){
+        for(r = 0; r < matrix->rows; r++){
+            permutation[r] = r;
+        }
+    }
+    for(c = 0; c < cols && rank < matrix->rows; c++){
+        /* Any nonzero residue is a valid pivot */
+        int pivot = -1;
+        for(r = rank; r < matrix->rows; r++){
+            if(*(matrix->data + (size_t)r * cols + c) != 0){
+                pivot = r;
+                break;
+            }
+        }
+        if(pivot < 0){
+            continue;
+        }
+        if(pivot != rank){
+            for(i = 0; i < cols; i++){
+                double swap = *(matrix->data + (size_t)pivot * cols + i);
+                *(matrix->data + (size_t)pivot * cols + i) = *(matrix->data + (size_t)rank * cols + i);
+                *(matrix->data + (size_t)rank * cols + i) = swap;
+            }
+            if(permutation != NULL){
+                int swap = permutation[pivot];
+                permutation[pivot] = permutation[rank];
+                permutation[rank] = swap;
+            }
+        }
+        const double *pivot_row = matrix->data + (size_t)rank * cols;
+        double pivot_inverse = (double)inverseModular((int64_t)pivot_row[c], matrix->modulus);
+        for(r = rank + 1; r < matrix->rows; r++){
+            double *row = matrix->data + (size_t)r * cols;
+            if(row[c] == 0){
+                continue;
+            }
+            double factor = reduceModular(row[c] * pivot_inverse, modulus, inverse);
+            double negated = modulus - factor;
+            /* row - factor * pivot_row, every term below p + p^2 < 2^53 */
+            for(i = c + 1; i < cols; i++){
+                row[i] = reduceModular(row[i] + negated * pivot_row[i], modulus, inverse);
+            }
+            row[c] = factor;
+        }
+        rank++;
+    }
+    return rank;
+}
+
+/*
+ * Function: (bool) modularLU
+ * --------------------
+ * In-place LU factorization P A = L U of a square matrix modulo a prime
+ * L is unit lower triangular and stored below the diagonal, U on and above
+ * Singular matrices have no such factorization with this storage, see
+ * eliminateModular; they are reported through the return value and rank
+ *
+ *  matrix (pointer): the matrix, replaced by L and U
+ *  permutation (pointer): receives P, row i of P A is row permutation[i] of A
+ *  rank (pointer): receives the rank, or NULL
+ *
+ *  Returns true if successful, false if the matrix is not square or is
+ *  singular modulo the prime, in which case the contents are not L and U
+*/
+bool modularLU(ModularMatrix *matrix, int *permutation, int *rank){
+    if(matrix->rows != matrix->cols){
+        printf("Modular LU needs a square matrix\n");
+        return false;
+    }
+    int found = eliminateModular(matrix, permutation);
+    if(rank != NULL){
+        *rank = found;
+    }
+    if(found < matrix->rows){
+        printf("Matrix is singular modulo %lld\n", (long long)matrix->modulus);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: (int) modularRank
+ * --------------------
+ * Rank of a matrix modulo a prime, computed on a copy
+ * Returns -1 on allocation failure
+ *
+ *  matrix (pointer): the matrix
+*/
+int modularRank(const ModularMatrix *matrix){
+    ModularMatrix copy = {matrix->rows, matrix->cols, matrix->modulus,
+                          (double *)malloc((size_t)matrix->rows * matrix->cols * sizeof(double))};
+    if(copy.data == NULL){
+        printf("Memory allocation failed for modular rank.\n");
+        return -1;
+    }
+    memcpy(copy.data, matrix->data, (size_t)matrix->rows * matrix->cols * sizeof(double));
+    int rank = eliminateModular(&copy, NULL);
+    free(copy.data);
+    return rank;
+}
+
+/*
+ * Struct: DoubleDouble
+ * --------------------
+ * Unevaluated sum hi + lo of two doubles with |lo| <= ulp(hi) / 2, giving
+ * about 106 bits of significand
+*/
+typedef struct{
+    double hi;
+    double lo;
+} DoubleDouble;
+
+/*
+ * Struct: DoubleDoubleMatrix
+ * --------------------
+ * Matrix of DoubleDouble entries kept as two separate arrays of high and
+ * low parts, so the kernels stream contiguous doubles that vectorize
+ *
+ *  rows (int): number of rows
+ *  cols (int): number of columns
+ *  hi (pointer): high parts, laid out like Matrix
+ *  lo (pointer): low parts, laid out like Matrix
+*/
+typedef struct{
+    int rows;
+    int cols;
+    double *hi;
+    double *lo;
+} DoubleDoubleMatrix;
+
+/*
+ * Function: (DoubleDouble) twoSum
+ * --------------------
+ * Error-free sum: returns s = fl(a + b) and the exact rounding error e,
+ * a + b = s + e, for any ordering of a and b (Knuth)
+*/
+DoubleDouble twoSum(double a, double b){
+    DoubleDouble result;
+    result.hi = a + b;
+    double b_virtual = result.hi - a;
+    result.lo = (a - (result.hi - b_virtual)) + (b - b_virtual);
+    return result;
+}
+
+/*
+ * Function: (DoubleDouble) fastTwoSum
+ * --------------------
+ * Error-free sum when |a| >= |b| (Dekker), three operations instead of six
+*/
+DoubleDouble fastTwoSum(double a, double b){
+    DoubleDouble result;
+    result.hi = a + b;
+    result.lo = b - (result.hi - a);
+    return result;
+}
+
+/*
+ * Function: (DoubleDouble) twoProduct
+ * --------------------
+ * Error-free product: p = fl(a b) and the exact error e, a b = p + e
+ * A single fused multiply-add gives the error when the target has one,
+ * otherwise both factors are split in halves with Dekker's method
+*/
+DoubleDouble twoProduct(double a, double b){
+    DoubleDouble result;
+    result.hi = a * b;
+#ifdef FP_FAST_FMA
+    result.lo = fma(a, b, -result.hi);
+#else
+    double a_split = 134217729.0 * a;
+    double a_high = a_split - (a_split - a);
+    double a_low = a - a_high;
+    double b_split = 134217729.0 * b;
+    double b_high = b_split - (b_split - b);
+    double b_low = b - b_high;
+    result.lo = ((a_high * b_high - result.hi) + a_high * b_low + a_low * b_high) + a_low * b_low;
+#endif
+    return result;
+}
+
+/*
+ * Function: (DoubleDouble) addDoubleDouble
+ * --------------------
+ * Sum of two double-double numbers, accurate to about 2^-104 relative
+*/
+DoubleDouble addDoubleDouble(DoubleDouble a, DoubleDouble b){
+    DoubleDouble high = twoSum(a.hi, b.hi);
+    DoubleDouble low = twoSum(a.lo, b.lo);
+    high.lo += low.hi;
+    high = fastTwoSum(high.hi, high.lo);
+    high.lo += low.lo;
+    return fastTwoSum(high.hi, high.lo);
+}
+
+/*
+ * Function: (DoubleDouble) multiplyDoubleDouble
+ * --------------------
+ * Product of two double-double numbers
+*/
+DoubleDouble multiplyDoubleDouble(DoubleDouble a, DoubleDouble b){
+    DoubleDouble product = twoProduct(a.hi, b.hi);
+    product.lo += a.hi * b.lo + a.lo * b.hi;
+    return fastTwoSum(product.hi, product.lo);
+}
+
+/*
+ * Function: (DoubleDouble) sumDoubleDouble
+ * --------------------
+ * Sums an array of doubles as accurately as if computed in double-double
+ * (Sum2 of Ogita, Rump and Oishi): the rounding errors of the running sum
+ * are collected separately and added at the end
+ *
+ *  values (pointer): the values
+ *  count (int): number of values
+*/
+DoubleDouble sumDoubleDouble(const double *values, int count){
+    DoubleDouble total = {0.0, 0.0};
+    int i;
+    for(i = 0; i < count; i++){
+        DoubleDouble step = twoSum(total.hi, values[i]);
+        total.hi = step.hi;
+        total.lo += step.lo;
+    }
+    return fastTwoSum(total.hi, total.lo);
+}
+
+/*
+ * Function: (DoubleDouble) dotDoubleDouble
+ * --------------------
+ * Dot product of two arrays of doubles as if computed in double-double
+ * (Dot2 of Ogita, Rump and Oishi), the result is as accurate as the plain
+ * dot product would be for a condition number 2^53 times larger
+ *
+ *  x (pointer): the first array
+ *  y (pointer): the second array
+ *  count (int): number of elements
+*/
+DoubleDouble dotDoubleDouble(const double *x, const double *y, int count){
+    DoubleDouble total = {0.0, 0.0};
+    int i;
+    for(i = 0; i < count; i++){
+        DoubleDouble product = twoProduct(x[i], y[i]);
+        DoubleDouble step = twoSum(total.hi, product.hi);
+        total.hi = step.hi;
+        total.lo += step.lo + product.lo;
+    }
+    return fastTwoSum(total.hi, total.lo);
+}
+
+/*
+ * Function: (bool) doubleDoubleFromMatrix
+ * --------------------
+ * Copies a matrix into double-double form with zero low parts
+ *
+ *  matrix (pointer): a pointer to the matrix
+ *  result (pointer): the result, hi and lo must be preallocated
+ *
+ *  Returns true if successful
+*/
+bool doubleDoubleFromMatrix(const Matrix *matrix, DoubleDoubleMatrix *result){
+    result->rows = matrix->rows;
+    result->cols = matrix->cols;
+    int i;
+    for(i = 0; i < matrix->rows * matrix->cols; i++){
+        result->hi[i] = *(matrix->data + i);
+        result->lo[i] = 0.0;
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) multiplyMatricesDoubleDouble
+ * --------------------
+ * Multiplies two double-double matrices with double-double accumulation
+ * Loops run r, k, c like multiplyMatricesStridedBatched: A_{r,k} is
+ * broadcast against row k of B and the row of the result accumulates in
+ * place, so the inner loop walks four contiguous arrays with no branches
+ * and vectorizes. Costs roughly 10 to 20 times the double product
+ *
+ *  matrix_a (pointer): the left matrix
+ *  matrix_b (pointer): the right matrix
+ *  result (pointer): the result, hi and lo must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool multiplyMatricesDoubleDouble(const DoubleDoubleMatrix *matrix_a, const DoubleDoubleMatrix *matrix_b,
+                                  DoubleDoubleMatrix *result){
+    if(matrix_a->cols != matrix_b->rows){
+        printf("Incompatible dimensions in double-double matrix multiplication\n");
+        return false;
+    }
+    result->rows = matrix_a->rows;
+    result->cols = matrix_b->cols;
+    int cols = result->cols;
+    int r;
+    int k;
+    int c;
+    for(r = 0; r < matrix_a->rows; r++){
+        double *out_hi = result->hi + (size_t)r * cols;
+        double *out_lo = result->lo + (size_t)r * cols;
+        for(c = 0; c < cols; c++){
+            out_hi[c] = 0.0;
+            out_lo[c] = 0.0;
+        }
+        for(k = 0; k < matrix_a->cols; k++){
+            DoubleDouble a_rk = {matrix_a->hi[(size_t)r * matrix_a->cols + k],
+                                 matrix_a->lo[(size_t)r * matrix_a->cols + k]};
+            const double *b_hi = matrix_b->hi + (size_t)k * cols;
+            const double *b_lo = matrix_b->lo + (size_t)k * cols;
+            for(c = 0; c < cols; c++){
+                DoubleDouble b_kc = {b_hi[c], b_lo[c]};
+                DoubleDouble accumulated = {out_hi[c], out_lo[c]};
+                accumulated = addDoubleDouble(accumulated, multiplyDoubleDouble(a_rk, b_kc));
+                out_hi[c] = accumulated.hi;
+                out_lo[c] = accumulated.lo;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Enum: TraversalDirection
+ * --------------------
+ * How sparseVecMatSemiring walks the graph
+ *
+ *  TRAVERSAL_PUSH: scatter from the entries present in x along rows of A,
+ *                  cheap when the frontier is small
+ *  TRAVERSAL_PULL: gather into every allowed output along rows of A^T,
+ *                  cheap when the frontier is large and the mask is tight
+ *  TRAVERSAL_AUTO: push or pull depending on how many edges leave x
+*/
+typedef enum {
+    TRAVERSAL_PUSH,
+    TRAVERSAL_PULL,
+    TRAVERSAL_AUTO
+} TraversalDirection;
+
+/*
+ * Function: (double) semiringZero
+ * --------------------
+ * Additive identity of a semiring, which also marks absent entries of the
+ * vectors handled by the sparse semiring operations
+ *
+ *  semiring (Semiring): the semiring
+*/
+double semiringZero(Semiring semiring){
+    switch(semiring){
+        case SEMIRING_MIN_PLUS:
+            return INFINITY;
+        case SEMIRING_MAX_PLUS:
+            return -INFINITY;
+        default:
+            return 0.0;
+    }
+}
+
+/*
+ * Function: (bool) transposeSparseMatrix
+ * --------------------
+ * Builds the CSR form of A^T (equivalently the CSC form of A) by counting
+ * the entries of every column and scattering them. Columns come out sorted
+ * The arrays of the result are allocated here
+ *
+ *  matrix (pointer): the sparse matrix
+ *  result (pointer): the transposed result
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool transposeSparseMatrix(const SparseMatrix *matrix, SparseMatrix *result){
+    result->rows = matrix->cols;
+    result->cols = matrix->rows;
+    result->nnz = matrix->nnz;
+    result->row_ptr = (int *)calloc((size_t)matrix->cols + 1, sizeof(int));
+    result->col_index = (int *)malloc((size_t)(matrix->nnz > 0 ? matrix->nnz : 1) * sizeof(int));
+    result->values = (double *)malloc((size_t)(matrix->nnz > 0 ? matrix->nnz : 1) * sizeof(double));
+    if(result->row_ptr == NULL || result->col_index == NULL || result->values == NULL){
+        printf("Memory allocation failed for sparse transpose.\n");
+        free(result->row_ptr);
+        free(result->col_index);
+        free(result->values);
+        return false;
+    }
+    int r;
+    int p;
+    for(p = 0; p < matrix->nnz; p++){
+        result->row_ptr[matrix->col_index[p] + 1]++;
+    }
+    for(r = 0; r < matrix->cols; r++){
+        result->row_ptr[r + 1] += result->row_ptr[r];
+    }
+    /* row_ptr[c] is used as the insertion point of column c, then restored */
+    for(r = 0; r < matrix->rows; r++){
+        for(p = matrix->row_ptr[r]; p < matrix->row_ptr[r + 1]; p++){
+            int position = result->row_ptr[matrix->col_index[p]]++;
+            result->col_index[position] = r;
+            result->values[position] = matrix->values[p];
+        }
+    }
+    for(r = matrix->cols; r > 0; r--){
+        result->row_ptr[r] = result->row_ptr[r - 1];
+    }
+    result->row_ptr[0] = 0;
+    return true;
+}
+
+/*
+ * Macro: DEFINE_SPARSE_SEMIRING
+ * --------------------
+ * Defines the sparse kernels of one semiring, specialized at compile time
+ * like DEFINE_SEMIRING_GEMM:
+ *
+ *  vecMatPush<SUFFIX>: y = x A scattering along the rows of A
+ *  vecMatPull<SUFFIX>: y = x A gathering along the rows of A^T. A gather
+ *                      stops early once it reaches TERMINAL, the value
+ *                      that addition can no longer change (1 for OR)
+ *  accumulateRow<SUFFIX>: Gustavson accumulation of row r of A B into a
+ *                         dense workspace, recording the touched columns
+ *
+ * mask (one flag per output) restricts which outputs are computed,
+ * complement inverts it; outputs outside the mask are left untouched
+*/
+#define DEFINE_SPARSE_SEMIRING(SUFFIX, ZERO, ADD, MULTIPLY, TERMINAL)                        \
+void vecMatPush##SUFFIX(const SparseMatrix *matrix, const double *x, const bool *mask,       \
+                        bool complement, double *y){                                         \
+    int i;                                                                                   \
+    int p;                                                                                   \
+    for(i = 0; i < matrix->rows; i++){                                                       \
+        double x_i = x[i];                                                                   \
+        if(x_i == ZERO){                                                                     \
+            continue;                                                                        \
+        }                                                                                    \
+        for(p = matrix->row_ptr[i]; p < matrix->row_ptr[i + 1]; p++){                        \
+            int j = matrix->col_index[p];                                                    \
+            if(mask == NULL || mask[j] != complement){                                       \
+                y[j] = ADD(y[j], MULTIPLY(x_i, matrix->values[p]));                          \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+}                                                                                            \
+void vecMatPull##SUFFIX(const SparseMatrix *transposed, const double *x, const bool *mask,   \
+                        bool complement, double *y){                                         \
+    int j;                                                                                   \
+    int p;                                                                                   \
+    for(j = 0; j < transposed->rows; j++){                                                   \
+        if(mask != NULL && mask[j] == complement){                                           \
+            continue;                                                                        \
+        }                                                                                    \
+        double total = y[j];                                                                 \
+        for(p = transposed->row_ptr[j]; p < transposed->row_ptr[j + 1]; p++){                \
+            double x_i = x[transposed->col_index[p]];                                        \
+            if(x_i != ZERO){                                                                 \
+                total = ADD(total, MULTIPLY(x_i, transposed->values[p]));                    \
+                if(total == TERMINAL){                                                       \
+                    break;                                                                   \
+                }                                                                            \
+            }                                                                                \
+        }                                                                                    \
+        y[j] = total;                                                                        \
+    }                                                                                        \
+}                                                                                            \
+void accumulateRow##SUFFIX(const SparseMatrix *matrix_a, const SparseMatrix *matrix_b, int r, \
+                           const int *allowed, double *values, int *stamp,                   \
+                           int *touched, int *touched_count){                                \
+    int p;                                                                                   \
+    int q;                                                                                   \
+    for(p = matrix_a->row_ptr[r]; p < matrix_a->row_ptr[r + 1]; p++){                        \
+        int k = matrix_a->col_index[p];                                                      \
+        double a_rk = matrix_a->values[p];                                                   \
+        for(q = matrix_b->row_ptr[k]; q < matrix_b->row_ptr[k + 1]; q++){                    \
+            int j = matrix_b->col_index[q];                                                  \
+            if(allowed != NULL && allowed[j] != r){                                          \
+                continue;                                                                    \
+            }                                                                                \
+            if(stamp[j] != r){                                                               \
+                stamp[j] = r;                                                                \
+                values[j] = ZERO;                                                            \
+                touched[(*touched_count)++] = j;                                             \
+            }                                                                                \
+            values[j] = ADD(values[j], MULTIPLY(a_rk, matrix_b->values[q]));                 \
+        }                                                                                    \
+    }                                                                                        \
+}
+
+DEFINE_SPARSE_SEMIRING(PlusTimes, 0.0, SEMIRING_SUM, SEMIRING_PRODUCT, NAN)
+DEFINE_SPARSE_SEMIRING(MinPlus, INFINITY, SEMIRING_MIN, SEMIRING_SUM, -INFINITY)
+DEFINE_SPARSE_SEMIRING(MaxPlus, -INFINITY, SEMIRING_MAX, SEMIRING_SUM, INFINITY)
+DEFINE_SPARSE_SEMIRING(MaxTimes, 0.0, SEMIRING_MAX, SEMIRING_PRODUCT, INFINITY)
+DEFINE_SPARSE_SEMIRING(OrAnd, 0.0, SEMIRING_OR, SEMIRING_AND, 1.0)
+
+/*
+ * Function: (bool) sparseVecMatSemiring
+ * --------------------
+ * Computes y = x A over a semiring for a sparse A and a dense vector x in
+ * which entries equal to semiringZero are absent, the core step of graph
+ * algorithms written as linear algebra: BFS over (or, and) with the visited
+ * set as a complemented mask, Bellman-Ford over (min, +), PageRank over
+ * (+, *). y starts at semiringZero everywhere, then the masked outputs are
+ * computed
+ * With TRAVERSAL_AUTO the kernel pulls when the edges leaving the present
+ * entries of x exceed nnz / SPARSE_PULL_RATIO and A^T is available, and
+ * pushes otherwise
+ *
+ *  matrix (pointer): A in CSR form, rows x cols
+ *  matrix_transposed (pointer): A^T in CSR form, or NULL to always push
+ *  x (pointer): input vector, one value per row of A
+ *  semiring (Semiring): the semiring
+ *  mask (pointer): one flag per column of A, or NULL for no mask
+ *  complement_mask (bool): compute the outputs whose flag is false instead
+ *  direction (TraversalDirection): push, pull or automatic
+ *  y (pointer): output vector, one value per column of A
+ *
+ *  Returns true if successful, false if pull is requested without A^T
+*/
+bool sparseVecMatSemiring(const SparseMatrix *matrix, const SparseMatrix *matrix_transposed,
+                          const double *x, Semiring semiring, const bool *mask, bool complement_mask,
+                          TraversalDirection direction, double *y){
+    double zero = semiringZero(semiring);
+    int i;
+    if(direction == TRAVERSAL_PULL && matrix_transposed == NULL){
+        printf("Pull traversal needs the transposed matrix\n");
+        return false;
+    }
+    if(direction == TRAVERSAL_AUTO){
+        long frontier_edges = 0;
+        for(i = 0; i < matrix->rows; i++){
+            if(x[i] != zero){
+                frontier_edges += matrix->row_ptr[i + 1] - matrix->row_ptr[i];
+            }
+        }
+        direction = (matrix_transposed != NULL && frontier_edges > matrix->nnz / SPARSE_PULL_RATIO) ?
+                    TRAVERSAL_PULL : TRAVERSAL_PUSH;
+    }
+    for(i = 0; i < matrix->cols; i++){
+        y[i] = zero;
+    }
+    bool push = direction == TRAVERSAL_PUSH;
+    switch(semiring){
+        case SEMIRING_MIN_PLUS:
+            if(push){
+                vecMatPushMinPlus(matrix, x, mask, complement_mask, y);
+            } else {
+                vecMatPullMinPlus(matrix_transposed, x, mask, complement_mask, y);
+            }
+            break;
+        case SEMIRING_MAX_PLUS:
+            if(push){
+                vecMatPushMaxPlus(matrix, x, mask, complement_mask, y);
+            } else {
+                vecMatPullMaxPlus(matrix_transposed, x, mask, complement_mask, y);
+            }
+            break;
+        case SEMIRING_MAX_TIMES:
+            if(push){
+                vecMatPushMaxTimes(matrix, x, mask, complement_mask, y);
+            } else {
+                vecMatPullMaxTimes(matrix_transposed, x, mask, complement_mask, y);
+            }
+            break;
+        case SEMIRING_OR_AND:
+            if(push){
+                vecMatPushOrAnd(matrix, x, mask, complement_mask, y);
+            } else {
+                vecMatPullOrAnd(matrix_transposed, x, mask, complement_mask, y);
+            }
+            break;
+        default:
+            if(push){
+                vecMatPushPlusTimes(matrix, x, mask, complement_mask, y);
+            } else {
+                vecMatPullPlusTimes(matrix_transposed, x, mask, complement_mask, y);
+            }
+            break;
+    }
+    return true;
+}
+
+/*
+ * Function: (int) compareIntegers
+ * --------------------
+ * qsort comparator for ints
+*/
+int compareIntegers(const void *a, const void *b){
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Function: (bool) sparseMultiplySemiring
+ * --------------------
+ * Sparse matrix product C = A B over a semiring (Gustavson's row by row
+ * algorithm with a dense accumulator)
+ * With a mask only the positions stored in the mask are computed, e.g.
+ * the edges of the graph when counting triangles. Columns of every output
+ * row are sorted. The arrays of the result are allocated here
+ *
+ *  matrix_a (pointer): the left sparse matrix
+ *  matrix_b (pointer): the right sparse matrix
+ *  semiring (Semiring): the semiring
+ *  mask (pointer): sparse pattern of the allowed outputs, or NULL
+ *  result (pointer): the sparse result
+ *
+ *  Returns true if successful, false on dimension mismatch or allocation failure
+*/
+bool sparseMultiplySemiring(const SparseMatrix *matrix_a, const SparseMatrix *matrix_b, Semiring semiring,
+                            const SparseMatrix *mask, SparseMatrix *result){
+    if(matrix_a->cols != matrix_b->rows ||
+       (mask != NULL && (mask->rows != matrix_a->rows || mask->cols != matrix_b->cols))){
+        printf("Incompatible dimensions in sparse semiring multiplication\n");
+        return false;
+    }
+    int cols = matrix_b->cols;
+    int capacity = matrix_a->nnz + matrix_b->nnz + 1;
+    double *values = (double *)malloc((size_t)cols * sizeof(double));
+    int *stamp = (int *)malloc((size_t)cols * sizeof(int));
+    int *allowed = (int *)malloc((size_t)cols * sizeof(int));
+    int *touched = (int *)malloc((size_t)cols * sizeof(int));
+    result->rows = matrix_a->rows;
+    result->cols = cols;
+    result->nnz = 0;
+    result->row_ptr = (int *)malloc(((size_t)matrix_a->rows + 1) * sizeof(int));
+    result->col_index = (int *)malloc((size_t)capacity * sizeof(int));
+    result->values = (double *)malloc((size_t)capacity * sizeof(double));
+    bool ok = values != NULL && stamp != NULL && allowed != NULL && touched != NULL &&
+              result->row_ptr != NULL && result->col_index != NULL && result->values != NULL;
+    int r;
+    int j;
+    int p;
+    if(ok){
+        for(j = 0; j < cols; j++){
+            stamp[j] = -1;
+            allowed[j] = -1;
+        }
+    }
+    for(r = 0; ok && r < matrix_a->rows; r++){
+        int touched_count = 0;
+        if(mask != NULL){
+            for(p = mask->row_ptr[r]; p < mask->row_ptr[r + 1]; p++){
+                allowed[mask->col_index[p]] = r;
+            }
+        }
+        const int *row_allowed = mask != NULL ? allowed : NULL;
+        switch(semiring){
+            case SEMIRING_MIN_PLUS:
+                accumulateRowMinPlus(matrix_a, matrix_b, r, row_allowed, values, stamp, touched, &touched_count);
+                break;
+            case SEMIRING_MAX_PLUS:
+                accumulateRowMaxPlus(matrix_a, matrix_b, r, row_allowed, values, stamp, touched, &touched_count);
+                break;
+            case SEMIRING_MAX_TIMES:
+                accumulateRowMaxTimes(matrix_a, matrix_b, r, row_allowed, values, stamp, touched, &touched_count);
+                break;
+            case SEMIRING_OR_AND:
+                accumulateRowOrAnd(matrix_a, matrix_b, r, row_allowed, values, stamp, touched, &touched_count);
+                break;
+            default:
+                accumulateRowPlusTimes(matrix_a, matrix_b, r, row_allowed, values, stamp, touched, &touched_count);
+                break;
+        }
+        /* Grow the output arrays when needed */
+        if(result->nnz + touched_count > capacity){
+            while(result->nnz + touched_count > capacity){
+                capacity *= 2;
+            }
+            int *grown_index = (int *)realloc(result->col_index, (size_t)capacity * sizeof(int));
+            if(grown_index != NULL){
+                result->col_index = grown_index;
+            }
+            double *grown_values = (double *)realloc(result->values, (size_t)capacity * sizeof(double));
+            if(grown_values != NULL){
+                result->values = grown_values;
+            }
+            ok = grown_index != NULL && grown_values != NULL;
+            if(!ok){
+                break;
+            }
+        }
+        qsort(touched, touched_count, sizeof(int), compareIntegers);
+        result->row_ptr[r] = result->nnz;
+        for(p = 0; p < touched_count; p++){
+            result->col_index[result->nnz] = touched[p];
+            result->values[result->nnz] = values[touched[p]];
+            result->nnz++;
+        }
+    }
+    free(values);
+    free(stamp);
+    free(allowed);
+    free(touched);
+    if(!ok){
+        printf("Memory allocation failed for sparse semiring multiplication.\n");
+        freeSparseMatrix(result);
+        return false;
+    }
+    result->row_ptr[matrix_a->rows] = result->nnz;
+    return true;
+}
+
+/*
+ * Enum: EmbeddingReduction
+ * --------------------
+ * How embeddingBag combines the rows of a bag
+*/
+typedef enum {
+    EMBEDDING_SUM,
+    EMBEDDING_MEAN,
+    EMBEDDING_MAX
+} EmbeddingReduction;
+
+/*
+ * Function: (void) prefetchRow
+ * --------------------
+ * Asks for every cache line of a row to be loaded ahead of its use
+ *
+ *  row (pointer): first element of the row
+ *  cols (int): length of the row
+*/
+void prefetchRow(const double *row, int cols){
+    int c;
+    for(c = 0; c < cols; c += 8){
+        PREFETCH_READ(row + c);
+    }
+}
+
+/*
+ * Function: (bool) checkRowIndices
+ * --------------------
+ * Verifies that every index addresses a row of the matrix
+ *
+ *  indices (pointer): the row indices
+ *  count (int): number of indices
+ *  rows (int): number of rows of the matrix
+*/
+bool checkRowIndices(const int *indices, int count, int rows){
+    int i;
+    for(i = 0; i < count; i++){
+        if(indices[i] < 0 || indices[i] >= rows){
+            printf("Row index %d out of range\n", indices[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Struct: GatherTask
+ * --------------------
+ * The output rows copied by one thread of gatherRows
+ *
+ *  matrix (pointer): the source matrix
+ *  indices (pointer): rows to copy
+ *  result (pointer): the result
+ *  first (int): first output row of the task
+ *  end (int): one past the last output row of the task
+*/
+typedef struct{
+    const Matrix *matrix;
+    const int *indices;
+    Matrix *result;
+    int first;
+    int end;
+} GatherTask;
+
+/*
+ * Function: (void *) runGatherTask
+ * --------------------
+ * Thread entry point of gatherRows
+ *
+ *  argument (pointer): the GatherTask
+ *
+ *  Returns NULL
+*/
+void *runGatherTask(void *argument){
+    GatherTask *task = (GatherTask *)argument;
+    int cols = task->matrix->cols;
+    int i;
+    for(i = task->first; i < task->end; i++){
+        if(i + GATHER_PREFETCH_DISTANCE < task->end){
+            prefetchRow(task->matrix->data + (size_t)task->indices[i + GATHER_PREFETCH_DISTANCE] * cols, cols);
+        }
+        memcpy(task->result->data + (size_t)i * cols, task->matrix->data + (size_t)task->indices[i] * cols,
+               cols * sizeof(double));
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) gatherRows
+ * --------------------
+ * Copies the selected rows of a matrix, in order, into the rows of the
+ * result. The row GATHER_PREFETCH_DISTANCE positions ahead is prefetched
+ * while the current one is copied, hiding the latency of random rows
+ * The output rows are split into one contiguous run per thread, so every
+ * row has a single writer
+ *
+ *  matrix (pointer): the source matrix
+ *  indices (pointer): rows to copy, duplicates allowed
+ *  count (int): number of indices
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  result (pointer): count x cols result, data must be preallocated
+ *
+ *  Returns true if successful, false on an out of range index or
+ *  allocation failure
+*/
+bool gatherRows(const Matrix *matrix, const int *indices, int count, int thread_count, Matrix *result){
+    if(!checkRowIndices(indices, count, matrix->rows)){
+        return false;
+    }
+    int t;
+    result->rows = count;
+    result->cols = matrix->cols;
+    if(thread_count > count){
+        thread_count = count;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    GatherTask *tasks = (GatherTask *)malloc(sizeof(GatherTask) * (size_t)thread_count);
+    if(tasks == NULL){
+        printf("Memory allocation failed for gather tasks.\n");
+        return false;
+    }
+    for(t = 0; t < thread_count; t++){
+        GatherTask task = {matrix, indices, result,
+                           (int)((long long)count * t / thread_count),
+                           (int)((long long)count * (t + 1) / thread_count)};
+        tasks[t] = task;
+    }
+    runParallel(runGatherTask, tasks, sizeof(GatherTask), thread_count);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Struct: ScatterTask
+ * --------------------
+ * The slice of target rows owned by one thread of scatterAddRows
+ *
+ *  source (pointer): the rows to add, one per index
+ *  indices (pointer): destination rows
+ *  target (pointer): the matrix accumulated into
+ *  first_row (int): first target row owned by the thread
+ *  end_row (int): one past the last target row owned by the thread
+*/
+typedef struct{
+    const Matrix *source;
+    const int *indices;
+    Matrix *target;
+    int first_row;
+    int end_row;
+} ScatterTask;
+
+/*
+ * Function: (void *) runScatterTask
+ * --------------------
+ * Thread entry point of scatterAddRows. Walks every index in order and
+ * adds only the rows whose destination falls in the slice of the task
+ *
+ *  argument (pointer): the ScatterTask
+ *
+ *  Returns NULL
+*/
+void *runScatterTask(void *argument){
+    ScatterTask *task = (ScatterTask *)argument;
+    int cols = task->source->cols;
+    int i;
+    int c;
+    for(i = 0; i < task->source->rows; i++){
+        int destination = task->indices[i];
+        if(destination < task->first_row || destination >= task->end_row){
+            continue;
+        }
+        if(i + GATHER_PREFETCH_DISTANCE < task->source->rows){
+            prefetchRow(task->target->data + (size_t)task->indices[i + GATHER_PREFETCH_DISTANCE] * cols, cols);
+        }
+        const double *in = task->source->data + (size_t)i * cols;
+        double *out = task->target->data + (size_t)destination * cols;
+        for(c = 0; c < cols; c++){
+            out[c] += in[c];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) scatterAddRows
+ * --------------------
+ * Adds row i of the source into row indices[i] of the target, the
+ * transpose of gatherRows (e.g. the gradient of an embedding lookup)
+ * Repeated indices accumulate every contribution, applied in order of
+ * appearance so the result is deterministic
+ * With several threads the target rows are segmented into one contiguous
+ * slice per thread and each thread applies only the indices landing in
+ * its slice. No row is written by two threads, so no atomics are needed,
+ * and the per row order is unchanged, so the result matches one thread
+ * exactly. Each thread reads the whole index array, which is cheap next
+ * to the rows it adds
+ *
+ *  source (pointer): the rows to add, one per index
+ *  indices (pointer): destination rows, duplicates allowed
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  target (pointer): the matrix accumulated into
+ *
+ *  Returns true if successful, false on mismatch, an out of range index
+ *  or allocation failure
+*/
+bool scatterAddRows(const Matrix *source, const int *indices, int thread_count, Matrix *target){
+    if(source->cols != target->cols){
+        printf("Mismatch in the dimensions when scattering rows\n");
+        return false;
+    }
+    if(!checkRowIndices(indices, source->rows, target->rows)){
+        return false;
+    }
+    int t;
+    if(thread_count > target->rows){
+        thread_count = target->rows;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    ScatterTask *tasks = (ScatterTask *)malloc(sizeof(ScatterTask) * (size_t)thread_count);
+    if(tasks == NULL){
+        printf("Memory allocation failed for scatter tasks.\n");
+        return false;
+    }
+    for(t = 0; t < thread_count; t++){
+        ScatterTask task = {source, indices, target,
+                            (int)((long long)target->rows * t / thread_count),
+                            (int)((long long)target->rows * (t + 1) / thread_count)};
+        tasks[t] = task;
+    }
+    runParallel(runScatterTask, tasks, sizeof(ScatterTask), thread_count);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Struct: EmbeddingTask
+ * --------------------
+ * The bags reduced by one thread of embeddingBag
+ *
+ *  table (pointer): the embedding table
+ *  indices (pointer): the rows of all bags
+ *  offsets (pointer): bag_count + 1 offsets into indices
+ *  weights (pointer): one weight per index, or NULL
+ *  reduction (EmbeddingReduction): how rows are combined
+ *  result (pointer): the result
+ *  first_bag (int): first bag of the task
+ *  end_bag (int): one past the last bag of the task
+*/
+typedef struct{
+    const Matrix *table;
+    const int *indices;
+    const int *offsets;
+    const double *weights;
+    EmbeddingReduction reduction;
+    Matrix *result;
+    int first_bag;
+    int end_bag;
+} EmbeddingTask;
+
+/*
+ * Function: (void *) runEmbeddingTask
+ * --------------------
+ * Thread entry point of embeddingBag
+ *
+ *  argument (pointer): the EmbeddingTask
+ *
+ *  Returns NULL
+*/
+void *runEmbeddingTask(void *argument){
+    EmbeddingTask *task = (EmbeddingTask *)argument;
+    const Matrix *table = task->table;
+    const int *indices = task->indices;
+    EmbeddingReduction reduction = task->reduction;
+    int cols = table->cols;
+    int total = task->offsets[task->end_bag];
+    int bag;
+    int i;
+    int c;
+    for(bag = task->first_bag; bag < task->end_bag; bag++){
+        double *out = task->result->data + (size_t)bag * cols;
+        int start = task->offsets[bag];
+        int end = task->offsets[bag + 1];
+        for(c = 0; c < cols; c++){
+            out[c] = (reduction == EMBEDDING_MAX && end > start) ? -INFINITY : 0.0;
+        }
+        for(i = start; i < end; i++){
+            if(i + GATHER_PREFETCH_DISTANCE < total){
+                prefetchRow(table->data + (size_t)indices[i + GATHER_PREFETCH_DISTANCE] * cols, cols);
+            }
+            const double *row = table->data + (size_t)indices[i] * cols;
+            if(reduction == EMBEDDING_MAX){
+                for(c = 0; c < cols; c++){
+                    out[c] = row[c] > out[c] ? row[c] : out[c];
+                }
+            } else {
+                double weight = task->weights != NULL ? task->weights[i] : 1.0;
+                for(c = 0; c < cols; c++){
+                    out[c] += weight * row[c];
+                }
+            }
+        }
+        if(reduction == EMBEDDING_MEAN && end > start){
+            for(c = 0; c < cols; c++){
+                out[c] /= (end - start);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) embeddingBag
+ * --------------------
+ * Looks up bags of rows of an embedding table and reduces each bag to a
+ * single row without materializing the gathered rows
+ * Bag b holds indices[offsets[b]] .. indices[offsets[b + 1] - 1]; empty
+ * bags give a row of zeros. Upcoming rows are prefetched as in gatherRows
+ * The bags are split into one contiguous run per thread, so every output
+ * row has a single writer
+ *
+ *  table (pointer): the embedding table
+ *  indices (pointer): the rows of all bags, one after the other
+ *  offsets (pointer): bag_count + 1 offsets into indices
+ *  bag_count (int): number of bags
+ *  weights (pointer): one weight per index for SUM and MEAN, or NULL
+ *  reduction (EmbeddingReduction): how rows are combined
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  result (pointer): bag_count x cols result, data must be preallocated
+ *
+ *  Returns true if successful, false on an out of range index or
+ *  allocation failure
+*/
+bool embeddingBag(const Matrix *table, const int *indices, const int *offsets, int bag_count,
+                  const double *weights, EmbeddingReduction reduction, int thread_count, Matrix *result){
+    int total = offsets[bag_count];
+    if(!checkRowIndices(indices, total, table->rows)){
+        return false;
+    }
+    int t;
+    result->rows = bag_count;
+    result->cols = table->cols;
+    if(thread_count > bag_count){
+        thread_count = bag_count;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    EmbeddingTask *tasks = (EmbeddingTask *)malloc(sizeof(EmbeddingTask) * (size_t)thread_count);
+    if(tasks == NULL){
+        printf("Memory allocation failed for embedding tasks.\n");
+        return false;
+    }
+    for(t = 0; t < thread_count; t++){
+        EmbeddingTask task = {table, indices, offsets, weights, reduction, result,
+                              (int)((long long)bag_count * t / thread_count),
+                              (int)((long long)bag_count * (t + 1) / thread_count)};
+        tasks[t] = task;
+    }
+    runParallel(runEmbeddingTask, tasks, sizeof(EmbeddingTask), thread_count);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Struct: SumTask
+ * --------------------
+ * The run of output tiles produced by one thread of sumMatricesN
+ *
+ *  operands (pointer): array of count pointers to the matrices
+ *  weights (pointer): one weight per operand, or NULL for a plain sum
+ *  count (int): number of operands
+ *  result (pointer): the result
+ *  first (size_t): first element of the run
+ *  end (size_t): one past the last element of the run
+*/
+typedef struct{
+    const Matrix *const *operands;
+    const double *weights;
+    int count;
+    Matrix *result;
+    size_t first;
+    size_t end;
+} SumTask;
+
+/*
+ * Function: (void *) runSumTask
+ * --------------------
+ * Thread entry point of sumMatricesN, sums its run SUM_TILE_ELEMENTS at a
+ * time
+ *
+ *  argument (pointer): the SumTask
+ *
+ *  Returns NULL
+*/
+void *runSumTask(void *argument){
+    SumTask *task = (SumTask *)argument;
+    size_t start;
+    size_t i;
+    int k;
+    for(start = task->first; start < task->end; start += SUM_TILE_ELEMENTS){
+        size_t length = task->end - start < SUM_TILE_ELEMENTS ? task->end - start : SUM_TILE_ELEMENTS;
+        double *out = task->result->data + start;
+        const double *in = task->operands[0]->data + start;
+        double weight = task->weights != NULL ? task->weights[0] : 1.0;
+        for(i = 0; i < length; i++){
+            out[i] = weight * in[i];
+        }
+        for(k = 1; k < task->count; k++){
+            in = task->operands[k]->data + start;
+            weight = task->weights != NULL ? task->weights[k] : 1.0;
+            for(i = 0; i < length; i++){
+                out[i] += weight * in[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) sumMatricesN
+ * --------------------
+ * Computes the weighted sum of count matrices of the same dimensions,
+ * result = sum_k weights[k] * operands[k]
+ * The output is produced SUM_TILE_ELEMENTS at a time: the tile stays in
+ * cache while every operand's matching piece is added into it, so each
+ * input is read once and the result is written once, instead of the
+ * count - 1 full passes of chained sumMatrices calls
+ * Tiles are independent, so the threads each take a contiguous run of
+ * whole tiles
+ * result may share its data with operands[0] but not with the others
+ *
+ *  operands (pointer): array of count pointers to the matrices
+ *  weights (pointer): one weight per operand, or NULL for a plain sum
+ *  count (int): number of operands, at least one
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false if the dimensions do not match or on
+ *  allocation failure
+*/
+bool sumMatricesN(const Matrix *const *operands, const double *weights, int count, int thread_count, Matrix *result){
+    if(count < 1){
+        printf("Need at least one matrix to sum\n");
+        return false;
+    }
+    int k;
+    for(k = 1; k < count; k++){
+        if(!checkDimensions(operands[0], operands[k])){
+            printf("Mismatch in the dimensions when summing\n");
+            return false;
+        }
+    }
+    size_t total = (size_t)operands[0]->rows * operands[0]->cols;
+    size_t tiles = (total + SUM_TILE_ELEMENTS - 1) / SUM_TILE_ELEMENTS;
+    int t;
+    result->rows = operands[0]->rows;
+    result->cols = operands[0]->cols;
+    if((size_t)thread_count > tiles){
+        thread_count = (int)tiles;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    SumTask *tasks = (SumTask *)malloc(sizeof(SumTask) * (size_t)thread_count);
+    if(tasks == NULL){
+        printf("Memory allocation failed for sum tasks.\n");
+        return false;
+    }
+    for(t = 0; t < thread_count; t++){
+        size_t first = tiles * t / thread_count * SUM_TILE_ELEMENTS;
+        size_t end = tiles * (t + 1) / thread_count * SUM_TILE_ELEMENTS;
+        SumTask task = {operands, weights, count, result, first, end < total ? end : total};
+        tasks[t] = task;
+    }
+    runParallel(runSumTask, tasks, sizeof(SumTask), thread_count);
+    free(tasks);
+    return true;
+}
+
+/*
+ * Struct: ConcurrentAccumulator
+ * --------------------
+ * Lets many threads add partial results into one shared matrix
+ * The target is cut into tiles of ACCUMULATOR_TILE_ELEMENTS. Each thread
+ * adds into its own private copies of the tiles it touches, with no
+ * synchronization at all, and merges them into the target when it calls
+ * accumulatorFlush. Every tile has a state word used during the merge:
+ * 0 when idle, -1 while one thread merges it exclusively with plain adds,
+ * n > 0 while n threads merge it concurrently with atomic compare-and-swap
+ * adds. A thread finding the tile idle takes it exclusively, one finding
+ * it in shared mode joins with CAS adds, and one finding it held
+ * exclusively moves on to its other tiles and comes back later, then
+ * opening the tile in shared mode if it has gone idle or joining it if
+ * it is shared. A flush thus only waits on tiles another thread is
+ * merging exclusively, which takes one pass over a single tile
+ *
+ *  target (pointer): the shared matrix
+ *  thread_count (int): number of thread slots
+ *  tile_count (int): number of tiles in the target
+ *  private_tiles (pointer): thread_count x tile_count tiles, NULL until used
+ *  states (pointer): merge state of every tile
+*/
+typedef struct{
+    Matrix *target;
+    int thread_count;
+    int tile_count;
+    double **private_tiles;
+    int *states;
+} ConcurrentAccumulator;
+
+/*
+ * Function: (void) atomicAddDouble
+ * --------------------
+ * Adds to a double shared between threads with a compare-and-swap loop
+ *
+ *  address (pointer): the shared value
+ *  value (double): the amount to add
+*/
+void atomicAddDouble(double *address, double value){
+    double expected;
+    double desired;
+    __atomic_load(address, &expected, __ATOMIC_RELAXED);
+    do {
+        desired = expected + value;
+    } while(!__atomic_compare_exchange(address, &expected, &desired, true,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Function: (bool) accumulatorInit
+ * --------------------
+ * Prepares an accumulator for a target matrix and a number of threads
+ * The target keeps its current contents, partial results are added to it
+ *
+ *  accumulator (pointer): the accumulator to initialize
+ *  target (pointer): the shared matrix
+ *  thread_count (int): number of threads that will add into it
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool accumulatorInit(ConcurrentAccumulator *accumulator, Matrix *target, int thread_count){
+    int total = target->rows * target->cols;
+    accumulator->target = target;
+    accumulator->thread_count = thread_count;
+    accumulator->tile_count = (total + ACCUMULATOR_TILE_ELEMENTS - 1) / ACCUMULATOR_TILE_ELEMENTS;
+    accumulator->private_tiles = (double **)calloc((size_t)thread_count * accumulator->tile_count + 1, sizeof(double *));
+    accumulator->states = (int *)calloc((size_t)accumulator->tile_count + 1, sizeof(int));
+    if(accumulator->private_tiles == NULL || accumulator->states == NULL){
+        printf("Memory allocation failed for concurrent accumulator.\n");
+        free(accumulator->private_tiles);
+        free(accumulator->states);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) accumulatorAddBlock
+ * --------------------
+ * Adds a block into the calling thread's private tiles, at the given
+ * position of the target. Touches no shared memory except to read the
+ * target's shape; each thread must use its own thread_id
+ *
+ *  accumulator (pointer): the accumulator
+ *  thread_id (int): the caller's slot, 0 .. thread_count - 1
+ *  block (pointer): the partial result
+ *  row, col (int): position of the block's first element in the target
+ *
+ *  Returns true if successful, false if the block does not fit or on
+ *  allocation failure
+*/
+bool accumulatorAddBlock(ConcurrentAccumulator *accumulator, int thread_id, const Matrix *block, int row, int col){
+    Matrix *target = accumulator->target;
+    if(row < 0 || col < 0 || row + block->rows > target->rows || col + block->cols > target->cols ||
+       thread_id < 0 || thread_id >= accumulator->thread_count){
+        printf("Block does not fit in the accumulator target\n");
+        return false;
+    }
+    double **tiles = accumulator->private_tiles + (size_t)thread_id * accumulator->tile_count;
+    int r;
+    int c;
+    for(r = 0; r < block->rows; r++){
+        int position = (row + r) * target->cols + col;
+        const double *in = block->data + (size_t)r * block->cols;
+        c = 0;
+        while(c < block->cols){
+            int tile = position / ACCUMULATOR_TILE_ELEMENTS;
+            int offset = position % ACCUMULATOR_TILE_ELEMENTS;
+            int length = ACCUMULATOR_TILE_ELEMENTS - offset;
+            if(length > block->cols - c){
+                length = block->cols - c;
+            }
+            if(tiles[tile] == NULL){
+                tiles[tile] = (double *)calloc(ACCUMULATOR_TILE_ELEMENTS, sizeof(double));
+                if(tiles[tile] == NULL){
+                    printf("Memory allocation failed for accumulator tile.\n");
+                    return false;
+                }
+            }
+            double *out = tiles[tile] + offset;
+            int i;
+            for(i = 0; i < length; i++){
+                out[i] += in[c + i];
+            }
+            c += length;
+            position += length;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) accumulatorAdd
+ * --------------------
+ * Adds a partial result the size of the whole target, see accumulatorAddBlock
+*/
+bool accumulatorAdd(ConcurrentAccumulator *accumulator, int thread_id, const Matrix *partial){
+    return accumulatorAddBlock(accumulator, thread_id, partial, 0, 0);
+}
+
+/*
+ * Function: (void) accumulatorFlush
+ * --------------------
+ * Merges the calling thread's private tiles into the target and resets
+ * them, following the tile states described in ConcurrentAccumulator
+ * Safe to call from all threads at once. The sum is complete once every
+ * thread has flushed and the threads have been joined
+ *
+ *  accumulator (pointer): the accumulator
+ *  thread_id (int): the caller's slot
+*/
+void accumulatorFlush(ConcurrentAccumulator *accumulator, int thread_id){
+    double **tiles = accumulator->private_tiles + (size_t)thread_id * accumulator->tile_count;
+    int total = accumulator->target->rows * accumulator->target->cols;
+    int pending = 1;
+    int contended = 0;
+    int tile;
+    int i;
+    while(pending > 0){
+        pending = 0;
+        for(tile = 0; tile < accumulator->tile_count; tile++){
+            if(tiles[tile] == NULL){
+                continue;
+            }
+            int *state = accumulator->states + tile;
+            double *out = accumulator->target->data + (size_t)tile * ACCUMULATOR_TILE_ELEMENTS;
+            int length = total - tile * ACCUMULATOR_TILE_ELEMENTS;
+            if(length > ACCUMULATOR_TILE_ELEMENTS){
+                length = ACCUMULATOR_TILE_ELEMENTS;
+            }
+            /* After a first pass the remaining tiles are known to be contended,
+               so an idle one is opened in shared mode rather than taken */
+            int expected = 0;
+            bool exclusive = !contended &&
+                             __atomic_compare_exchange_n(state, &expected, -1, false,
+                                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+            bool shared = false;
+            /* Otherwise join shared mode from the state actually observed,
+               retrying while other threads enter or leave it */
+            while(!exclusive && !shared && expected >= 0){
+                shared = __atomic_compare_exchange_n(state, &expected, expected + 1, false,
+                                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+            }
+            if(exclusive){
+                for(i = 0; i < length; i++){
+                    out[i] += tiles[tile][i];
+                }
+                __atomic_store_n(state, 0, __ATOMIC_RELEASE);
+            } else if(shared){
+                for(i = 0; i < length; i++){
+                    atomicAddDouble(out + i, tiles[tile][i]);
+                }
+                __atomic_fetch_sub(state, 1, __ATOMIC_RELEASE);
+            } else {
+                pending++;
+                continue;
+            }
+            free(tiles[tile]);
+            tiles[tile] = NULL;
+        }
+        contended = 1;
+    }
+}
+
+/*
+ * Function: (void) accumulatorDestroy
+ * --------------------
+ * Releases an accumulator. Tiles that were never flushed are discarded
+ *
+ *  accumulator (pointer): the accumulator
+*/
+void accumulatorDestroy(ConcurrentAccumulator *accumulator){
+    size_t i;
+    for(i = 0; i < (size_t)accumulator->thread_count * accumulator->tile_count; i++){
+        free(accumulator->private_tiles[i]);
+    }
+    free(accumulator->private_tiles);
+    free(accumulator->states);
+    accumulator->private_tiles = NULL;
+    accumulator->states = NULL;
+}
+
+/*
+ * Enum: ScanAxis
+ * --------------------
+ * Direction of a prefix sum: SCAN_ROWS accumulates along each row (left to
+ * right), SCAN_COLUMNS accumulates down each column (top to bottom)
+*/
+typedef enum {
+    SCAN_ROWS,
+    SCAN_COLUMNS
+} ScanAxis;
+
+/*
+ * Struct: ScanTask
+ * --------------------
+ * A block of rows handled by one thread of scanMatrix
+ *
+ *  matrix (pointer): the matrix being scanned
+ *  result (pointer): the result
+ *  axis (ScanAxis): direction of the sums
+ *  exclusive (bool): exclusive instead of inclusive scan
+ *  totals_only (bool): first pass of a column scan, only sum the block
+ *  first_row (int): first row of the block
+ *  row_count (int): number of rows in the block
+ *  carry (pointer): cols doubles, the block totals or the carry in
+*/
+typedef struct{
+    const Matrix *matrix;
+    Matrix *result;
+    ScanAxis axis;
+    bool exclusive;
+    bool totals_only;
+    int first_row;
+    int row_count;
+    double *carry;
+} ScanTask;
+
+/*
+ * Function: (void) scanRowBlock
+ * --------------------
+ * Scans every row of a block of rows along the row
+ *
+ *  matrix (pointer): the matrix being scanned
+ *  first_row (int): first row of the block
+ *  row_count (int): number of rows in the block
+ *  exclusive (bool): whether each element leaves itself out of its sum
+ *  result (pointer): a pointer to the result, data must be preallocated
+*/
+void scanRowBlock(const Matrix *matrix, int first_row, int row_count, bool exclusive, Matrix *result){
+    int r;
+    int c;
+    for(r = first_row; r < first_row + row_count; r++){
+        const double *in = matrix->data + (size_t)r * matrix->cols;
+        double *out = result->data + (size_t)r * matrix->cols;
+        double sum = 0.0;
+        for(c = 0; c < matrix->cols; c++){
+            double value = in[c];
+            out[c] = exclusive ? sum : sum + value;
+            sum += value;
+        }
+    }
+}
+
+/*
+ * Function: (void) columnBlockTotals
+ * --------------------
+ * Sums a block of rows column by column, the first pass of a blocked column
+ * scan. Blocks are independent, so each can go to a different thread
+ *
+ *  matrix (pointer): the matrix being scanned
+ *  first_row (int): first row of the block
+ *  row_count (int): number of rows in the block
+ *  totals (pointer): output, one sum per column
+*/
+void columnBlockTotals(const Matrix *matrix, int first_row, int row_count, double *totals){
+    int r;
+    int c;
+    for(c = 0; c < matrix->cols; c++){
+        totals[c] = 0.0;
+    }
+    for(r = first_row; r < first_row + row_count; r++){
+        const double *in = matrix->data + (size_t)r * matrix->cols;
+        for(c = 0; c < matrix->cols; c++){
+            totals[c] += in[c];
+        }
+    }
+}
+
+/*
+ * Function: (void) scanColumnBlock
+ * --------------------
+ * Scans a block of rows down the columns, starting from carry, the second
+ * pass of a blocked column scan. Rows are processed whole, so the inner
+ * loop runs along contiguous memory and vectorizes. Given the exclusive
+ * prefix of the columnBlockTotals of earlier blocks as carry, blocks are
+ * independent again. result may be the same matrix as the input
+ *
+ *  matrix (pointer): the matrix being scanned
+ *  first_row (int): first row of the block
+ *  row_count (int): number of rows in the block
+ *  exclusive (bool): whether each element leaves itself out of its sum
+ *  carry (pointer): per column sum of all rows above the block, updated to
+ *                   include the block on return
+ *  result (pointer): a pointer to the result, data must be preallocated
+*/
+void scanColumnBlock(const Matrix *matrix, int first_row, int row_count, bool exclusive, double *carry, Matrix *result){
+    int r;
+    int c;
+    for(r = first_row; r < first_row + row_count; r++){
+        const double *in = matrix->data + (size_t)r * matrix->cols;
+        double *out = result->data + (size_t)r * matrix->cols;
+        if(exclusive){
+            for(c = 0; c < matrix->cols; c++){
+                double value = in[c];
+                out[c] = carry[c];
+                carry[c] += value;
+            }
+        } else {
+            for(c = 0; c < matrix->cols; c++){
+                carry[c] += in[c];
+                out[c] = carry[c];
+            }
+        }
+    }
+}
+
+/*
+ * Function: (void *) runScanTask
+ * --------------------
+ * Thread entry point running a ScanTask. Column blocks are walked
+ * SCAN_BLOCK_ROWS rows at a time so the carry stays in cache
+ *
+ *  argument (pointer): the ScanTask
+ *
+ *  Returns NULL
+*/
+void *runScanTask(void *argument){
+    ScanTask *task = (ScanTask *)argument;
+    int end = task->first_row + task->row_count;
+    int r;
+    if(task->axis == SCAN_ROWS){
+        scanRowBlock(task->matrix, task->first_row, task->row_count, task->exclusive, task->result);
+    } else if(task->totals_only){
+        columnBlockTotals(task->matrix, task->first_row, task->row_count, task->carry);
+    } else {
+        for(r = task->first_row; r < end; r += SCAN_BLOCK_ROWS){
+            int row_count = end - r < SCAN_BLOCK_ROWS ? end - r : SCAN_BLOCK_ROWS;
+            scanColumnBlock(task->matrix, r, row_count, task->exclusive, task->carry, task->result);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) scanMatrix
+ * --------------------
+ * Computes cumulative sums of a matrix along rows or down columns
+ * Inclusive: result(r, c) = matrix(r, 0) + ... + matrix(r, c) for SCAN_ROWS
+ * Exclusive: the same sum without matrix(r, c) itself, so it starts at 0
+ * The rows are split into one block per thread. Row scans are independent
+ * per row. Column scans take two passes: every thread sums its block with
+ * columnBlockTotals, the block totals are prefix summed into one carry per
+ * block, and every thread scans its block with scanColumnBlock from its
+ * carry. With a single thread the first pass is skipped and the matrix is
+ * read once. result may be the same matrix as the input
+ *
+ *  matrix (pointer): the matrix to scan
+ *  axis (ScanAxis): direction of the sums
+ *  exclusive (bool): exclusive instead of inclusive scan
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool scanMatrix(const Matrix *matrix, ScanAxis axis, bool exclusive, int thread_count, Matrix *result){
+    int cols = matrix->cols;
+    int t;
+    int c;
+    if(thread_count > matrix->rows){
+        thread_count = matrix->rows;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    result->rows = matrix->rows;
+    result->cols = cols;
+    ScanTask *tasks = (ScanTask *)malloc(sizeof(ScanTask) * (size_t)thread_count);
+    double *carries = (double *)calloc((size_t)thread_count * cols + 1, sizeof(double));
+    if(tasks == NULL || carries == NULL){
+        printf("Memory allocation failed for scan.\n");
+        free(tasks);
+        free(carries);
+        return false;
+    }
+    int block = (matrix->rows + thread_count - 1) / thread_count;
+    if(block > 0){
+        thread_count = (matrix->rows + block - 1) / block;
+    }
+    for(t = 0; t < thread_count; t++){
+        int first = t * block;
+        ScanTask task = {matrix, result, axis, exclusive, thread_count > 1, first,
+                         matrix->rows - first < block ? matrix->rows - first : block,
+                         carries + (size_t)t * cols};
+        tasks[t] = task;
+    }
+    if(axis == SCAN_COLUMNS && thread_count > 1){
+        runParallel(runScanTask, tasks, sizeof(ScanTask), thread_count);
+        /* Exclusive prefix over the block totals gives each block its carry */
+        for(c = 0; c < cols; c++){
+            double running = 0.0;
+            for(t = 0; t < thread_count; t++){
+                double total = carries[(size_t)t * cols + c];
+                carries[(size_t)t * cols + c] = running;
+                running += total;
+            }
+        }
+        for(t = 0; t < thread_count; t++){
+            tasks[t].totals_only = false;
+        }
+    }
+    runParallel(runScanTask, tasks, sizeof(ScanTask), thread_count);
+    free(tasks);
+    free(carries);
+    return true;
+}
+
+/*
+ * Function: (bool) summedAreaTable
+ * --------------------
+ * Computes the summed-area table (integral image) of a matrix,
+ * result(r, c) = sum of matrix(i, j) for i <= r and j <= c
+ * One pass: a running sum along the row plus the row above. result may be
+ * the same matrix as the input
+ *
+ *  matrix (pointer): the matrix
+ *  result (pointer): a pointer to the result, data must be preallocated
+ *
+ *  Returns true
+*/
+bool summedAreaTable(const Matrix *matrix, Matrix *result){
+    int r;
+    int c;
+    result->rows = matrix->rows;
+    result->cols = matrix->cols;
+    for(r = 0; r < matrix->rows; r++){
+        const double *in = matrix->data + (size_t)r * matrix->cols;
+        double *out = result->data + (size_t)r * matrix->cols;
+        const double *above = r > 0 ? out - matrix->cols : out;
+        double sum = 0.0;
+        for(c = 0; c < matrix->cols; c++){
+            sum += in[c];
+            out[c] = r > 0 ? above[c] + sum : sum;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (double) summedAreaSum
+ * --------------------
+ * Sums the rectangle of rows row_start..row_end and columns
+ * col_start..col_end (inclusive) with four lookups in a summed-area table
+ *
+ *  table (pointer): the output of summedAreaTable
+ *  row_start, col_start (int): top left corner
+ *  row_end, col_end (int): bottom right corner
+ *
+ *  Returns the sum of the rectangle
+*/
+double summedAreaSum(const Matrix *table, int row_start, int col_start, int row_end, int col_end){
+    double sum = table->data[(size_t)row_end * table->cols + col_end];
+    if(row_start > 0){
+        sum -= table->data[(size_t)(row_start - 1) * table->cols + col_end];
+    }
+    if(col_start > 0){
+        sum -= table->data[(size_t)row_end * table->cols + col_start - 1];
+    }
+    if(row_start > 0 && col_start > 0){
+        sum += table->data[(size_t)(row_start - 1) * table->cols + col_start - 1];
+    }
+    return sum;
+}
+
+/*
+ * Function: (bool) choleskyFactor
+ * --------------------
+ * Computes the lower triangular L with matrix = L L^T for a symmetric
+ * positive definite matrix. Only the lower triangle of the input is read,
+ * and every entry of L comes from a dot product of two contiguous rows
+ * result may be the same matrix as the input; its upper triangle is zeroed
+ *
+ *  matrix (pointer): the symmetric positive definite n x n matrix
+ *  result (pointer): receives L, data must be preallocated
+ *
+ *  Returns true if successful, false if the matrix is not positive definite
+*/
+bool choleskyFactor(const Matrix *matrix, Matrix *result){
+    if(!isSquare(matrix)){
+        printf("Cholesky factorization needs a square matrix\n");
+        return false;
+    }
+    int n = matrix->rows;
+    int i;
+    int j;
+    int k;
+    result->rows = n;
+    result->cols = n;
+    for(i = 0; i < n; i++){
+        double *row_i = result->data + (size_t)i * n;
+        for(j = 0; j <= i; j++){
+            const double *row_j = result->data + (size_t)j * n;
+            double sum = matrix->data[(size_t)i * n + j];
+            for(k = 0; k < j; k++){
+                sum -= row_i[k] * row_j[k];
+            }
+            if(j < i){
+                row_i[j] = sum / row_j[j];
+            } else if(sum > 0){
+                row_i[i] = sqrt(sum);
+            } else {
+                printf("Matrix is not positive definite\n");
+                return false;
+            }
+        }
+        for(j = i + 1; j < n; j++){
+            row_i[j] = 0.0;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) solveLowerTransposed
+ * --------------------
+ * Overwrites matrix with matrix * L^-T for a lower triangular L, solving
+ * x L^T = b for every row b. Component j of x needs the dot product of the
+ * part of x already solved with row j of L, so L is read along its rows
+ * Rows are independent and may be solved in any order
+ *
+ *  lower (pointer): the n x n lower triangular matrix
+ *  matrix (pointer): the m x n right-hand sides, overwritten with the solution
+ *
+ *  Returns true if successful, false if the dimensions do not match or L
+ *  has a zero on its diagonal
+*/
+bool solveLowerTransposed(const Matrix *lower, Matrix *matrix){
+    int n = lower->rows;
+    if(!isSquare(lower) || matrix->cols != n){
+        printf("Mismatch in the dimensions of the triangular solve\n");
+        return false;
+    }
+    int r;
+    int j;
+    int k;
+    for(j = 0; j < n; j++){
+        if(lower->data[(size_t)j * n + j] == 0){
+            printf("Triangular matrix is singular\n");
+            return false;
+        }
+    }
+    for(r = 0; r < matrix->rows; r++){
+        double *x = matrix->data + (size_t)r * n;
+        for(j = 0; j < n; j++){
+            const double *row_j = lower->data + (size_t)j * n;
+            double sum = x[j];
+            for(k = 0; k < j; k++){
+                sum -= x[k] * row_j[k];
+            }
+            x[j] = sum / row_j[j];
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (void) applyHouseholder
+ * --------------------
+ * Applies the reflector H = I - tau v v^T to columns first_col..cols - 1 of
+ * rows first_row..rows - 1. v is read from column v_col of the same rows
+ * of the vectors matrix. Works row by row: w = v^T M is accumulated along
+ * contiguous rows, then M -= tau v w^T
+ *
+ *  vectors (pointer): holds v in column v_col
+ *  v_col (int): column of v
+ *  tau (double): scale of the reflector
+ *  matrix (pointer): the matrix to update in place
+ *  first_row (int): first row touched, where v starts
+ *  first_col (int): first column touched
+ *  work (pointer): scratch space of matrix->cols doubles
+*/
+void applyHouseholder(const Matrix *vectors, int v_col, double tau, Matrix *matrix,
+                      int first_row, int first_col, double *work){
+    int i;
+    int k;
+    int cols = matrix->cols;
+    for(k = first_col; k < cols; k++){
+        work[k] = 0.0;
+    }
+    for(i = first_row; i < matrix->rows; i++){
+        double v = vectors->data[(size_t)i * vectors->cols + v_col];
+        const double *row = matrix->data + (size_t)i * cols;
+        for(k = first_col; k < cols; k++){
+            work[k] += v * row[k];
+        }
+    }
+    for(i = first_row; i < matrix->rows; i++){
+        double v = tau * vectors->data[(size_t)i * vectors->cols + v_col];
+        double *row = matrix->data + (size_t)i * cols;
+        for(k = first_col; k < cols; k++){
+            row[k] -= v * work[k];
+        }
+    }
+}
+
+/*
+ * Function: (bool) householderQR
+ * --------------------
+ * Computes the thin QR factorization matrix = Q R of an m x n matrix with
+ * m >= n using Householder reflectors. Q is formed by applying the
+ * reflectors backwards to the first n columns of the identity, and signs
+ * are chosen so that the diagonal of R is nonnegative
+ *
+ *  matrix (pointer): the m x n matrix
+ *  q (pointer): receives the m x n Q with orthonormal columns, or NULL
+ *  r (pointer): receives the n x n upper triangular R
+ *
+ *  Returns true if successful, false if m < n or on allocation failure
+*/
+bool householderQR(const Matrix *matrix, Matrix *q, Matrix *r){
+    int m = matrix->rows;
+    int n = matrix->cols;
+    if(m < n){
+        printf("QR factorization needs at least as many rows as columns\n");
+        return false;
+    }
+    Matrix work = {m, n, (double *)malloc(sizeof(double) * ((size_t)m * n + 1))};
+    double *tau = (double *)malloc(sizeof(double) * (2 * (size_t)n + 1));
+    if(work.data == NULL || tau == NULL){
+        printf("Memory allocation failed for QR workspace.\n");
+        free(work.data);
+        free(tau);
+        return false;
+    }
+    double *scratch = tau + n;
+    memcpy(work.data, matrix->data, sizeof(double) * (size_t)m * n);
+    r->rows = n;
+    r->cols = n;
+    int i;
+    int j;
+    for(j = 0; j < n; j++){
+        double norm = 0.0;
+        for(i = j; i < m; i++){
+            double x = work.data[(size_t)i * n + j];
+            norm += x * x;
+        }
+        norm = sqrt(norm);
+        double head = work.data[(size_t)j * n + j];
+        double alpha = head > 0 ? -norm : norm;
+        if(norm == 0){
+            tau[j] = 0.0;
+        } else {
+            /* v = x - alpha e_1, scaled so that v_0 = 1 */
+            double v0 = head - alpha;
+            for(i = j + 1; i < m; i++){
+                work.data[(size_t)i * n + j] /= v0;
+            }
+            work.data[(size_t)j * n + j] = 1.0;
+            tau[j] = -v0 / alpha;
+            applyHouseholder(&work, j, tau[j], &work, j, j + 1, scratch);
+        }
+        /* Row j of R is final once reflector j has been applied */
+        for(i = 0; i < n; i++){
+            r->data[(size_t)j * n + i] = i < j ? 0.0 : work.data[(size_t)j * n + i];
+        }
+        r->data[(size_t)j * n + j] = norm == 0 ? head : alpha;
+    }
+    if(q != NULL){
+        q->rows = m;
+        q->cols = n;
+        memset(q->data, 0, sizeof(double) * (size_t)m * n);
+        for(j = 0; j < n; j++){
+            q->data[(size_t)j * n + j] = 1.0;
+        }
+        for(j = n - 1; j >= 0; j--){
+            if(tau[j] != 0){
+                work.data[(size_t)j * n + j] = 1.0;
+                applyHouseholder(&work, j, tau[j], q, j, j, scratch);
+            }
+        }
+    }
+    /* Flip signs so that R has a nonnegative diagonal and the factors are unique */
+    for(j = 0; j < n; j++){
+        if(r->data[(size_t)j * n + j] < 0){
+            for(i = j; i < n; i++){
+                r->data[(size_t)j * n + i] = -r->data[(size_t)j * n + i];
+            }
+            if(q != NULL){
+                for(i = 0; i < m; i++){
+                    q->data[(size_t)i * n + j] = -q->data[(size_t)i * n + j];
+                }
+            }
+        }
+    }
+    free(work.data);
+    free(tau);
+    return true;
+}
+
+/*
+ * Struct: TsqrLeafTask
+ * --------------------
+ * The leaves of tallSkinnyQR handled by one thread, either factored or,
+ * on the way back, multiplied by their pushed down Q factors
+ *
+ *  matrix (pointer): the m x n matrix
+ *  q (pointer): the m x n Q, or NULL
+ *  factors (pointer): one n x n factor per leaf
+ *  block (int): rows per leaf, the last leaf takes the remainder
+ *  leaves (int): number of leaves
+ *  first (int): first leaf of the task
+ *  end (int): one past the last leaf of the task
+ *  apply (bool): multiply the leaf Q by its factor instead of factoring
+ *  scratch (pointer): 2 block x n doubles for the product
+ *  ok (bool): receives false if a step failed
+*/
+typedef struct{
+    const Matrix *matrix;
+    Matrix *q;
+    double *factors;
+    int block;
+    int leaves;
+    int first;
+    int end;
+    bool apply;
+    double *scratch;
+    bool ok;
+} TsqrLeafTask;
+
+/*
+ * Function: (void *) runTsqrLeafTask
+ * --------------------
+ * Thread entry point of the leaf steps of tallSkinnyQR
+ *
+ *  argument (pointer): the TsqrLeafTask
+ *
+ *  Returns NULL
+*/
+void *runTsqrLeafTask(void *argument){
+    TsqrLeafTask *task = (TsqrLeafTask *)argument;
+    int m = task->matrix->rows;
+    int n = task->matrix->cols;
+    size_t square = (size_t)n * n;
+    int leaf;
+    for(leaf = task->first; leaf < task->end && task->ok; leaf++){
+        int first = leaf * task->block;
+        int rows = leaf == task->leaves - 1 ? m - first : task->block;
+        Matrix leaf_q = {rows, n, task->q != NULL ? task->q->data + (size_t)first * n : NULL};
+        Matrix factor = {n, n, task->factors + leaf * square};
+        if(task->apply){
+            Matrix product = {rows, n, task->scratch};
+            task->ok = multiplyMatricesEpilogue(&leaf_q, &factor, NULL, &product);
+            memcpy(leaf_q.data, product.data, sizeof(double) * (size_t)rows * n);
+        } else {
+            Matrix part = {rows, n, task->matrix->data + (size_t)first * n};
+            task->ok = householderQR(&part, task->q != NULL ? &leaf_q : NULL, &factor);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Struct: TsqrMergeTask
+ * --------------------
+ * The merges of one tree level of tallSkinnyQR handled by one thread,
+ * either reducing two R factors or pushing a Q factor back down
+ *
+ *  n (int): number of columns
+ *  factors (pointer): one n x n factor per leaf
+ *  merges (pointer): the 2n x n Q of every merge
+ *  merge_left (pointer): left leaf of every merge
+ *  merge_right (pointer): right leaf of every merge
+ *  first (int): first merge of the task
+ *  end (int): one past the last merge of the task
+ *  with_q (bool): whether the merge Q factors are kept
+ *  down (bool): push the Q factors down instead of reducing
+ *  stacked (pointer): 2n x n scratch
+ *  ok (bool): receives false if a step failed
+*/
+typedef struct{
+    int n;
+    double *factors;
+    double *merges;
+    const int *merge_left;
+    const int *merge_right;
+    int first;
+    int end;
+    bool with_q;
+    bool down;
+    double *stacked;
+    bool ok;
+} TsqrMergeTask;
+
+/*
+ * Function: (void *) runTsqrMergeTask
+ * --------------------
+ * Thread entry point of the tree steps of tallSkinnyQR. Merges of one
+ * level touch disjoint leaves, so they need no synchronization
+ *
+ *  argument (pointer): the TsqrMergeTask
+ *
+ *  Returns NULL
+*/
+void *runTsqrMergeTask(void *argument){
+    TsqrMergeTask *task = (TsqrMergeTask *)argument;
+    int n = task->n;
+    size_t square = (size_t)n * n;
+    int index;
+    for(index = task->first; index < task->end && task->ok; index++){
+        double *left = task->factors + task->merge_left[index] * square;
+        double *right = task->factors + task->merge_right[index] * square;
+        Matrix top = {n, n, task->merges + index * 2 * square};
+        if(task->down){
+            Matrix parent = {n, n, task->stacked};
+            Matrix bottom = {n, n, top.data + square};
+            Matrix left_factor = {n, n, left};
+            Matrix right_factor = {n, n, right};
+            memcpy(task->stacked, left, sizeof(double) * square);
+            task->ok = multiplyMatricesEpilogue(&top, &parent, NULL, &left_factor) &&
+                       multiplyMatricesEpilogue(&bottom, &parent, NULL, &right_factor);
+        } else {
+            Matrix pair = {2 * n, n, task->stacked};
+            Matrix pair_q = {2 * n, n, top.data};
+            Matrix merged = {n, n, left};
+            memcpy(task->stacked, left, sizeof(double) * square);
+            memcpy(task->stacked + square, right, sizeof(double) * square);
+            task->ok = householderQR(&pair, task->with_q ? &pair_q : NULL, &merged);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) runTsqrLevel
+ * --------------------
+ * Splits the merges first .. end - 1 of one tree level over the threads
+ *
+ *  tasks (pointer): thread_count merge tasks, scratch already assigned
+ *  thread_count (int): number of threads
+ *  first (int): first merge of the level
+ *  end (int): one past the last merge of the level
+ *  down (bool): push the Q factors down instead of reducing
+ *
+ *  Returns true if every merge succeeded
+*/
+bool runTsqrLevel(TsqrMergeTask *tasks, int thread_count, int first, int end, bool down){
+    int count = end - first < thread_count ? end - first : thread_count;
+    int t;
+    bool ok = true;
+    for(t = 0; t < count; t++){
+        tasks[t].first = first + (end - first) * t / count;
+        tasks[t].end = first + (end - first) * (t + 1) / count;
+        tasks[t].down = down;
+        tasks[t].ok = true;
+    }
+    runParallel(runTsqrMergeTask, tasks, sizeof(TsqrMergeTask), count);
+    for(t = 0; t < count; t++){
+        ok = ok && tasks[t].ok;
+    }
+    return ok;
+}
+
+/*
+ * Function: (bool) tallSkinnyQR
+ * --------------------
+ * Computes the thin QR factorization of a tall and skinny m x n matrix with
+ * TSQR. The rows are cut into leaf blocks of at least TSQR_BLOCK_ROWS rows,
+ * each leaf gets its own Householder QR, and the n x n R factors are
+ * combined pairwise up a binary tree, each merge being the QR of two
+ * stacked R factors. The leaves, and the merges of one level, are spread
+ * over the threads; the tree has the same shape for any thread count, so
+ * the factors do not depend on it. To recover Q, the small Q factors of
+ * the merges are pushed back down the tree, level by level, into one
+ * n x n factor per leaf, and each leaf Q is multiplied by its factor, so
+ * the matrix is read once and Q written twice regardless of the depth of
+ * the tree
+ *
+ *  matrix (pointer): the m x n matrix, m >= n
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  q (pointer): receives the m x n Q with orthonormal columns, or NULL
+ *  r (pointer): receives the n x n upper triangular R
+ *
+ *  Returns true if successful, false if m < n or on allocation failure
+*/
+bool tallSkinnyQR(const Matrix *matrix, int thread_count, Matrix *q, Matrix *r){
+    int m = matrix->rows;
+    int n = matrix->cols;
+    if(m < n){
+        printf("QR factorization needs at least as many rows as columns\n");
+        return false;
+    }
+    int block = TSQR_BLOCK_ROWS > n ? TSQR_BLOCK_ROWS : n;
+    int leaves = m / block;
+    if(leaves < 2){
+        return householderQR(matrix, q, r);
+    }
+    if(thread_count > leaves){
+        thread_count = leaves;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    size_t square = (size_t)n * n;
+    /* Leaf R factors, reused for the per leaf Q factors on the way down */
+    double *factors = (double *)malloc(sizeof(double) * (leaves * square + 1));
+    /* Q of every merge, 2n x n each, in the order they were made */
+    double *merges = (double *)malloc(sizeof(double) * ((leaves - 1) * 2 * square + 1));
+    /* Left and right leaf of every merge, then the first merge of every level */
+    int *merge_left = (int *)malloc(sizeof(int) * (3 * (size_t)leaves + 2));
+    /* Per thread: the product for one leaf of under 2 * block rows, or two stacked R factors */
+    double *scratch = (double *)malloc(sizeof(double) * ((size_t)block * 2 * n * thread_count + 1));
+    TsqrLeafTask *leaf_tasks = (TsqrLeafTask *)malloc(sizeof(TsqrLeafTask) * (size_t)thread_count);
+    TsqrMergeTask *merge_tasks = (TsqrMergeTask *)malloc(sizeof(TsqrMergeTask) * (size_t)thread_count);
+    if(factors == NULL || merges == NULL || merge_left == NULL || scratch == NULL ||
+       leaf_tasks == NULL || merge_tasks == NULL){
+        printf("Memory allocation failed for TSQR workspace.\n");
+        free(factors);
+        free(merges);
+        free(merge_left);
+        free(scratch);
+        free(leaf_tasks);
+        free(merge_tasks);
+        return false;
+    }
+    int *merge_right = merge_left + leaves;
+    int *level_start = merge_right + leaves;
+    bool ok = true;
+    int leaf;
+    int step;
+    int level;
+    int levels = 0;
+    int count = 0;
+    int t;
+    int i;
+    /* The shape of the tree: merges of one level are consecutive */
+    for(step = 1; step < leaves; step *= 2){
+        level_start[levels++] = count;
+        for(leaf = 0; leaf + step < leaves; leaf += 2 * step){
+            merge_left[count] = leaf;
+            merge_right[count] = leaf + step;
+            count++;
+        }
+    }
+    level_start[levels] = count;
+    for(t = 0; t < thread_count; t++){
+        TsqrLeafTask leaf_task = {matrix, q, factors, block, leaves,
+                                  leaves * t / thread_count, leaves * (t + 1) / thread_count,
+                                  false, scratch + (size_t)block * 2 * n * t, true};
+        TsqrMergeTask merge_task = {n, factors, merges, merge_left, merge_right, 0, 0,
+                                    q != NULL, false, scratch + (size_t)block * 2 * n * t, true};
+        leaf_tasks[t] = leaf_task;
+        merge_tasks[t] = merge_task;
+    }
+    runParallel(runTsqrLeafTask, leaf_tasks, sizeof(TsqrLeafTask), thread_count);
+    for(t = 0; t < thread_count; t++){
+        ok = ok && leaf_tasks[t].ok;
+    }
+    /* Reduce the R factors up the tree, the result ends in leaf 0 */
+    for(level = 0; level < levels && ok; level++){
+        ok = runTsqrLevel(merge_tasks, thread_count, level_start[level], level_start[level + 1], false);
+    }
+    if(ok){
+        r->rows = n;
+        r->cols = n;
+        memcpy(r->data, factors, sizeof(double) * square);
+    }
+    if(ok && q != NULL){
+        q->rows = m;
+        q->cols = n;
+        /* Push the merge factors down, latest level first */
+        memset(factors, 0, sizeof(double) * square);
+        for(i = 0; i < n; i++){
+            factors[(size_t)i * n + i] = 1.0;
+        }
+        for(level = levels - 1; level >= 0 && ok; level--){
+            ok = runTsqrLevel(merge_tasks, thread_count, level_start[level], level_start[level + 1], true);
+        }
+        if(ok){
+            for(t = 0; t < thread_count; t++){
+                leaf_tasks[t].apply = true;
+            }
+            runParallel(runTsqrLeafTask, leaf_tasks, sizeof(TsqrLeafTask), thread_count);
+            for(t = 0; t < thread_count; t++){
+                ok = ok && leaf_tasks[t].ok;
+            }
+        }
+    }
+    free(factors);
+    free(merges);
+    free(merge_left);
+    free(scratch);
+    free(leaf_tasks);
+    free(merge_tasks);
+    return ok;
+}
+
+/*
+ * Struct: GramTask
+ * --------------------
+ * The row blocks handled by one thread of choleskyQR2. Each block is
+ * optionally copied to target and solved with L^T, then optionally added
+ * into the Gram matrix of the task
+ *
+ *  source (pointer): the m x n rows read
+ *  target (pointer): the m x n rows written, or NULL to only read source
+ *  factor (pointer): the n x n Cholesky factor L to solve with, or NULL
+ *  gram (pointer): the n x n Gram matrix of the task, or NULL
+ *  first_row (int): first row of the task
+ *  end_row (int): one past the last row of the task
+ *  ok (bool): receives false if a step failed
+*/
+typedef struct{
+    const Matrix *source;
+    Matrix *target;
+    const Matrix *factor;
+    double *gram;
+    int first_row;
+    int end_row;
+    bool ok;
+} GramTask;
+
+/*
+ * Function: (void *) runGramTask
+ * --------------------
+ * Thread entry point of choleskyQR2, walks its rows TSQR_BLOCK_ROWS at a
+ * time so that the solve and the Gram update share the block in cache
+ *
+ *  argument (pointer): the GramTask
+ *
+ *  Returns NULL
+*/
+void *runGramTask(void *argument){
+    GramTask *task = (GramTask *)argument;
+    int n = task->source->cols;
+    int start;
+    if(task->gram != NULL){
+        memset(task->gram, 0, sizeof(double) * (size_t)n * n);
+    }
+    for(start = task->first_row; start < task->end_row && task->ok; start += TSQR_BLOCK_ROWS){
+        int rows = task->end_row - start < TSQR_BLOCK_ROWS ? task->end_row - start : TSQR_BLOCK_ROWS;
+        Matrix block = {rows, n, task->source->data + (size_t)start * n};
+        if(task->target != NULL){
+            block.data = task->target->data + (size_t)start * n;
+            if(task->target->data != task->source->data){
+                memcpy(block.data, task->source->data + (size_t)start * n, sizeof(double) * rows * n);
+            }
+        }
+        if(task->factor != NULL){
+            task->ok = solveLowerTransposed(task->factor, &block);
+        }
+        if(task->ok && task->gram != NULL){
+            Matrix gram = {n, n, task->gram};
+            task->ok = symmetricRankKUpdate(&block, 1.0, &gram);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function: (bool) runGramPass
+ * --------------------
+ * Runs one pass of choleskyQR2 over all row blocks and, when the tasks
+ * have Gram matrices, adds them into gram in task order
+ *
+ *  tasks (pointer): thread_count tasks with their rows assigned
+ *  thread_count (int): number of threads
+ *  source (pointer): the rows read
+ *  target (pointer): the rows written, or NULL
+ *  factor (pointer): the Cholesky factor to solve with, or NULL
+ *  gram (pointer): receives the n x n Gram matrix, or NULL
+ *
+ *  Returns true if every block succeeded
+*/
+bool runGramPass(GramTask *tasks, int thread_count, const Matrix *source, Matrix *target,
+                 const Matrix *factor, Matrix *gram){
+    size_t square = (size_t)source->cols * source->cols;
+    size_t i;
+    int t;
+    bool ok = true;
+    for(t = 0; t < thread_count; t++){
+        tasks[t].source = source;
+        tasks[t].target = target;
+        tasks[t].factor = factor;
+        tasks[t].gram = gram != NULL ? gram->data + square * (t + 1) : NULL;
+        tasks[t].ok = true;
+    }
+    runParallel(runGramTask, tasks, sizeof(GramTask), thread_count);
+    for(t = 0; t < thread_count; t++){
+        ok = ok && tasks[t].ok;
+    }
+    if(ok && gram != NULL){
+        memset(gram->data, 0, sizeof(double) * square);
+        for(t = 0; t < thread_count; t++){
+            for(i = 0; i < square; i++){
+                gram->data[i] += tasks[t].gram[i];
+            }
+        }
+    }
+    return ok;
+}
+
+/*
+ * Function: (bool) choleskyQR2
+ * --------------------
+ * Computes the thin QR factorization of a tall and skinny m x n matrix with
+ * CholeskyQR2: G = A^T A, G = L L^T, Q1 = A L^-T, then the same again on Q1
+ * to restore the orthogonality lost in the first round, and R = R2 R1
+ * The solve with L1 and the Gram matrix of Q1 are fused over blocks of
+ * TSQR_BLOCK_ROWS rows, so A is read twice and Q written twice. Every pass
+ * gives the threads contiguous runs of blocks, each with its own Gram
+ * matrix, and the Gram matrices are added in task order. All the work is
+ * in symmetricRankKUpdate and triangular solves, but the Cholesky
+ * factorization fails once the condition number of A nears 1e8; use
+ * tallSkinnyQR for such matrices
+ *
+ *  matrix (pointer): the m x n matrix, m >= n
+ *  thread_count (int): number of threads to use, 1 for the calling thread
+ *  q (pointer): receives the m x n Q, data must be preallocated
+ *  r (pointer): receives the n x n upper triangular R
+ *
+ *  Returns true if successful, false if m < n, the matrix is too ill
+ *  conditioned or on allocation failure
+*/
+bool choleskyQR2(const Matrix *matrix, int thread_count, Matrix *q, Matrix *r){
+    int m = matrix->rows;
+    int n = matrix->cols;
+    if(m < n){
+        printf("QR factorization needs at least as many rows as columns\n");
+        return false;
+    }
+    int blocks = (m + TSQR_BLOCK_ROWS - 1) / TSQR_BLOCK_ROWS;
+    if(thread_count > blocks){
+        thread_count = blocks;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    size_t square = (size_t)n * n;
+    /* The Gram matrix followed by one per thread, then L1 and L2 */
+    double *buffer = (double *)malloc(sizeof(double) * ((thread_count + 3) * square + 1));
+    GramTask *tasks = (GramTask *)malloc(sizeof(GramTask) * (size_t)thread_count);
+    if(buffer == NULL || tasks == NULL){
+        printf("Memory allocation failed for CholeskyQR2 workspace.\n");
+        free(buffer);
+        free(tasks);
+        return false;
+    }
+    Matrix gram = {n, n, buffer};
+    Matrix first = {n, n, buffer + (thread_count + 1) * square};
+    Matrix second = {n, n, first.data + square};
+    int t;
+    int i;
+    int j;
+    int k;
+    for(t = 0; t < thread_count; t++){
+        int end = blocks * (t + 1) / thread_count * TSQR_BLOCK_ROWS;
+        GramTask task = {matrix, NULL, NULL, NULL, blocks * t / thread_count * TSQR_BLOCK_ROWS,
+                         end < m ? end : m, true};
+        tasks[t] = task;
+    }
+    bool ok = runGramPass(tasks, thread_count, matrix, NULL, NULL, &gram) &&
+              choleskyFactor(&gram, &first) &&
+              runGramPass(tasks, thread_count, matrix, q, &first, &gram) &&
+              choleskyFactor(&gram, &second);
+    if(ok){
+        q->rows = m;
+        q->cols = n;
+        ok = runGramPass(tasks, thread_count, q, q, &second, NULL);
+    }
+    if(ok){
+        /* R = L2^T L1^T */
+        r->rows = n;
+        r->cols = n;
+        for(i = 0; i < n; i++){
+            for(j = 0; j < n; j++){
+                double sum = 0.0;
+                for(k = i; k <= j; k++){
+                    sum += second.data[(size_t)k * n + i] * first.data[(size_t)j * n + k];
+                }
+                r->data[(size_t)i * n + j] = sum;
+            }
+        }
+    }
+    free(buffer);
+    free(tasks);
+    return ok;
+}
+
+/*
+ * Function: (void) transposeCopy
+ * --------------------
+ * Writes the transpose of a matrix into a separate preallocated matrix,
+ * unlike transposeMatrix which works in place for square inputs
+ *
+ *  matrix (pointer): the original matrix
+ *  result (pointer): the cols x rows result, data must be preallocated
+*/
+void transposeCopy(const Matrix *matrix, Matrix *result){
+    int r;
+    int c;
+    result->rows = matrix->cols;
+    result->cols = matrix->rows;
+    for(r = 0; r < matrix->rows; r++){
+        const double *in = matrix->data + (size_t)r * matrix->cols;
+        for(c = 0; c < matrix->cols; c++){
+            result->data[(size_t)c * matrix->rows + r] = in[c];
+        }
+    }
+}
+
+/*
+ * Function: (bool) solveUpperTriangular
+ * --------------------
+ * Overwrites matrix with U^-1 matrix for an upper triangular U by back
+ * substitution. Each step subtracts multiples of already solved rows, so
+ * all the inner loops run along contiguous rows
+ *
+ *  upper (pointer): the k x k upper triangular matrix
+ *  matrix (pointer): the k x n right-hand sides, overwritten with the solution
+ *
+ *  Returns true if successful, false if the dimensions do not match or U
+ *  has a zero on its diagonal
+*/
+bool solveUpperTriangular(const Matrix *upper, Matrix *matrix){
+    int k = upper->rows;
+    if(!isSquare(upper) || matrix->rows != k){
+        printf("Mismatch in the dimensions of the triangular solve\n");
+        return false;
+    }
+    int n = matrix->cols;
+    int i;
+    int j;
+    int c;
+    for(i = k - 1; i >= 0; i--){
+        double pivot = upper->data[(size_t)i * k + i];
+        if(pivot == 0){
+            printf("Triangular matrix is singular\n");
+            return false;
+        }
+        double *row_i = matrix->data + (size_t)i * n;
+        for(j = i + 1; j < k; j++){
+            double factor = upper->data[(size_t)i * k + j];
+            const double *row_j = matrix->data + (size_t)j * n;
+            for(c = 0; c < n; c++){
+                row_i[c] -= factor * row_j[c];
+            }
+        }
+        for(c = 0; c < n; c++){
+            row_i[c] /= pivot;
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (void) subtractProductStrided
+ * --------------------
+ * Computes C -= A B on blocks addressed through leading dimensions, so it
+ * can update sub-blocks of larger matrices in place. Uses the GEMM
+ * micro-kernel tile by tile
+ *
+ *  a (pointer): first element of the rows x inner block A
+ *  lda (int): distance between rows of A
+ *  b (pointer): first element of the inner x cols block B
+ *  ldb (int): distance between rows of B
+ *  c (pointer): first element of the rows x cols block C
+ *  ldc (int): distance between rows of C
+ *  rows, inner, cols (int): dimensions of the product
+*/
+void subtractProductStrided(const double *a, int lda, const double *b, int ldb,
+                            double *c, int ldc, int rows, int inner, int cols){
+    double tile[GEMM_TILE_ROWS][GEMM_TILE_COLS];
+    int row;
+    int col;
+    int i;
+    int j;
+    if(inner <= 0){
+        return;
+    }
+    for(col = 0; col < cols; col += GEMM_TILE_COLS){
+        int tile_cols = cols - col < GEMM_TILE_COLS ? cols - col : GEMM_TILE_COLS;
+        for(row = 0; row < rows; row += GEMM_TILE_ROWS){
+            int tile_rows = rows - row < GEMM_TILE_ROWS ? rows - row : GEMM_TILE_ROWS;
+            multiplyMicroTile(a + (size_t)row * lda, lda, 1, b + col, ldb, 1,
+                              inner, tile_rows, tile_cols, tile);
+            for(i = 0; i < tile_rows; i++){
+                double *out = c + (size_t)(row + i) * ldc + col;
+                for(j = 0; j < tile_cols; j++){
+                    out[j] -= tile[i][j];
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Function: (bool) pivotedQR
+ * --------------------
+ * Computes the rank revealing QR factorization A P = Q R with column
+ * pivoting: at every step the remaining column of largest norm is brought
+ * forward and eliminated with a Householder reflector. The reflectors are
+ * gathered in panels of PIVOTED_QR_PANEL columns as in LAPACK's QP3: the
+ * panel keeps Y and F = A^T Y T, the compact WY form of its reflectors
+ * applied to the trailing columns, and only the pivot column and the
+ * finished rows of R are updated inside the panel. The trailing columns
+ * get the whole panel at once with one GEMM, A -= Y F^T, so most of the
+ * flops run in the tiled micro-kernel. Column norms are downdated after
+ * each step; when cancellation has eaten half of their digits the panel
+ * ends early and they are recomputed after the GEMM. The pivot's norm is
+ * recomputed before building its reflector, and a stale estimate sends
+ * the search back with the true norm, so a zero column never yields a
+ * reflector. Stops once the largest remaining norm falls below tolerance
+ * times the largest initial one, or after max_rank steps
+ *
+ *  matrix (pointer): the m x n matrix A
+ *  tolerance (double): relative threshold defining the numerical rank
+ *  max_rank (int): upper bound on the rank, min(m, n) or less
+ *  q (pointer): receives the m x rank Q, or NULL; room for m x max_rank
+ *  r (pointer): receives the rank x n upper trapezoidal R, in pivoted
+ *               column order; room for max_rank x n
+ *  permutation (pointer): receives the n column indices, the first rank of
+ *                         them select a well conditioned set of columns
+ *  rank (pointer): receives the numerical rank
+ *
+ *  Returns true if successful, false on allocation failure
+*/
+bool pivotedQR(const Matrix *matrix, double tolerance, int max_rank,
+               Matrix *q, Matrix *r, int *permutation, int *rank){
+    int m = matrix->rows;
+    int n = matrix->cols;
+    if(max_rank > m){
+        max_rank = m;
+    }
+    if(max_rank > n){
+        max_rank = n;
+    }
+    Matrix work = {m, n, (double *)malloc(sizeof(double) * ((size_t)m * n + 1))};
+    double *norms = (double *)malloc(sizeof(double) * ((3 + (size_t)PIVOTED_QR_PANEL) * n + (size_t)max_rank + 1));
+    if(work.data == NULL || norms == NULL){
+        printf("Memory allocation failed for pivoted QR workspace.\n");
+        free(work.data);
+        free(norms);
+        return false;
+    }
+    double *original = norms + n;
+    double *scratch = original + n;
+    /* F^T of the current panel, one row of n per reflector */
+    double *panel_f = scratch + n;
+    double *tau = panel_f + (size_t)PIVOTED_QR_PANEL * n;
+    double threshold = sqrt(DBL_EPSILON);
+    memcpy(work.data, matrix->data, sizeof(double) * (size_t)m * n);
+    int i;
+    int j;
+    int k;
+    int l;
+    for(k = 0; k < n; k++){
+        norms[k] = 0.0;
+        permutation[k] = k;
+    }
+    for(i = 0; i < m; i++){
+        const double *row = work.data + (size_t)i * n;
+        for(k = 0; k < n; k++){
+            norms[k] += row[k] * row[k];
+        }
+    }
+    double largest = 0.0;
+    for(k = 0; k < n; k++){
+        norms[k] = sqrt(norms[k]);
+        original[k] = norms[k];
+        largest = norms[k] > largest ? norms[k] : largest;
+    }
+    bool done = false;
+    j = 0;
+    while(j < max_rank && !done){
+        int panel = j;
+        int count = 0;
+        bool recompute = false;
+        while(j < max_rank && count < PIVOTED_QR_PANEL && !recompute){
+            int pivot = j;
+            for(k = j + 1; k < n; k++){
+                if(norms[k] > norms[pivot]){
+                    pivot = k;
+                }
+            }
+            if(norms[pivot] <= tolerance * largest || norms[pivot] == 0){
+                done = true;
+                break;
+            }
+            if(pivot != j){
+                for(i = 0; i < m; i++){
+                    double *row = work.data + (size_t)i * n;
+                    double swap = row[j];
+                    row[j] = row[pivot];
+                    row[pivot] = swap;
+                }
+                for(l = 0; l < count; l++){
+                    double *f_row = panel_f + (size_t)l * n;
+                    double swap = f_row[j];
+                    f_row[j] = f_row[pivot];
+                    f_row[pivot] = swap;
+                }
+                double swap = norms[j];
+                norms[j] = norms[pivot];
+                norms[pivot] = swap;
+                swap = original[j];
+                original[j] = original[pivot];
+                original[pivot] = swap;
+                int index = permutation[j];
+                permutation[j] = permutation[pivot];
+                permutation[pivot] = index;
+            }
+            /* Bring the pivot column up to date with the reflectors of the panel */
+            double norm = 0.0;
+            for(i = j; i < m; i++){
+                const double *row = work.data + (size_t)i * n;
+                double sum = 0.0;
+                for(l = 0; l < count; l++){
+                    sum += row[panel + l] * panel_f[(size_t)l * n + j];
+                }
+                work.data[(size_t)i * n + j] -= sum;
+                norm += work.data[(size_t)i * n + j] * work.data[(size_t)i * n + j];
+            }
+            for(l = 0; l < count; l++){
+                panel_f[(size_t)l * n + j] = 0.0;
+            }
+            norm = sqrt(norm);
+            if(norm <= tolerance * largest || norm == 0){
+                /* The downdated estimate was stale, search again with the true norm */
+                norms[j] = norm;
+                original[j] = norm;
+                continue;
+            }
+            /* Reflector for column j, as in householderQR */
+            double head = work.data[(size_t)j * n + j];
+            double alpha = head > 0 ? -norm : norm;
+            double v0 = head - alpha;
+            for(i = j + 1; i < m; i++){
+                work.data[(size_t)i * n + j] /= v0;
+            }
+            tau[j] = -v0 / alpha;
+            work.data[(size_t)j * n + j] = 1.0;
+            /* Row count of F^T: tau (A^T v - F Y^T v) over the trailing columns */
+            double *f_new = panel_f + (size_t)count * n;
+            for(k = j + 1; k < n; k++){
+                scratch[k] = 0.0;
+            }
+            for(i = j; i < m; i++){
+                const double *row = work.data + (size_t)i * n;
+                double v = row[j];
+                for(k = j + 1; k < n; k++){
+                    scratch[k] += v * row[k];
+                }
+            }
+            for(l = 0; l < count; l++){
+                const double *f_row = panel_f + (size_t)l * n;
+                double projection = 0.0;
+                for(i = j; i < m; i++){
+                    projection += work.data[(size_t)i * n + panel + l] * work.data[(size_t)i * n + j];
+                }
+                for(k = j + 1; k < n; k++){
+                    scratch[k] -= f_row[k] * projection;
+                }
+            }
+            for(k = 0; k <= j; k++){
+                f_new[k] = 0.0;
+            }
+            for(k = j + 1; k < n; k++){
+                f_new[k] = tau[j] * scratch[k];
+            }
+            /* Row j of R gets every reflector of the panel, v_0 = 1 for the new one */
+            double *row_j = work.data + (size_t)j * n;
+            for(l = 0; l <= count; l++){
+                double y = row_j[panel + l];
+                const double *f_row = panel_f + (size_t)l * n;
+                for(k = j + 1; k < n; k++){
+                    row_j[k] -= y * f_row[k];
+                }
+            }
+            row_j[j] = alpha;
+            /* Downdate the norms of the remaining columns, a negative norm marks a recomputation */
+            for(k = j + 1; k < n; k++){
+                if(norms[k] == 0){
+                    continue;
+                }
+                double ratio = fabs(row_j[k]) / norms[k];
+                double shrink = 1.0 - ratio * ratio;
+                shrink = shrink > 0 ? shrink : 0.0;
+                double relative = norms[k] / original[k];
+                if(shrink * relative * relative <= threshold){
+                    norms[k] = -1.0;
+                    recompute = true;
+                } else {
+                    norms[k] *= sqrt(shrink);
+                }
+            }
+            j++;
+            count++;
+        }
+        if(done){
+            break;
+        }
+        /* The trailing matrix gets the whole panel with one GEMM: A -= Y F^T */
+        if(count > 0 && j < m && j < n){
+            subtractProductStrided(work.data + (size_t)j * n + panel, n, panel_f + j, n,
+                                   work.data + (size_t)j * n + j, n, m - j, count, n - j);
+        }
+        if(recompute){
+            for(k = j; k < n; k++){
+                if(norms[k] < 0){
+                    double sum = 0.0;
+                    for(i = j; i < m; i++){
+                        double x = work.data[(size_t)i * n + k];
+                        sum += x * x;
+                    }
+                    norms[k] = sqrt(sum);
+                    original[k] = norms[k];
+                }
+            }
+        }
+    }
+    *rank = j;
+    r->rows = j;
+    r->cols = n;
+    for(i = 0; i < j; i++){
+        for(k = 0; k < n; k++){
+            r->data[(size_t)i * n + k] = k < i ? 0.0 : work.data[(size_t)i * n + k];
+        }
+    }
+    if(q != NULL){
+        int rank_q = j;
+        q->rows = m;
+        q->cols = rank_q;
+        memset(q->data, 0, sizeof(double) * ((size_t)m * rank_q));
+        for(i = 0; i < rank_q; i++){
+            q->data[(size_t)i * rank_q + i] = 1.0;
+        }
+        for(j = rank_q - 1; j >= 0; j--){
+            work.data[(size_t)j * n + j] = 1.0;
+            applyHouseholder(&work, j, tau[j], q, j, j, scratch);
+        }
+    }
+    free(work.data);
+    free(norms);
+    return true;
+}
+
+/*
+ * Function: (bool) interpolativeCoefficients
+ * --------------------
+ * Runs pivotedQR on a matrix and expresses every column through the first
+ * rank pivot columns: with A P = Q [R11 R12], the coefficients are
+ * [I, R11^-1 R12] scattered back to the original column order, so that
+ * A is approximated by A(:, columns) coefficients
+ *
+ *  matrix (pointer): the matrix, usually a sketch of the one of interest
+ *  rank (int): the number of columns to select
+ *  columns (pointer): receives the rank selected column indices
+ *  coefficients (pointer): receives the rank x cols coefficients
+ *
+ *  Returns true if successful, false if the matrix has a lower rank or on
+ *  allocation failure
+*/
+bool interpolativeCoefficients(const Matrix *matrix, int rank, int *columns, Matrix *coefficients){
+    int n = matrix->cols;
+    int found;
+    int i;
+    int k;
+    Matrix r = {rank, n, (double *)malloc(sizeof(double) * ((size_t)rank * n + 1))};
+    Matrix r11 = {rank, rank, (double *)malloc(sizeof(double) * ((size_t)rank * rank + 1))};
+    int *permutation = (int *)malloc(sizeof(int) * (size_t)n);
+    if(r.data == NULL || r11.data == NULL || permutation == NULL){
+        printf("Memory allocation failed for interpolative decomposition.\n");
+        free(r.data);
+        free(r11.data);
+        free(permutation);
+        return false;
+    }
+    bool ok = pivotedQR(matrix, 0.0, rank, NULL, &r, permutation, &found);
+    if(ok && found < rank){
+        printf("Matrix has rank %d, below the requested %d\n", found, rank);
+        ok = false;
+    }
+    if(ok){
+        /* Split R into R11 and, in place, T = R12 as rank x n with R11 as zero padding */
+        for(i = 0; i < rank; i++){
+            for(k = 0; k < rank; k++){
+                r11.data[(size_t)i * rank + k] = r.data[(size_t)i * n + k];
+                r.data[(size_t)i * n + k] = 0.0;
+            }
+        }
+        ok = solveUpperTriangular(&r11, &r);
+    }
+    if(ok){
+        coefficients->rows = rank;
+        coefficients->cols = n;
+        for(i = 0; i < rank; i++){
+            for(k = 0; k < n; k++){
+                double value = k < rank ? (k == i ? 1.0 : 0.0) : r.data[(size_t)i * n + k];
+                coefficients->data[(size_t)i * n + permutation[k]] = value;
+            }
+        }
+        memcpy(columns, permutation, sizeof(int) * (size_t)rank);
+    }
+    free(r.data);
+    free(r11.data);
+    free(permutation);
+    return ok;
+}
+
+/*
+ * Function: (bool) interpolativeDecomposition
+ * --------------------
+ * Computes a randomized column interpolative decomposition of rank k,
+ * A ~ A(:, columns) coefficients. The columns are chosen by pivotedQR on
+ * a Gaussian sketch S A with k + ID_OVERSAMPLE rows, which keeps the
+ * column geometry of A, so the expensive pass over A is a single GEMM
+ *
+ *  matrix (pointer): the m x n matrix A
+ *  rank (int): the number of columns to keep
+ *  seed (uint64_t): seed of the sketch
+ *  columns (pointer): receives the rank selected column indices
+ *  coefficients (pointer): receives the rank x n coefficients
+ *
+ *  Returns true if successful, false on bad arguments or allocation failure
+*/
+bool interpolativeDecomposition(const Matrix *matrix, int rank, uint64_t seed, int *columns, Matrix *coefficients){
+    if(rank < 1 || rank > matrix->cols || rank > matrix->rows){
+        printf("Rank must be between 1 and the smaller dimension\n");
+        return false;
+    }
+    int sketch_rows = rank + ID_OVERSAMPLE;
+    Matrix sketch = {sketch_rows, matrix->cols,
+                     (double *)malloc(sizeof(double) * ((size_t)sketch_rows * matrix->cols + 1))};
+    if(sketch.data == NULL){
+        printf("Memory allocation failed for interpolative decomposition.\n");
+        return false;
+    }
+    bool ok = sketchMatrix(matrix, SKETCH_GAUSSIAN, sketch_rows, seed, &sketch) &&
+              interpolativeCoefficients(&sketch, rank, columns, coefficients);
+    free(sketch.data);
+    return ok;
+}
+
+/*
+ * Function: (bool) curDecomposition
+ * --------------------
+ * Computes a CUR decomposition A ~ C U R with C = A(:, columns) and
+ * R = A(rows, :) taken from randomized interpolative decompositions of A
+ * and A^T. U = C^+ A R^+ is the least squares optimal core, computed from
+ * the Householder QRs C = Qc Rc and R^T = Qr Rr as
+ * U = Rc^-1 (Qc^T A Qr) Rr^-T without forming any pseudoinverse
+ *
+ *  matrix (pointer): the m x n matrix A
+ *  rank (int): number of columns and rows to keep
+ *  seed (uint64_t): seed of the sketches
+ *  columns (pointer): receives the rank column indices
+ *  rows (pointer): receives the rank row indices
+ *  c (pointer): receives the m x rank C
+ *  u (pointer): receives the rank x rank U
+ *  r (pointer): receives the rank x n R
+ *
+ *  Returns true if successful, false on bad arguments, rank deficiency or
+ *  allocation failure
+*/
+bool curDecomposition(const Matrix *matrix, int rank, uint64_t seed, int *columns, int *rows,
+                      Matrix *c, Matrix *u, Matrix *r){
+    int m = matrix->rows;
+    int n = matrix->cols;
+    if(rank < 1 || rank > m || rank > n){
+        printf("Rank must be between 1 and the smaller dimension\n");
+        return false;
+    }
+    size_t larger = (size_t)(m > n ? m : n);
+    size_t size = (size_t)m * n + larger * rank + 2 * ((size_t)m + n) * rank + 3 * (size_t)rank * rank + 1;
+    double *buffer = (double *)malloc(sizeof(double) * size);
+    if(buffer == NULL){
+        printf("Memory allocation failed for CUR decomposition.\n");
+        return false;
+    }
+    Matrix transposed = {n, m, buffer};
+    Matrix coefficients = {rank, (int)larger, transposed.data + (size_t)m * n};
+    Matrix qc = {m, rank, coefficients.data + larger * rank};
+    Matrix qr = {n, rank, qc.data + (size_t)m * rank};
+    Matrix rc = {rank, rank, qr.data + (size_t)n * rank};
+    Matrix rr = {rank, rank, rc.data + (size_t)rank * rank};
+    Matrix core = {rank, rank, rr.data + (size_t)rank * rank};
+    Matrix projected = {rank, n, core.data + (size_t)rank * rank};
+    int i;
+    int k;
+    transposeCopy(matrix, &transposed);
+    bool ok = interpolativeDecomposition(matrix, rank, seed, columns, &coefficients) &&
+              interpolativeDecomposition(&transposed, rank, seed + 1, rows, &coefficients);
+    if(ok){
+        c->rows = m;
+        c->cols = rank;
+        r->rows = rank;
+        r->cols = n;
+        for(i = 0; i < m; i++){
+            for(k = 0; k < rank; k++){
+                c->data[(size_t)i * rank + k] = matrix->data[(size_t)i * n + columns[k]];
+            }
+        }
+        for(k = 0; k < rank; k++){
+            memcpy(r->data + (size_t)k * n, matrix->data + (size_t)rows[k] * n, sizeof(double) * n);
+        }
+        /* Qc^T A, then multiplied by Qr, which holds the rank columns of R^T's Q */
+        ok = householderQR(c, &qc, &rc) &&
+             multiplyMatricesTransposed(&qc, true, matrix, false, &projected);
+    }
+    if(ok){
+        Matrix r_transposed = {n, rank, transposed.data};
+        transposeCopy(r, &r_transposed);
+        ok = householderQR(&r_transposed, &qr, &rr) &&
+             multiplyMatricesEpilogue(&projected, &qr, NULL, &core) &&
+             solveUpperTriangular(&rc, &core);
+    }
+    if(ok){
+        /* core Rr^-T = (Rr^-1 core^T)^T */
+        transposeCopy(&core, u);
+        ok = solveUpperTriangular(&rr, u);
+        if(ok){
+            transposeCopy(u, &core);
+            memcpy(u->data, core.data, sizeof(double) * (size_t)rank * rank);
+        }
+    }
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Function: (bool) hessenbergReduce
+ * --------------------
+ * Reduces a square matrix in place to upper Hessenberg form H = Z^T A Z
+ * with Householder reflectors, accumulating the orthogonal Z
+ *
+ *  matrix (pointer): the n x n matrix, overwritten with H
+ *  z (pointer): receives the n x n orthogonal Z, data must be preallocated
+ *
+ *  Returns true if successful, false if the matrix is not square or on
+ *  allocation failure
+*/
+bool hessenbergReduce(Matrix *matrix, Matrix *z){
+    if(!isSquare(matrix)){
+        printf("Hessenberg reduction needs a square matrix\n");
+        return false;
+    }
+    int n = matrix->rows;
+    double *v = (double *)malloc(sizeof(double) * (2 * (size_t)n + 1));
+    if(v == NULL){
+        printf("Memory allocation failed for Hessenberg reduction.\n");
+        return false;
+    }
+    double *w = v + n;
+    double *h = matrix->data;
+    int i;
+    int j;
+    int k;
+    z->rows = n;
+    z->cols = n;
+    memset(z->data, 0, sizeof(double) * (size_t)n * n);
+    for(i = 0; i < n; i++){
+        z->data[(size_t)i * n + i] = 1.0;
+    }
+    for(k = 0; k + 2 < n; k++){
+        double norm = 0.0;
+        for(i = k + 1; i < n; i++){
+            norm += h[(size_t)i * n + k] * h[(size_t)i * n + k];
+        }
+        norm = sqrt(norm);
+        double head = h[(size_t)(k + 1) * n + k];
+        if(norm == 0 || norm == fabs(head)){
+            continue;
+        }
+        double alpha = head > 0 ? -norm : norm;
+        double v0 = head - alpha;
+        double tau = -v0 / alpha;
+        v[k + 1] = 1.0;
+        for(i = k + 2; i < n; i++){
+            v[i] = h[(size_t)i * n + k] / v0;
+            h[(size_t)i * n + k] = 0.0;
+        }
+        h[(size_t)(k + 1) * n + k] = alpha;
+        /* H = P H on rows k + 1.., columns k + 1.. */
+        for(j = k + 1; j < n; j++){
+            w[j] = 0.0;
+        }
+        for(i = k + 1; i < n; i++){
+            const double *row = h + (size_t)i * n;
+            for(j = k + 1; j < n; j++){
+                w[j] += v[i] * row[j];
+            }
+        }
+        for(i = k + 1; i < n; i++){
+            double *row = h + (size_t)i * n;
+            double scale = tau * v[i];
+            for(j = k + 1; j < n; j++){
+                row[j] -= scale * w[j];
+            }
+        }
+        /* H = H P and Z = Z P on columns k + 1.. of every row */
+        for(i = 0; i < 2 * n; i++){
+            double *row = i < n ? h + (size_t)i * n : z->data + (size_t)(i - n) * n;
+            double sum = 0.0;
+            for(j = k + 1; j < n; j++){
+                sum += row[j] * v[j];
+            }
+            sum *= tau;
+            for(j = k + 1; j < n; j++){
+                row[j] -= sum * v[j];
+            }
+        }
+    }
+    free(v);
+    return true;
+}
+
+/*
+ * Function: (bool) schurDecomposition
+ * --------------------
+ * Computes the real Schur decomposition A = Z T Z^T: T is upper quasi
+ * triangular, with 1 x 1 blocks for real eigenvalues and 2 x 2 blocks for
+ * complex conjugate pairs, and Z is orthogonal. After hessenbergReduce,
+ * Francis double shift QR steps chase a bulge down the active window until
+ * subdiagonal entries become negligible, following the EISPACK hqr2
+ * iteration with its exceptional shifts. Blocks with real eigenvalue pairs
+ * are split with a rotation, and everything below the block diagonal is
+ * set to exactly zero so callers can read the block structure from the
+ * subdiagonal
+ *
+ *  matrix (pointer): the n x n matrix A
+ *  t (pointer): receives T, data must be preallocated, may be matrix
+ *  z (pointer): receives Z, data must be preallocated
+ *
+ *  Returns true if successful, false if the iteration did not converge
+*/
+bool schurDecomposition(const Matrix *matrix, Matrix *t, Matrix *z){
+    if(!isSquare(matrix)){
+        printf("Schur decomposition needs a square matrix\n");
+        return false;
+    }
+    int size = matrix->rows;
+    if(t->data != matrix->data){
+        memcpy(t->data, matrix->data, sizeof(double) * (size_t)size * size);
+    }
+    t->rows = size;
+    t->cols = size;
+    if(!hessenbergReduce(t, z)){
+        return false;
+    }
+    double *h = t->data;
+    double *zd = z->data;
+    double norm = 0.0;
+    double exshift = 0.0;
+    double p = 0;
+    double q = 0;
+    double r = 0;
+    double s = 0;
+    double w;
+    double x;
+    double y;
+    double zz;
+    int n = size - 1;
+    int iter = 0;
+    int total = 0;
+    int i;
+    int j;
+    int k;
+    int l;
+    int m;
+#define H(row, col) h[(size_t)(row) * size + (col)]
+#define Z(row, col) zd[(size_t)(row) * size + (col)]
+    for(i = 0; i < size; i++){
+        for(j = i > 0 ? i - 1 : 0; j < size; j++){
+            norm += fabs(H(i, j));
+        }
+    }
+    while(n >= 0){
+        /* Look for a single small subdiagonal element */
+        for(l = n; l > 0; l--){
+            s = fabs(H(l - 1, l - 1)) + fabs(H(l, l));
+            if(s == 0){
+                s = norm;
+            }
+            if(fabs(H(l, l - 1)) < DBL_EPSILON * s){
+                H(l, l - 1) = 0.0;
+                break;
+            }
+        }
+        if(l == n){
+            /* One root found */
+            H(n, n) += exshift;
+            n--;
+            iter = 0;
+        } else if(l == n - 1){
+            /* Two roots found */
+            w = H(n, n - 1) * H(n - 1, n);
+            p = (H(n - 1, n - 1) - H(n, n)) / 2.0;
+            q = p * p + w;
+            zz = sqrt(fabs(q));
+            H(n, n) += exshift;
+            H(n - 1, n - 1) += exshift;
+            if(q >= 0){
+                /* Real pair, split the block with a rotation */
+                zz = p >= 0 ? p + zz : p - zz;
+                x = H(n, n - 1);
+                s = fabs(x) + fabs(zz);
+                p = x / s;
+                q = zz / s;
+                r = sqrt(p * p + q * q);
+                p /= r;
+                q /= r;
+                for(j = n - 1; j < size; j++){
+                    zz = H(n - 1, j);
+                    H(n - 1, j) = q * zz + p * H(n, j);
+                    H(n, j) = q * H(n, j) - p * zz;
+                }
+                for(i = 0; i <= n; i++){
+                    zz = H(i, n - 1);
+                    H(i, n - 1) = q * zz + p * H(i, n);
+                    H(i, n) = q * H(i, n) - p * zz;
+                }
+                for(i = 0; i < size; i++){
+                    zz = Z(i, n - 1);
+                    Z(i, n - 1) = q * zz + p * Z(i, n);
+                    Z(i, n) = q * Z(i, n) - p * zz;
+                }
+                H(n, n - 1) = 0.0;
+            }
+            n -= 2;
+            iter = 0;
+        } else {
+            if(total++ > SCHUR_MAX_ITERATIONS * size){
+                printf("Schur decomposition did not converge\n");
+                return false;
+            }
+            x = H(n, n);
+            y = H(n - 1, n - 1);
+            w = H(n, n - 1) * H(n - 1, n);
+            /* Exceptional shifts break cycles */
+            if(iter == 10){
+                exshift += x;
+                for(i = 0; i <= n; i++){
+                    H(i, i) -= x;
+                }
+                s = fabs(H(n, n - 1)) + fabs(H(n - 1, n - 2));
+                x = y = 0.75 * s;
+                w = -0.4375 * s * s;
+            }
+            if(iter == 30){
+                s = (y - x) / 2.0;
+                s = s * s + w;
+                if(s > 0){
+                    s = sqrt(s);
+                    if(y < x){
+                        s = -s;
+                    }
+                    s = x - w / ((y - x) / 2.0 + s);
+                    for(i = 0; i <= n; i++){
+                        H(i, i) -= s;
+                    }
+                    exshift += s;
+                    x = y = w = 0.964;
+                }
+            }
+            iter++;
+            /* Look for two consecutive small subdiagonal elements */
+            for(m = n - 2; m >= l; m--){
+                zz = H(m, m);
+                r = x - zz;
+                s = y - zz;
+                p = (r * s - w) / H(m + 1, m) + H(m, m + 1);
+                q = H(m + 1, m + 1) - zz - r - s;
+                r = H(m + 2, m + 1);
+                s = fabs(p) + fabs(q) + fabs(r);
+                p /= s;
+                q /= s;
+                r /= s;
+                if(m == l){
+                    break;
+                }
+                if(fabs(H(m, m - 1)) * (fabs(q) + fabs(r)) <
+                   DBL_EPSILON * (fabs(p) * (fabs(H(m - 1, m - 1)) + fabs(zz) + fabs(H(m + 1, m + 1))))){
+                    break;
+                }
+            }
+            for(i = m + 2; i <= n; i++){
+                H(i, i - 2) = 0.0;
+                if(i > m + 2){
+                    H(i, i - 3) = 0.0;
+                }
+            }
+            /* Double QR step on rows l..n and columns m..n */
+            for(k = m; k <= n - 1; k++){
+                bool notlast = k != n - 1;
+                if(k != m){
+                    p = H(k, k - 1);
+                    q = H(k + 1, k - 1);
+                    r = notlast ? H(k + 2, k - 1) : 0.0;
+                    x = fabs(p) + fabs(q) + fabs(r);
+                    if(x == 0){
+                        continue;
+                    }
+                    p /= x;
+                    q /= x;
+                    r /= x;
+                }
+                s = sqrt(p * p + q * q + r * r);
+                if(p < 0){
+                    s = -s;
+                }
+                if(s == 0){
+                    continue;
+                }
+                if(k != m){
+                    H(k, k - 1) = -s * x;
+                    H(k + 1, k - 1) = 0.0;
+                    if(notlast){
+                        H(k + 2, k - 1) = 0.0;
+                    }
+                } else if(l != m){
+                    H(k, k - 1) = -H(k, k - 1);
+                }
+                p += s;
+                x = p / s;
+                y = q / s;
+                zz = r / s;
+                q /= p;
+                r /= p;
+                for(j = k; j < size; j++){
+                    p = H(k, j) + q * H(k + 1, j);
+                    if(notlast){
+                        p += r * H(k + 2, j);
+                        H(k + 2, j) -= p * zz;
+                    }
+                    H(k, j) -= p * x;
+                    H(k + 1, j) -= p * y;
+                }
+                for(i = 0; i <= (n < k + 3 ? n : k + 3); i++){
+                    p = x * H(i, k) + y * H(i, k + 1);
+                    if(notlast){
+                        p += zz * H(i, k + 2);
+                        H(i, k + 2) -= p * r;
+                    }
+                    H(i, k) -= p;
+                    H(i, k + 1) -= p * q;
+                }
+                for(i = 0; i < size; i++){
+                    p = x * Z(i, k) + y * Z(i, k + 1);
+                    if(notlast){
+                        p += zz * Z(i, k + 2);
+                        Z(i, k + 2) -= p * r;
+                    }
+                    Z(i, k) -= p;
+                    Z(i, k + 1) -= p * q;
+                }
+            }
+        }
+    }
+    for(i = 2; i < size; i++){
+        for(j = 0; j < i - 1; j++){
+            H(i, j) = 0.0;
+        }
+    }
+#undef H
+#undef Z
+    return true;
+}
+
+/*
+ * Function: (int) quasiTriangularSplit
+ * --------------------
+ * Picks a row near the middle of a quasi triangular matrix where it can be
+ * cut into two diagonal blocks without breaking a 2 x 2 block
+ *
+ *  t (pointer): first element of the matrix
+ *  ld (int): distance between its rows
+ *  size (int): its dimension
+ *
+ *  Returns the size of the leading block, or 0 if the matrix is a single
+ *  1 x 1 or 2 x 2 block
+*/
+int quasiTriangularSplit(const double *t, int ld, int size){
+    int half = size / 2;
+    if(half > 0 && t[(size_t)half * ld + half - 1] != 0){
+        half++;
+    }
+    return half < size ? half : 0;
+}
+
+/*
+ * Function: (bool) solveQuasiTriangularSylvester
+ * --------------------
+ * Solves T_A Y + Y T_B = F in place for upper quasi triangular T_A and T_B
+ * Recursively halves the larger of the two matrices at a block boundary:
+ * with T_A = [A11 A12; 0 A22] the bottom rows of Y are solved first and
+ * A12 Y2 is removed from the top rows with one GEMM update, and likewise
+ * for columns with T_B. Most of the work thus lands in
+ * subtractProductStrided; only the 1 x 1 to 2 x 2 diagonal block pairs are
+ * solved directly, as linear systems of at most four unknowns
+ *
+ *  ta (pointer): first element of the m x m matrix T_A
+ *  lda (int): distance between rows of T_A
+ *  m (int): dimension of T_A
+ *  tb (pointer): first element of the n x n matrix T_B
+ *  ldb (int): distance between rows of T_B
+ *  n (int): dimension of T_B
+ *  y (pointer): the m x n right-hand side F, overwritten with Y
+ *  ldy (int): distance between rows of Y
+ *
+ *  Returns true if successful, false if T_A and -T_B share an eigenvalue
+*/
+bool solveQuasiTriangularSylvester(const double *ta, int lda, int m, const double *tb, int ldb, int n,
+                                   double *y, int ldy){
+    int split_a = quasiTriangularSplit(ta, lda, m);
+    int split_b = quasiTriangularSplit(tb, ldb, n);
+    if(split_a > 0 && (m >= n || split_b == 0)){
+        const double *a22 = ta + (size_t)split_a * lda + split_a;
+        double *y2 = y + (size_t)split_a * ldy;
+        if(!solveQuasiTriangularSylvester(a22, lda, m - split_a, tb, ldb, n, y2, ldy)){
+            return false;
+        }
+        subtractProductStrided(ta + split_a, lda, y2, ldy, y, ldy, split_a, m - split_a, n);
+        return solveQuasiTriangularSylvester(ta, lda, split_a, tb, ldb, n, y, ldy);
+    }
+    if(split_b > 0){
+        const double *b22 = tb + (size_t)split_b * ldb + split_b;
+        if(!solveQuasiTriangularSylvester(ta, lda, m, tb, ldb, split_b, y, ldy)){
+            return false;
+        }
+        subtractProductStrided(y, ldy, tb + split_b, ldb, y + split_b, ldy, m, split_b, n - split_b);
+        return solveQuasiTriangularSylvester(ta, lda, m, b22, ldb, n - split_b, y + split_b, ldy);
+    }
+    /* Kronecker form of the block equation, unknown (i, j) at index i * n + j */
+    double system[4][5];
+    int count = m * n;
+    int i;
+    int j;
+    int k;
+    int row;
+    int col;
+    for(i = 0; i < m; i++){
+        for(j = 0; j < n; j++){
+            row = i * n + j;
+            for(col = 0; col < count; col++){
+                system[row][col] = 0.0;
+            }
+            for(k = 0; k < m; k++){
+                system[row][k * n + j] += ta[(size_t)i * lda + k];
+            }
+            for(k = 0; k < n; k++){
+                system[row][i * n + k] += tb[(size_t)k * ldb + j];
+            }
+            system[row][count] = y[(size_t)i * ldy + j];
+        }
+    }
+    /* Gaussian elimination with partial pivoting */
+    for(col = 0; col < count; col++){
+        int pivot = col;
+        for(row = col + 1; row < count; row++){
+            if(fabs(system[row][col]) > fabs(system[pivot][col])){
+                pivot = row;
+            }
+        }
+        if(system[pivot][col] == 0){
+            printf("Sylvester equation is singular\n");
+            return false;
+        }
+        for(k = 0; k <= count; k++){
+            double swap = system[col][k];
+            system[col][k] = system[pivot][k];
+            system[pivot][k] = swap;
+        }
+        for(row = col + 1; row < count; row++){
+            double factor = system[row][col] / system[col][col];
+            for(k = col; k <= count; k++){
+                system[row][k] -= factor * system[col][k];
+            }
+        }
+    }
+    for(row = count - 1; row >= 0; row--){
+        double sum = system[row][count];
+        for(k = row + 1; k < count; k++){
+            sum -= system[row][k] * system[k][count];
+        }
+        system[row][count] = sum / system[row][row];
+    }
+    for(i = 0; i < m; i++){
+        for(j = 0; j < n; j++){
+            y[(size_t)i * ldy + j] = system[i * n + j][count];
+        }
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) solveSylvester
+ * --------------------
+ * Solves the Sylvester equation A X + X B = C with the Bartels-Stewart
+ * method: with the real Schur forms A = U T_A U^T and B = V T_B V^T, the
+ * equation becomes T_A Y + Y T_B = U^T C V with X = U Y V^T, and the
+ * triangular equation is solved by solveQuasiTriangularSylvester
+ * A unique solution exists when no eigenvalue of A is the negative of an
+ * eigenvalue of B
+ *
+ *  matrix_a (pointer): the m x m matrix A
+ *  matrix_b (pointer): the n x n matrix B
+ *  matrix_c (pointer): the m x n right-hand side C
+ *  result (pointer): receives the m x n X, data must be preallocated
+ *
+ *  Returns true if successful, false on mismatched dimensions, a singular
+ *  equation, no convergence or allocation failure
+*/
+bool solveSylvester(const Matrix *matrix_a, const Matrix *matrix_b, const Matrix *matrix_c, Matrix *result){
+    int m = matrix_a->rows;
+    int n = matrix_b->rows;
+    if(!isSquare(matrix_a) || !isSquare(matrix_b) || matrix_c->rows != m || matrix_c->cols != n){
+        printf("Mismatch in the dimensions of the Sylvester equation\n");
+        return false;
+    }
+    size_t larger = (size_t)(m > n ? m : n);
+    double *buffer = (double *)malloc(sizeof(double) * (2 * (size_t)m * m + 2 * (size_t)n * n + larger * larger + 1));
+    if(buffer == NULL){
+        printf("Memory allocation failed for Sylvester solver.\n");
+        return false;
+    }
+    Matrix ta = {m, m, buffer};
+    Matrix u = {m, m, ta.data + (size_t)m * m};
+    Matrix tb = {n, n, u.data + (size_t)m * m};
+    Matrix v = {n, n, tb.data + (size_t)n * n};
+    Matrix work = {m, n, v.data + (size_t)n * n};
+    bool ok = schurDecomposition(matrix_a, &ta, &u) && schurDecomposition(matrix_b, &tb, &v) &&
+              multiplyMatricesTransposed(&u, true, matrix_c, false, &work) &&
+              multiplyMatricesEpilogue(&work, &v, NULL, result) &&
+              solveQuasiTriangularSylvester(ta.data, m, m, tb.data, n, n, result->data, n) &&
+              multiplyMatricesEpilogue(&u, result, NULL, &work) &&
+              multiplyMatricesTransposed(&work, false, &v, true, result);
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Function: (bool) solveLyapunov
+ * --------------------
+ * Solves the continuous Lyapunov equation A X + X A^T = Q as the
+ * Sylvester equation with B = A^T
+ *
+ *  matrix_a (pointer): the n x n matrix A
+ *  matrix_q (pointer): the n x n right-hand side Q
+ *  result (pointer): receives the n x n X, data must be preallocated
+ *
+ *  Returns true if successful, false as for solveSylvester
+*/
+bool solveLyapunov(const Matrix *matrix_a, const Matrix *matrix_q, Matrix *result){
+    Matrix transposed = {matrix_a->cols, matrix_a->rows,
+                         (double *)malloc(sizeof(double) * ((size_t)matrix_a->rows * matrix_a->cols + 1))};
+    if(transposed.data == NULL){
+        printf("Memory allocation failed for Lyapunov solver.\n");
+        return false;
+    }
+    transposeCopy(matrix_a, &transposed);
+    bool ok = solveSylvester(matrix_a, &transposed, matrix_q, result);
+    free(transposed.data);
+    return ok;
+}
+
+/*
+ * Function: (void) shiftedSparseProduct
+ * --------------------
+ * Computes y = (A + shift I) x for a square sparse A
+ *
+ *  matrix (pointer): the sparse matrix A
+ *  shift (double): the diagonal shift
+ *  x (pointer): the input vector
+ *  y (pointer): the output vector, must not overlap x
+*/
+void shiftedSparseProduct(const SparseMatrix *matrix, double shift, const double *x, double *y){
+    int r;
+    int position;
+    for(r = 0; r < matrix->rows; r++){
+        double sum = shift * x[r];
+        for(position = matrix->row_ptr[r]; position < matrix->row_ptr[r + 1]; position++){
+            sum += matrix->values[position] * x[matrix->col_index[position]];
+        }
+        y[r] = sum;
+    }
+}
+
+/*
+ * Function: (bool) solveShiftedSparse
+ * --------------------
+ * Solves (A + shift I) x = b for a square sparse A with BiCGSTAB, right
+ * preconditioned by the diagonal of A + shift I
+ *
+ *  matrix (pointer): the sparse matrix A
+ *  shift (double): the diagonal shift
+ *  rhs (pointer): the right-hand side b
+ *  x (pointer): receives the solution
+ *  tolerance (double): relative residual at which to stop
+ *  max_iter (int): iteration limit
+ *  work (pointer): scratch space of 8 * rows doubles
+ *
+ *  Returns true if the iteration converged
+*/
+bool solveShiftedSparse(const SparseMatrix *matrix, double shift, const double *rhs, double *x,
+                        double tolerance, int max_iter, double *work){
+    int n = matrix->rows;
+    double *residual = work;
+    double *shadow = residual + n;
+    double *direction = shadow + n;
+    double *image = direction + n;
+    double *preconditioned = image + n;
+    double *partial = preconditioned + n;
+    double *correction = partial + n;
+    double *diagonal = correction + n;
+    double rho = 1.0;
+    double alpha = 1.0;
+    double omega = 1.0;
+    double target = 0.0;
+    int iteration;
+    int i;
+    int position;
+    for(i = 0; i < n; i++){
+        diagonal[i] = shift;
+        for(position = matrix->row_ptr[i]; position < matrix->row_ptr[i + 1]; position++){
+            if(matrix->col_index[position] == i){
+                diagonal[i] += matrix->values[position];
+            }
+        }
+        if(diagonal[i] == 0){
+            diagonal[i] = 1.0;
+        }
+        x[i] = 0.0;
+        residual[i] = rhs[i];
+        shadow[i] = rhs[i];
+        direction[i] = 0.0;
+        image[i] = 0.0;
+        target += rhs[i] * rhs[i];
+    }
+    target *= tolerance * tolerance;
+    if(target == 0){
+        return true;
+    }
+    for(iteration = 0; iteration < max_iter; iteration++){
+        double rho_next = 0.0;
+        for(i = 0; i < n; i++){
+            rho_next += shadow[i] * residual[i];
+        }
+        if(rho_next == 0){
+            return false;
+        }
+        double beta = (rho_next / rho) * (alpha / omega);
+        rho = rho_next;
+        for(i = 0; i < n; i++){
+            direction[i] = residual[i] + beta * (direction[i] - omega * image[i]);
+            preconditioned[i] = direction[i] / diagonal[i];
+        }
+        shiftedSparseProduct(matrix, shift, preconditioned, image);
+        double denominator = 0.0;
+        for(i = 0; i < n; i++){
+            denominator += shadow[i] * image[i];
+        }
+        alpha = rho / denominator;
+        double norm = 0.0;
+        for(i = 0; i < n; i++){
+            residual[i] -= alpha * image[i];
+            x[i] += alpha * preconditioned[i];
+            norm += residual[i] * residual[i];
+            partial[i] = residual[i] / diagonal[i];
+        }
+        if(norm <= target){
+            return true;
+        }
+        shiftedSparseProduct(matrix, shift, partial, correction);
+        double numerator = 0.0;
+        denominator = 0.0;
+        for(i = 0; i < n; i++){
+            numerator += correction[i] * residual[i];
+            denominator += correction[i] * correction[i];
+        }
+        omega = numerator / denominator;
+        norm = 0.0;
+        for(i = 0; i < n; i++){
+            x[i] += omega * partial[i];
+            residual[i] -= omega * correction[i];
+            norm += residual[i] * residual[i];
+        }
+        if(norm <= target){
+            return true;
+        }
+        if(omega == 0){
+            return false;
+        }
+    }
+    return false;
+}
+
+/*
+ * Function: (bool) lowRankADI
+ * --------------------
+ * Computes a low rank factor Z with X ~ Z Z^T for the Lyapunov equation
+ * A X + X A^T + B B^T = 0 with a large sparse stable A, by the low rank
+ * Cholesky factor ADI iteration:
+ *   V_1 = sqrt(-2 p_1) (A + p_1 I)^-1 B
+ *   V_i = sqrt(p_i / p_{i-1}) (V_{i-1} - (p_i + p_{i-1}) (A + p_i I)^-1 V_{i-1})
+ * Z gains the k columns of V_i every step, and the iteration stops once
+ * ||V_i|| <= tolerance ||Z||. The shifts must be negative; values spread
+ * logarithmically over the real parts of the spectrum of A work well and
+ * are cycled when there are fewer of them than iterations. The shifted
+ * systems are solved column by column with solveShiftedSparse
+ *
+ *  matrix_a (pointer): the n x n sparse matrix A
+ *  matrix_b (pointer): the n x k dense B, k small
+ *  shifts (pointer): shift_count negative shifts
+ *  shift_count (int): number of shifts
+ *  max_iter (int): maximum number of ADI steps
+ *  tolerance (double): relative size of the last block at which to stop
+ *  result (pointer): receives Z, n x (steps * k); room for n x (max_iter * k)
+ *
+ *  Returns true if successful, false on bad arguments, a failed inner
+ *  solve, allocation failure, or when max_iter steps did not reach the
+ *  tolerance; Z then holds all max_iter steps
+*/
+bool lowRankADI(const SparseMatrix *matrix_a, const Matrix *matrix_b, const double *shifts, int shift_count,
+                int max_iter, double tolerance, Matrix *result){
+    int n = matrix_a->rows;
+    int k = matrix_b->cols;
+    int i;
+    int c;
+    int step;
+    if(matrix_a->cols != n || matrix_b->rows != n || shift_count < 1 || max_iter < 1){
+        printf("Bad arguments for low rank ADI\n");
+        return false;
+    }
+    for(i = 0; i < shift_count; i++){
+        if(shifts[i] >= 0){
+            printf("ADI shifts must be negative\n");
+            return false;
+        }
+    }
+    /* Current block V column by column, a solve result and the solver workspace */
+    double *block = (double *)malloc(sizeof(double) * ((size_t)n * (k + 9) + 1));
+    if(block == NULL){
+        printf("Memory allocation failed for low rank ADI.\n");
+        return false;
+    }
+    double *solution = block + (size_t)n * k;
+    double *work = solution + n;
+    int stride = max_iter * k;
+    double total = 0.0;
+    bool ok = true;
+    bool converged = false;
+    for(c = 0; c < k; c++){
+        for(i = 0; i < n; i++){
+            block[(size_t)c * n + i] = matrix_b->data[(size_t)i * k + c];
+        }
+    }
+    for(step = 0; step < max_iter && ok; step++){
+        double shift = shifts[step % shift_count];
+        double previous = shifts[(step + shift_count - 1) % shift_count];
+        double norm = 0.0;
+        for(c = 0; c < k && ok; c++){
+            double *column = block + (size_t)c * n;
+            ok = solveShiftedSparse(matrix_a, shift, column, solution, ADI_INNER_TOLERANCE, n + 100, work);
+            if(!ok){
+                printf("Shifted solve did not converge in low rank ADI\n");
+                break;
+            }
+            if(step == 0){
+                double scale = sqrt(-2.0 * shift);
+                for(i = 0; i < n; i++){
+                    column[i] = scale * solution[i];
+                }
+            } else {
+                double scale = sqrt(shift / previous);
+                for(i = 0; i < n; i++){
+                    column[i] = scale * (column[i] - (shift + previous) * solution[i]);
+                }
+            }
+            for(i = 0; i < n; i++){
+                result->data[(size_t)i * stride + (size_t)step * k + c] = column[i];
+                norm += column[i] * column[i];
+            }
+        }
+        total += norm;
+        if(ok && norm <= tolerance * tolerance * total){
+            converged = true;
+            step++;
+            break;
+        }
+    }
+    /* Pack the rows to the final number of columns */
+    int cols = step * k;
+    for(i = 0; i < n && ok; i++){
+        memmove(result->data + (size_t)i * cols, result->data + (size_t)i * stride, sizeof(double) * cols);
+    }
+    result->rows = n;
+    result->cols = cols;
+    free(block);
+    if(ok && !converged){
+        printf("Low rank ADI did not converge in %d steps\n", max_iter);
+        return false;
+    }
+    return ok;
+}
+
+/*
+ * Function: (bool) symmetricEigen
+ * --------------------
+ * Computes all eigenvalues and eigenvectors of a symmetric matrix
+ * Householder reduction to tridiagonal form with the transformations
+ * accumulated (EISPACK tred2), then the implicit QL iteration with
+ * Wilkinson shifts on the tridiagonal matrix, rotating the accumulated
+ * vectors along (tql2). Only the lower triangle of the input is read
+ *
+ *  matrix (pointer): the symmetric n x n matrix
+ *  eigenvalues (pointer): receives the n eigenvalues in ascending order
+ *  eigenvectors (pointer): receives the orthonormal eigenvectors as
+ *                          columns, data must be preallocated, may be matrix
+ *
+ *  Returns true if successful, false if the matrix is not square, the
+ *  iteration did not converge or on allocation failure
+*/
+bool symmetricEigen(const Matrix *matrix, double *eigenvalues, Matrix *eigenvectors){
+    if(!isSquare(matrix)){
+        printf("Eigendecomposition needs a square matrix\n");
+        return false;
+    }
+    int n = matrix->rows;
+    if(n == 0){
+        return true;
+    }
+    double *e = (double *)malloc(sizeof(double) * ((size_t)n + 1));
+    if(e == NULL){
+        printf("Memory allocation failed for eigensolver.\n");
+        return false;
+    }
+    double *d = eigenvalues;
+    double *v = eigenvectors->data;
+    double f;
+    double g;
+    double h;
+    double hh;
+    double scale;
+    int i;
+    int j;
+    int k;
+    int l;
+    int m;
+#define V(row, col) v[(size_t)(row) * n + (col)]
+    if(v != matrix->data){
+        memcpy(v, matrix->data, sizeof(double) * (size_t)n * n);
+    }
+    eigenvectors->rows = n;
+    eigenvectors->cols = n;
+    /* Tridiagonalize, working up from the last row */
+    for(j = 0; j < n; j++){
+        d[j] = V(n - 1, j);
+    }
+    for(i = n - 1; i > 0; i--){
+        scale = 0.0;
+        h = 0.0;
+        for(k = 0; k < i; k++){
+            scale += fabs(d[k]);
+        }
+        if(scale == 0){
+            e[i] = d[i - 1];
+            for(j = 0; j < i; j++){
+                d[j] = V(i - 1, j);
+                V(i, j) = 0.0;
+                V(j, i) = 0.0;
+            }
+        } else {
+            for(k = 0; k < i; k++){
+                d[k] /= scale;
+                h += d[k] * d[k];
+            }
+            f = d[i - 1];
+            g = sqrt(h);
+            if(f > 0){
+                g = -g;
+            }
+            e[i] = scale * g;
+            h -= f * g;
+            d[i - 1] = f - g;
+            for(j = 0; j < i; j++){
+                e[j] = 0.0;
+            }
+            for(j = 0; j < i; j++){
+                f = d[j];
+                V(j, i) = f;
+                g = e[j] + V(j, j) * f;
+                for(k = j + 1; k <= i - 1; k++){
+                    g += V(k, j) * d[k];
+                    e[k] += V(k, j) * f;
+                }
+                e[j] = g;
+            }
+            f = 0.0;
+            for(j = 0; j < i; j++){
+                e[j] /= h;
+                f += e[j] * d[j];
+            }
+            hh = f / (h + h);
+            for(j = 0; j < i; j++){
+                e[j] -= hh * d[j];
+            }
+            for(j = 0; j < i; j++){
+                f = d[j];
+                g = e[j];
+                for(k = j; k <= i - 1; k++){
+                    V(k, j) -= f * e[k] + g * d[k];
+                }
+                d[j] = V(i - 1, j);
+                V(i, j) = 0.0;
+            }
+        }
+        d[i] = h;
+    }
+    /* Accumulate the transformations */
+    for(i = 0; i < n - 1; i++){
+        V(n - 1, i) = V(i, i);
+        V(i, i) = 1.0;
+        h = d[i + 1];
+        if(h != 0){
+            for(k = 0; k <= i; k++){
+                d[k] = V(k, i + 1) / h;
+            }
+            for(j = 0; j <= i; j++){
+                g = 0.0;
+                for(k = 0; k <= i; k++){
+                    g += V(k, i + 1) * V(k, j);
+                }
+                for(k = 0; k <= i; k++){
+                    V(k, j) -= g * d[k];
+                }
+            }
+        }
+        for(k = 0; k <= i; k++){
+            V(k, i + 1) = 0.0;
+        }
+    }
+    for(j = 0; j < n; j++){
+        d[j] = V(n - 1, j);
+        V(n - 1, j) = 0.0;
+    }
+    V(n - 1, n - 1) = 1.0;
+    /* Implicit QL on the tridiagonal matrix */
+    for(i = 1; i < n; i++){
+        e[i - 1] = e[i];
+    }
+    e[n - 1] = 0.0;
+    f = 0.0;
+    double largest = 0.0;
+    int total = 0;
+    for(l = 0; l < n; l++){
+        largest = fmax(largest, fabs(d[l]) + fabs(e[l]));
+        for(m = l; m < n - 1; m++){
+            if(fabs(e[m]) <= DBL_EPSILON * largest){
+                break;
+            }
+        }
+        if(m > l){
+            do {
+                if(total++ > SCHUR_MAX_ITERATIONS * n){
+                    printf("Eigensolver did not converge\n");
+                    free(e);
+                    return false;
+                }
+                g = d[l];
+                double p = (d[l + 1] - g) / (2.0 * e[l]);
+                double r = hypot(p, 1.0);
+                if(p < 0){
+                    r = -r;
+                }
+                d[l] = e[l] / (p + r);
+                d[l + 1] = e[l] * (p + r);
+                double next = d[l + 1];
+                h = g - d[l];
+                for(i = l + 2; i < n; i++){
+                    d[i] -= h;
+                }
+                f += h;
+                p = d[m];
+                double c = 1.0;
+                double c2 = c;
+                double c3 = c;
+                double following = e[l + 1];
+                double s = 0.0;
+                double s2 = 0.0;
+                for(i = m - 1; i >= l; i--){
+                    c3 = c2;
+                    c2 = c;
+                    s2 = s;
+                    g = c * e[i];
+                    h = c * p;
+                    r = hypot(p, e[i]);
+                    e[i + 1] = s * r;
+                    s = e[i] / r;
+                    c = p / r;
+                    p = c * d[i] - s * g;
+                    d[i + 1] = h + s * (c * g + s * d[i]);
+                    /* Rotate columns i and i + 1 of the vectors */
+                    for(k = 0; k < n; k++){
+                        h = V(k, i + 1);
+                        V(k, i + 1) = s * V(k, i) + c * h;
+                        V(k, i) = c * V(k, i) - s * h;
+                    }
+                }
+                p = -s * s2 * c3 * following * e[l] / next;
+                e[l] = s * p;
+                d[l] = c * p;
+            } while(fabs(e[l]) > DBL_EPSILON * largest);
+        }
+        d[l] += f;
+        e[l] = 0.0;
+    }
+    /* Sort ascending, moving the vectors along */
+    for(i = 0; i < n - 1; i++){
+        k = i;
+        for(j = i + 1; j < n; j++){
+            if(d[j] < d[k]){
+                k = j;
+            }
+        }
+        if(k != i){
+            double swap = d[k];
+            d[k] = d[i];
+            d[i] = swap;
+            for(j = 0; j < n; j++){
+                swap = V(j, i);
+                V(j, i) = V(j, k);
+                V(j, k) = swap;
+            }
+        }
+    }
+#undef V
+    free(e);
+    return true;
+}
+
+/*
+ * Function: (bool) reduceGeneralizedSymmetric
+ * --------------------
+ * Overwrites the symmetric matrix A with C = L^-1 A L^-T, blocked as in
+ * LAPACK's xSYGST. For each diagonal block of REDUCTION_BLOCK columns:
+ *   A11 = L11^-1 A11 L11^-T   by two small triangular solves
+ *   A21 = A21 L11^-T
+ *   A21 -= 1/2 L21 A11
+ *   A22 -= A21 L21^T + L21 A21^T   on the lower triangle only
+ *   A21 -= 1/2 L21 A11
+ *   A21 = L22^-1 A21
+ * The two halves of the symmetric update let it run as one rank 2k
+ * product, so most of the n^3 flops go through subtractProductStrided.
+ * The lower triangle is mirrored into the upper one at the end
+ *
+ *  lower (pointer): the Cholesky factor L of B
+ *  matrix (pointer): the symmetric n x n matrix A, replaced by C
+ *
+ *  Returns true if successful, false on mismatched dimensions or
+ *  allocation failure
+*/
+bool reduceGeneralizedSymmetric(const Matrix *lower, Matrix *matrix){
+    int n = matrix->rows;
+    if(!isSquare(matrix) || !checkDimensions(lower, matrix)){
+        printf("Mismatch in the dimensions of the two sided reduction\n");
+        return false;
+    }
+    double *scratch = (double *)malloc(sizeof(double) * ((size_t)REDUCTION_BLOCK * REDUCTION_BLOCK + 2 * (size_t)REDUCTION_BLOCK * n + 1));
+    if(scratch == NULL){
+        printf("Memory allocation failed for two sided reduction.\n");
+        return false;
+    }
+    const double *l = lower->data;
+    double *a = matrix->data;
+    double *half = scratch;
+    double *a21t = scratch + (size_t)REDUCTION_BLOCK * REDUCTION_BLOCK;
+    double *l21t = a21t + (size_t)REDUCTION_BLOCK * n;
+    int k;
+    int i;
+    int j;
+    int p;
+    int pass;
+    for(k = 0; k < n; k += REDUCTION_BLOCK){
+        int kb = (n - k < REDUCTION_BLOCK) ? n - k : REDUCTION_BLOCK;
+        int rows = n - k - kb;
+        double *a11 = a + (size_t)k * n + k;
+        const double *l11 = l + (size_t)k * n + k;
+        /* A11 L11^-T row by row, transposed, then solved again: A11 is symmetric */
+        for(pass = 0; pass < 2; pass++){
+            for(i = 0; i < kb; i++){
+                double *x = a11 + (size_t)i * n;
+                for(j = 0; j < kb; j++){
+                    double sum = x[j];
+                    for(p = 0; p < j; p++){
+                        sum -= x[p] * l11[(size_t)j * n + p];
+                    }
+                    x[j] = sum / l11[(size_t)j * n + j];
+                }
+            }
+            for(i = 0; i < kb; i++){
+                for(j = 0; j < i; j++){
+                    double swap = a11[(size_t)i * n + j];
+                    a11[(size_t)i * n + j] = a11[(size_t)j * n + i];
+                    a11[(size_t)j * n + i] = swap;
+                }
+            }
+        }
+        for(i = 0; i < kb; i++){
+            for(j = 0; j < i; j++){
+                double mean = 0.5 * (a11[(size_t)i * n + j] + a11[(size_t)j * n + i]);
+                a11[(size_t)i * n + j] = mean;
+                a11[(size_t)j * n + i] = mean;
+            }
+        }
+        if(rows == 0){
+            break;
+        }
+        double *a21 = a + (size_t)(k + kb) * n + k;
+        double *a22 = a21 + kb;
+        const double *l21 = l + (size_t)(k + kb) * n + k;
+        const double *l22 = l21 + kb;
+        /* A21 L11^-T */
+        for(i = 0; i < rows; i++){
+            double *x = a21 + (size_t)i * n;
+            for(j = 0; j < kb; j++){
+                double sum = x[j];
+                for(p = 0; p < j; p++){
+                    sum -= x[p] * l11[(size_t)j * n + p];
+                }
+                x[j] = sum / l11[(size_t)j * n + j];
+            }
+        }
+        for(i = 0; i < kb; i++){
+            for(j = 0; j < kb; j++){
+                half[i * kb + j] = 0.5 * a11[(size_t)i * n + j];
+            }
+        }
+        subtractProductStrided(l21, n, half, kb, a21, n, rows, kb, kb);
+        for(i = 0; i < rows; i++){
+            for(j = 0; j < kb; j++){
+                a21t[(size_t)j * rows + i] = a21[(size_t)i * n + j];
+                l21t[(size_t)j * rows + i] = l21[(size_t)i * n + j];
+            }
+        }
+        /* Rank 2k update of A22, one block row at a time up to its diagonal block */
+        for(i = 0; i < rows; i += REDUCTION_BLOCK){
+            int ib = (rows - i < REDUCTION_BLOCK) ? rows - i : REDUCTION_BLOCK;
+            subtractProductStrided(a21 + (size_t)i * n, n, l21t, rows, a22 + (size_t)i * n, n, ib, kb, i + ib);
+            subtractProductStrided(l21 + (size_t)i * n, n, a21t, rows, a22 + (size_t)i * n, n, ib, kb, i + ib);
+        }
+        subtractProductStrided(l21, n, half, kb, a21, n, rows, kb, kb);
+        /* L22^-1 A21 by forward substitution over whole rows */
+        for(i = 0; i < rows; i++){
+            double *x = a21 + (size_t)i * n;
+            for(p = 0; p < i; p++){
+                double coefficient = l22[(size_t)i * n + p];
+                if(coefficient != 0.0){
+                    const double *y = a21 + (size_t)p * n;
+                    for(j = 0; j < kb; j++){
+                        x[j] -= coefficient * y[j];
+                    }
+                }
+            }
+            double pivot = l22[(size_t)i * n + i];
+            for(j = 0; j < kb; j++){
+                x[j] /= pivot;
+            }
+        }
+    }
+    for(i = 0; i < n; i++){
+        for(j = 0; j < i; j++){
+            a[(size_t)j * n + i] = a[(size_t)i * n + j];
+        }
+    }
+    free(scratch);
+    return true;
+}
+
+/*
+ * Function: (bool) generalizedSymmetricEigen
+ * --------------------
+ * Solves A x = lambda B x for symmetric A and symmetric positive definite
+ * B without forming any inverse. With B = L L^T from choleskyFactor, the
+ * problem becomes the standard C y = lambda y with C = L^-1 A L^-T and
+ * x = L^-T y. C is formed by the blocked two sided reduction
+ * reduceGeneralizedSymmetric, which needs about n^3 flops against 2n^3 for
+ * two full triangular solves. It is solved by symmetricEigen and the
+ * vectors are mapped back by one more triangular solve. The eigenvectors
+ * come out B-orthonormal, X^T B X = I
+ *
+ *  matrix_a (pointer): the symmetric n x n matrix A
+ *  matrix_b (pointer): the symmetric positive definite n x n matrix B
+ *  eigenvalues (pointer): receives the n eigenvalues in ascending order
+ *  eigenvectors (pointer): receives the eigenvectors as columns, data must
+ *                          be preallocated
+ *
+ *  Returns true if successful, false on mismatched dimensions, B not
+ *  positive definite, no convergence or allocation failure
+*/
+bool generalizedSymmetricEigen(const Matrix *matrix_a, const Matrix *matrix_b, double *eigenvalues, Matrix *eigenvectors){
+    int n = matrix_a->rows;
+    if(!isSquare(matrix_a) || !checkDimensions(matrix_a, matrix_b)){
+        printf("Mismatch in the dimensions of the generalized eigenproblem\n");
+        return false;
+    }
+    double *buffer = (double *)malloc(sizeof(double) * (2 * (size_t)n * n + 1));
+    if(buffer == NULL){
+        printf("Memory allocation failed for generalized eigensolver.\n");
+        return false;
+    }
+    Matrix lower = {n, n, buffer};
+    Matrix work = {n, n, buffer + (size_t)n * n};
+    memcpy(work.data, matrix_a->data, sizeof(double) * (size_t)n * n);
+    bool ok = choleskyFactor(matrix_b, &lower) && reduceGeneralizedSymmetric(&lower, &work)
+              && symmetricEigen(&work, eigenvalues, eigenvectors);
+    if(ok){
+        /* x = L^-T y, solved as L^T X = Y */
+        transposeCopy(&lower, &work);
+        ok = solveUpperTriangular(&work, eigenvectors);
+    }
+    free(buffer);
+    return ok;
+}
+
+/*
+ * Macro: DEFINE_BATCHED_KERNELS
+ * --------------------
+ * Defines the kernels run on every system of a batch, for matrices of
+ * dimension SIZE stored row by row:
+ *   int luKernel##SUFFIX(a, n, pivots): LU with partial pivoting in place,
+ *     unit lower L below the diagonal, pivots[k] the row swapped with k
+ *   void luSolveKernel##SUFFIX(lu, pivots, b, n, k): solves with the LU
+ *     for the n x k right-hand sides b in place
+ *   int choleskyKernel##SUFFIX(a, n): a = L L^T in place, upper part zeroed
+ *   void choleskySolveKernel##SUFFIX(l, b, n, k): solves with L L^T
+ * The factorizations return 0, or the 1-based column where they broke
+ * down. Passing the parameter n as SIZE gives the general kernels; a
+ * literal SIZE gives constant trip counts that the compiler fully unrolls
+ * and keeps in registers, which is where small systems spend their time
+*/
+#define DEFINE_BATCHED_KERNELS(SUFFIX, SIZE)                                                 \
+int luKernel##SUFFIX(double *a, int n, int *pivots){                                         \
+    const int size = SIZE;                                                                   \
+    int singular = 0;                                                                        \
+    int i;                                                                                   \
+    int j;                                                                                   \
+    int k;                                                                                   \
+    (void)n;                                                                                 \
+    for(k = 0; k < size; k++){                                                               \
+        int pivot = k;                                                                       \
+        for(i = k + 1; i < size; i++){                                                       \
+            if(fabs(a[i * size + k]) > fabs(a[pivot * size + k])){                           \
+                pivot = i;                                                                   \
+            }                                                                                \
+        }                                                                                    \
+        pivots[k] = pivot;                                                                   \
+        if(a[pivot * size + k] == 0){                                                        \
+            singular = singular == 0 ? k + 1 : singular;                                     \
+            continue;                                                                        \
+        }                                                                                    \
+        if(pivot != k){                                                                      \
+            for(j = 0; j < size; j++){                                                       \
+                double swap = a[k * size + j];                                               \
+                a[k * size + j] = a[pivot * size + j];                                       \
+                a[pivot * size + j] = swap;                                                  \
+            }                                                                                \
+        }                                                                                    \
+        double inverse = 1.0 / a[k * size + k];                                              \
+        for(i = k + 1; i < size; i++){                                                       \
+            double factor = a[i * size + k] * inverse;                                       \
+            a[i * size + k] = factor;                                                        \
+            for(j = k + 1; j < size; j++){                                                   \
+                a[i * size + j] -= factor * a[k * size + j];                                 \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+    return singular;                                                                         \
+}                                                                                            \
+void luSolveKernel##SUFFIX(const double *lu, const int *pivots, double *b, int n, int k){    \
+    const int size = SIZE;                                                                   \
+    int i;                                                                                   \
+    int j;                                                                                   \
+    int c;                                                                                   \
+    (void)n;                                                                                 \
+    for(i = 0; i < size; i++){                                                               \
+        if(pivots[i] != i){                                                                  \
+            for(c = 0; c < k; c++){                                                          \
+                double swap = b[i * k + c];                                                  \
+                b[i * k + c] = b[pivots[i] * k + c];                                         \
+                b[pivots[i] * k + c] = swap;                                                 \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+    for(i = 1; i < size; i++){                                                               \
+        for(j = 0; j < i; j++){                                                              \
+            double factor = lu[i * size + j];                                                \
+            for(c = 0; c < k; c++){                                                          \
+                b[i * k + c] -= factor * b[j * k + c];                                       \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+    for(i = size - 1; i >= 0; i--){                                                          \
+        for(j = i + 1; j < size; j++){                                                       \
+            double factor = lu[i * size + j];                                                \
+            for(c = 0; c < k; c++){                                                          \
+                b[i * k + c] -= factor * b[j * k + c];                                       \
+            }                                                                                \
+        }                                                                                    \
+        double inverse = 1.0 / lu[i * size + i];                                             \
+        for(c = 0; c < k; c++){                                                              \
+            b[i * k + c] *= inverse;                                                         \
+        }                                                                                    \
+    }                                                                                        \
+}                                                                                            \
+int choleskyKernel##SUFFIX(double *a, int n){                                                \
+    const int size = SIZE;                                                                   \
+    int i;                                                                                   \
+    int j;                                                                                   \
+    int k;                                                                                   \
+    (void)n;                                                                                 \
+    for(i = 0; i < size; i++){                                                               \
+        for(j = 0; j <= i; j++){                                                             \
+            double sum = a[i * size + j];                                                    \
+            for(k = 0; k < j; k++){                                                          \
+                sum -= a[i * size + k] * a[j * size + k];                                    \
+            }                                                                                \
+            if(j < i){                                                                       \
+                a[i * size + j] = sum / a[j * size + j];                                     \
+            } else if(sum > 0){                                                              \
+                a[i * size + i] = sqrt(sum);                                                 \
+            } else {                                                                         \
+                return i + 1;                                                                \
+            }                                                                                \
+        }                                                                                    \
+        for(j = i + 1; j < size; j++){                                                       \
+            a[i * size + j] = 0.0;                                                           \
+        }                                                                                    \
+    }                                                                                        \
+    return 0;                                                                                \
+}                                                                                            \
+void choleskySolveKernel##SUFFIX(const double *l, double *b, int n, int k){                  \
+    const int size = SIZE;                                                                   \
+    int i;                                                                                   \
+    int j;                                                                                   \
+    int c;                                                                                   \
+    (void)n;                                                                                 \
+    for(i = 0; i < size; i++){                                                               \
+        for(j = 0; j < i; j++){                                                              \
+            double factor = l[i * size + j];                                                 \
+            for(c = 0; c < k; c++){                                                          \
+                b[i * k + c] -= factor * b[j * k + c];                                       \
+            }                                                                                \
+        }                                                                                    \
+        double inverse = 1.0 / l[i * size + i];                                              \
+        for(c = 0; c < k; c++){                                                              \
+            b[i * k + c] *= inverse;                                                         \
+        }                                                                                    \
+    }                                                                                        \
+    for(i = size - 1; i >= 0; i--){                                                          \
+        double inverse = 1.0 / l[i * size + i];                                              \
+        for(c = 0; c < k; c++){                                                              \
+            b[i * k + c] *= inverse;                                                         \
+        }                                                                                    \
+        for(j = 0; j < i; j++){                                                              \
+            double factor = l[i * size + j];                                                 \
+            for(c = 0; c < k; c++){                                                          \
+                b[j * k + c] -= factor * b[i * k + c];                                       \
+            }                                                                                \
+        }                                                                                    \
+    }                                                                                        \
+}
+
+DEFINE_BATCHED_KERNELS(General, n)
+DEFINE_BATCHED_KERNELS(4, 4)
+DEFINE_BATCHED_KERNELS(6, 6)
+DEFINE_BATCHED_KERNELS(8, 8)
+DEFINE_BATCHED_KERNELS(12, 12)
+DEFINE_BATCHED_KERNELS(16, 16)
+DEFINE_BATCHED_KERNELS(32, 32)
+
+/*
+ * Callback: LUKernel, LUSolveKernel, CholeskyKernel, CholeskySolveKernel
+ * --------------------
+ * Signatures of the kernels from DEFINE_BATCHED_KERNELS, so a batch picks
+ * its kernel once rather than per system
+*/
+typedef int (*LUKernel)(double *a, int n, int *pivots);
+typedef void (*LUSolveKernel)(const double *lu, const int *pivots, double *b, int n, int k);
+typedef int (*CholeskyKernel)(double *a, int n);
+typedef void (*CholeskySolveKernel)(const double *l, double *b, int n, int k);
+
+/*
+ * Function: (bool) checkBatch
+ * --------------------
+ * Checks that a batch holds square matrices that do not overlap
+ *
+ *  matrix (pointer): shape of the matrices of the batch
+ *  stride (int): number of doubles between consecutive matrices
+ *  batch_count (int): number of matrices
+ *
+ *  Returns true if the batch is valid
+*/
+bool checkBatch(const Matrix *matrix, int stride, int batch_count){
+    if(!isSquare(matrix)){
+        printf("Batched factorizations need square matrices\n");
+        return false;
+    }
+    if(batch_count > 1 && stride < matrix->rows * matrix->cols){
+        printf("Stride too small for the batch\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) luFactorBatched
+ * --------------------
+ * Computes the LU factorization with partial pivoting of batch_count square
+ * matrices laid out as in multiplyMatricesStridedBatched, each in place
+ * Dimensions 4, 6, 8, 12, 16 and 32 use the unrolled kernels
+ *
+ *  matrix (pointer): shape and first element of the batch
+ *  stride (int): number of doubles between consecutive matrices
+ *  batch_count (int): number of matrices
+ *  pivots (pointer): receives n pivot rows per matrix, one after the other
+ *  info (pointer): receives 0 per nonsingular matrix, or the 1-based column
+ *                  of the first zero pivot; may be NULL
+ *
+ *  Returns true if every matrix is nonsingular
+*/
+bool luFactorBatched(Matrix *matrix, int stride, int batch_count, int *pivots, int *info){
+    if(!checkBatch(matrix, stride, batch_count)){
+        return false;
+    }
+    int n = matrix->rows;
+    LUKernel kernel = n == 4 ? luKernel4 : n == 6 ? luKernel6 : n == 8 ? luKernel8 :
+                      n == 12 ? luKernel12 : n == 16 ? luKernel16 : n == 32 ? luKernel32 :
+                      luKernelGeneral;
+    int singular = 0;
+    int batch;
+    for(batch = 0; batch < batch_count; batch++){
+        int status = kernel(matrix->data + (size_t)batch * stride, n, pivots + (size_t)batch * n);
+        if(info != NULL){
+            info[batch] = status;
+        }
+        singular += status != 0;
+    }
+    if(singular > 0){
+        printf("%d singular matrices in batched LU\n", singular);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) luSolveBatched
+ * --------------------
+ * Solves A_i X_i = B_i for every system of a batch factored by
+ * luFactorBatched, overwriting each B_i with X_i
+ *
+ *  lu (pointer): shape and first element of the factored batch
+ *  stride_lu (int): number of doubles between consecutive factors
+ *  pivots (pointer): the pivots from luFactorBatched
+ *  rhs (pointer): shape (n x k) and first element of the right-hand sides
+ *  stride_rhs (int): number of doubles between consecutive right-hand sides
+ *  batch_count (int): number of systems
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool luSolveBatched(const Matrix *lu, int stride_lu, const int *pivots, Matrix *rhs, int stride_rhs, int batch_count){
+    int n = lu->rows;
+    if(!checkBatch(lu, stride_lu, batch_count) || rhs->rows != n){
+        printf("Mismatch in the dimensions of the batched solve\n");
+        return false;
+    }
+    LUSolveKernel kernel = n == 4 ? luSolveKernel4 : n == 6 ? luSolveKernel6 : n == 8 ? luSolveKernel8 :
+                           n == 12 ? luSolveKernel12 : n == 16 ? luSolveKernel16 :
+                           n == 32 ? luSolveKernel32 : luSolveKernelGeneral;
+    int batch;
+    for(batch = 0; batch < batch_count; batch++){
+        kernel(lu->data + (size_t)batch * stride_lu, pivots + (size_t)batch * n,
+               rhs->data + (size_t)batch * stride_rhs, n, rhs->cols);
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) choleskyFactorBatched
+ * --------------------
+ * Computes the Cholesky factor L of batch_count symmetric positive definite
+ * matrices in place, laid out as in luFactorBatched
+ *
+ *  matrix (pointer): shape and first element of the batch
+ *  stride (int): number of doubles between consecutive matrices
+ *  batch_count (int): number of matrices
+ *  info (pointer): receives 0 per positive definite matrix, or the 1-based
+ *                  column where the factorization broke down; may be NULL
+ *
+ *  Returns true if every matrix is positive definite
+*/
+bool choleskyFactorBatched(Matrix *matrix, int stride, int batch_count, int *info){
+    if(!checkBatch(matrix, stride, batch_count)){
+        return false;
+    }
+    int n = matrix->rows;
+    CholeskyKernel kernel = n == 4 ? choleskyKernel4 : n == 6 ? choleskyKernel6 : n == 8 ? choleskyKernel8 :
+                            n == 12 ? choleskyKernel12 : n == 16 ? choleskyKernel16 :
+                            n == 32 ? choleskyKernel32 : choleskyKernelGeneral;
+    int failed = 0;
+    int batch;
+    for(batch = 0; batch < batch_count; batch++){
+        int status = kernel(matrix->data + (size_t)batch * stride, n);
+        if(info != NULL){
+            info[batch] = status;
+        }
+        failed += status != 0;
+    }
+    if(failed > 0){
+        printf("%d matrices not positive definite in batched Cholesky\n", failed);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Function: (bool) choleskySolveBatched
+ * --------------------
+ * Solves A_i X_i = B_i for every system of a batch factored by
+ * choleskyFactorBatched, overwriting each B_i with X_i
+ *
+ *  factor (pointer): shape and first element of the factored batch
+ *  stride_factor (int): number of doubles between consecutive factors
+ *  rhs (pointer): shape (n x k) and first element of the right-hand sides
+ *  stride_rhs (int): number of doubles between consecutive right-hand sides
+ *  batch_count (int): number of systems
+ *
+ *  Returns true if successful, false if the dimensions do not match
+*/
+bool choleskySolveBatched(const Matrix *factor, int stride_factor, Matrix *rhs, int stride_rhs, int batch_count){
+    int n = factor->rows;
+    if(!checkBatch(factor, stride_factor, batch_count) || rhs->rows != n){
+        printf("Mismatch in the dimensions of the batched solve\n");
+        return false;
+    }
+    CholeskySolveKernel kernel = n == 4 ? choleskySolveKernel4 : n == 6 ? choleskySolveKernel6 :
+                                 n == 8 ? choleskySolveKernel8 : n == 12 ? choleskySolveKernel12 :
+                                 n == 16 ? choleskySolveKernel16 : n == 32 ? choleskySolveKernel32 :
+                                 choleskySolveKernelGeneral;
+    int batch;
+    for(batch = 0; batch < batch_count; batch++){
+        kernel(factor->data + (size_t)batch * stride_factor, rhs->data + (size_t)batch * stride_rhs, n, rhs->cols);
+    }
+    return true;
+}
+
+/*
+ * Function: (void) interleaveBatch
+ * --------------------
+ * Converts a strided batch to the interleaved layout, where element (i, j)
+ * of matrix b is stored at interleaved[(i * cols + j) * batch_count + b]:
+ * the same element of every matrix sits side by side
+ *
+ *  matrix (pointer): shape and first element of the batch
+ *  stride (int): number of doubles between consecutive matrices
+ *  batch_count (int): number of matrices
+ *  interleaved (pointer): receives rows * cols * batch_count doubles
+*/
+void interleaveBatch(const Matrix *matrix, int stride, int batch_count, double *interleaved){
+    int size = matrix->rows * matrix->cols;
+    int batch;
+    int e;
+    for(batch = 0; batch < batch_count; batch++){
+        const double *in = matrix->data + (size_t)batch * stride;
+        for(e = 0; e < size; e++){
+            interleaved[(size_t)e * batch_count + batch] = in[e];
+        }
+    }
+}
+
+/*
+ * Function: (void) deinterleaveBatch
+ * --------------------
+ * Converts the interleaved layout back to a strided batch
+ *
+ *  interleaved (pointer): rows * cols * batch_count doubles
+ *  batch_count (int): number of matrices
+ *  matrix (pointer): shape and first element of the batch, data must be
+ *                    preallocated
+ *  stride (int): number of doubles between consecutive matrices
+*/
+void deinterleaveBatch(const double *interleaved, int batch_count, Matrix *matrix, int stride){
+    int size = matrix->rows * matrix->cols;
+    int batch;
+    int e;
+    for(batch = 0; batch < batch_count; batch++){
+        double *out = matrix->data + (size_t)batch * stride;
+        for(e = 0; e < size; e++){
+            out[e] = interleaved[(size_t)e * batch_count + batch];
+        }
+    }
+}
+
+/*
+ * Function: (void) choleskyFactorInterleaved
+ * --------------------
+ * Computes the Cholesky factors of a batch of n x n matrices stored in the
+ * interleaved layout, in place. Every loop of the factorization has the
+ * batch as its innermost loop, so one instruction processes as many
+ * systems as the vector registers hold. Cholesky needs no pivoting, so the
+ * systems never take different paths: a failing pivot is recorded in info
+ * and replaced by 1 with a select instead of a branch
+ *
+ *  data (pointer): the interleaved batch, overwritten with the factors
+ *  n (int): dimension of the matrices
+ *  batch_count (int): number of matrices
+ *  info (pointer): receives 0 per positive definite matrix, or the 1-based
+ *                  column of the first failing pivot
+*/
+void choleskyFactorInterleaved(double *data, int n, int batch_count, int *info){
+    size_t lanes = (size_t)batch_count;
+    int i;
+    int j;
+    int k;
+    int b;
+    for(b = 0; b < batch_count; b++){
+        info[b] = 0;
+    }
+    for(i = 0; i < n; i++){
+        for(j = 0; j <= i; j++){
+            double *out = data + (size_t)(i * n + j) * lanes;
+            for(k = 0; k < j; k++){
+                const double *left = data + (size_t)(i * n + k) * lanes;
+                const double *right = data + (size_t)(j * n + k) * lanes;
+                for(b = 0; b < batch_count; b++){
+                    out[b] -= left[b] * right[b];
+                }
+            }
+            if(j < i){
+                const double *diagonal = data + (size_t)(j * n + j) * lanes;
+                for(b = 0; b < batch_count; b++){
+                    out[b] /= diagonal[b];
+                }
+            } else {
+                for(b = 0; b < batch_count; b++){
+                    bool bad = !(out[b] > 0);
+                    info[b] = bad && info[b] == 0 ? i + 1 : info[b];
+                    out[b] = sqrt(bad ? 1.0 : out[b]);
+                }
+            }
+        }
+        for(j = i + 1; j < n; j++){
+            memset(data + (size_t)(i * n + j) * lanes, 0, sizeof(double) * lanes);
+        }
+    }
+}
+
+/*
+ * Function: (void) choleskySolveInterleaved
+ * --------------------
+ * Solves A_b x_b = r_b for every system of an interleaved batch factored
+ * by choleskyFactorInterleaved, with the batch as the innermost loop
+ *
+ *  factor (pointer): the interleaved factors
+ *  n (int): dimension of the matrices
+ *  batch_count (int): number of systems
+ *  rhs (pointer): interleaved right-hand sides, element i of system b at
+ *                 rhs[i * batch_count + b], overwritten with the solutions
+*/
+void choleskySolveInterleaved(const double *factor, int n, int batch_count, double *rhs){
+    size_t lanes = (size_t)batch_count;
+    int i;
+    int j;
+    int b;
+    for(i = 0; i < n; i++){
+        double *x_i = rhs + (size_t)i * lanes;
+        for(j = 0; j < i; j++){
+            const double *l = factor + (size_t)(i * n + j) * lanes;
+            const double *x_j = rhs + (size_t)j * lanes;
+            for(b = 0; b < batch_count; b++){
+                x_i[b] -= l[b] * x_j[b];
+            }
+        }
+        const double *diagonal = factor + (size_t)(i * n + i) * lanes;
+        for(b = 0; b < batch_count; b++){
+            x_i[b] /= diagonal[b];
+        }
+    }
+    for(i = n - 1; i >= 0; i--){
+        double *x_i = rhs + (size_t)i * lanes;
+        const double *diagonal = factor + (size_t)(i * n + i) * lanes;
+        for(b = 0; b < batch_count; b++){
+            x_i[b] /= diagonal[b];
+        }
+        for(j = 0; j < i; j++){
+            const double *l = factor + (size_t)(i * n + j) * lanes;
+            double *x_j = rhs + (size_t)j * lanes;
+            for(b = 0; b < batch_count; b++){
+                x_j[b] -= l[b] * x_i[b];
+            }
+        }
+    }
+}
+
+/*
+ * Function: (double) determinant2x2
+ * --------------------
+ * Computes the determinant of a 2 x 2 matrix stored row by row
+ *
+ *  m (pointer): the 4 entries
+ *
+ *  Returns the determinant
+*/
+double determinant2x2(const double *m){
+    return m[0] * m[3] - m[1] * m[2];
+}
+
+/*
+ * Function: (double) determinant3x3
+ * --------------------
+ * Computes the determinant of a 3 x 3 matrix stored row by row, by
+ * cofactor expansion along the first row
+ *
+ *  m (pointer): the 9 entries
+ *
+ *  Returns the determinant
+*/
+double determinant3x3(const double *m){
+    return m[0] * (m[4] * m[8] - m[5] * m[7])
+         - m[1] * (m[3] * m[8] - m[5] * m[6])
+         + m[2] * (m[3] * m[7] - m[4] * m[6]);
+}
+
+/*
+ * Function: (double) determinant4x4
+ * --------------------
+ * Computes the determinant of a 4 x 4 matrix stored row by row, by
+ * Laplace expansion of the 2 x 2 minors of the top two rows against the
+ * complementary minors of the bottom two
+ *
+ *  m (pointer): the 16 entries
+ *
+ *  Returns the determinant
+*/
+double determinant4x4(const double *m){
+    double s0 = m[0] * m[5] - m[4] * m[1];
+    double s1 = m[0] * m[6] - m[4] * m[2];
+    double s2 = m[0] * m[7] - m[4] * m[3];
+    double s3 = m[1] * m[6] - m[5] * m[2];
+    double s4 = m[1] * m[7] - m[5] * m[3];
+    double s5 = m[2] * m[7] - m[6] * m[3];
+    double c5 = m[10] * m[15] - m[14] * m[11];
+    double c4 = m[9] * m[15] - m[13] * m[11];
+    double c3 = m[9] * m[14] - m[13] * m[10];
+    double c2 = m[8] * m[15] - m[12] * m[11];
+    double c1 = m[8] * m[14] - m[12] * m[10];
+    double c0 = m[8] * m[13] - m[12] * m[9];
+    return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+}
+
+/*
+ * Function: (double) largestMagnitude
+ * --------------------
+ * Returns the largest absolute value among count entries, with fmax so
+ * that no comparison branches are taken
+*/
+double largestMagnitude(const double *m, int count){
+    double largest = 0.0;
+    int i;
+    for(i = 0; i < count; i++){
+        largest = fmax(largest, fabs(m[i]));
+    }
+    return largest;
+}
+
+/*
+ * Function: (bool) invert2x2
+ * --------------------
+ * Inverts a 2 x 2 matrix with the closed form adj(A) / det(A)
+ * The matrix counts as near singular when |det| <= SMALL_INVERSE_TOLERANCE
+ * times the largest entry to the power 2; the inverse is then all zeros
+ * Branch free and silent, for use in tight loops. inverse may be m
+ *
+ *  m (pointer): the 4 entries, row by row
+ *  inverse (pointer): receives the 4 entries of the inverse
+ *  determinant (pointer): receives the determinant, may be NULL
+ *
+ *  Returns true if the matrix is not near singular
+*/
+static inline bool invert2x2(const double *m, double *inverse, double *determinant){
+    double a = m[0];
+    double b = m[1];
+    double c = m[2];
+    double d = m[3];
+    double det = a * d - b * c;
+    double scale = largestMagnitude(m, 4);
+    bool regular = fabs(det) > SMALL_INVERSE_TOLERANCE * scale * scale;
+    double factor = regular ? 1.0 / det : 0.0;
+    inverse[0] = d * factor;
+    inverse[1] = -b * factor;
+    inverse[2] = -c * factor;
+    inverse[3] = a * factor;
+    if(determinant != NULL){
+        *determinant = det;
+    }
+    return regular;
+}
+
+/*
+ * Function: (bool) invert3x3
+ * --------------------
+ * Inverts a 3 x 3 matrix with the closed form adj(A) / det(A), reusing the
+ * first column of cofactors for the determinant. Near singularity is
+ * judged as in invert2x2, with the largest entry to the power 3
+ *
+ *  m (pointer): the 9 entries, row by row
+ *  inverse (pointer): receives the 9 entries of the inverse, may be m
+ *  determinant (pointer): receives the determinant, may be NULL
+ *
+ *  Returns true if the matrix is not near singular
+*/
+static inline bool invert3x3(const double *m, double *inverse, double *determinant){
+    double c00 = m[4] * m[8] - m[5] * m[7];
+    double c01 = m[5] * m[6] - m[3] * m[8];
+    double c02 = m[3] * m[7] - m[4] * m[6];
+    double c10 = m[2] * m[7] - m[1] * m[8];
+    double c11 = m[0] * m[8] - m[2] * m[6];
+    double c12 = m[1] * m[6] - m[0] * m[7];
+    double c20 = m[1] * m[5] - m[2] * m[4];
+    double c21 = m[2] * m[3] - m[0] * m[5];
+    double c22 = m[0] * m[4] - m[1] * m[3];
+    double det = m[0] * c00 + m[1] * c01 + m[2] * c02;
+    double scale = largestMagnitude(m, 9);
+    bool regular = fabs(det) > SMALL_INVERSE_TOLERANCE * scale * scale * scale;
+    double factor = regular ? 1.0 / det : 0.0;
+    /* The inverse is the transposed cofactor matrix over the determinant */
+    inverse[0] = c00 * factor;
+    inverse[1] = c10 * factor;
+    inverse[2] = c20 * factor;
+    inverse[3] = c01 * factor;
+    inverse[4] = c11 * factor;
+    inverse[5] = c21 * factor;
+    inverse[6] = c02 * factor;
+    inverse[7] = c12 * factor;
+    inverse[8] = c22 * factor;
+    if(determinant != NULL){
+        *determinant = det;
+    }
+    return regular;
+}
+
+/*
+ * Function: (bool) invert4x4
+ * --------------------
+ * Inverts a 4 x 4 matrix in closed form from the twelve 2 x 2 minors of
+ * determinant4x4: each cofactor is a combination of three of them, so the
+ * whole inverse costs about 200 flops and no divisions but one. Near
+ * singularity is judged as in invert2x2, with the largest entry to the
+ * power 4
+ *
+ *  m (pointer): the 16 entries, row by row
+ *  inverse (pointer): receives the 16 entries of the inverse, may be m
+ *  determinant (pointer): receives the determinant, may be NULL
+ *
+ *  Returns true if the matrix is not near singular
+*/
+static inline bool invert4x4(const double *m, double *inverse, double *determinant){
+    double a[16];
+    memcpy(a, m, sizeof(a));
+    double s0 = a[0] * a[5] - a[4] * a[1];
+    double s1 = a[0] * a[6] - a[4] * a[2];
+    double s2 = a[0] * a[7] - a[4] * a[3];
+    double s3 = a[1] * a[6] - a[5] * a[2];
+    double s4 = a[1] * a[7] - a[5] * a[3];
+    double s5 = a[2] * a[7] - a[6] * a[3];
+    double c5 = a[10] * a[15] - a[14] * a[11];
+    double c4 = a[9] * a[15] - a[13] * a[11];
+    double c3 = a[9] * a[14] - a[13] * a[10];
+    double c2 = a[8] * a[15] - a[12] * a[11];
+    double c1 = a[8] * a[14] - a[12] * a[10];
+    double c0 = a[8] * a[13] - a[12] * a[9];
+    double det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+    double scale = largestMagnitude(a, 16);
+    double scale_squared = scale * scale;
+    bool regular = fabs(det) > SMALL_INVERSE_TOLERANCE * scale_squared * scale_squared;
+    double factor = regular ? 1.0 / det : 0.0;
+    inverse[0] = (a[5] * c5 - a[6] * c4 + a[7] * c3) * factor;
+    inverse[1] = (-a[1] * c5 + a[2] * c4 - a[3] * c3) * factor;
+    inverse[2] = (a[13] * s5 - a[14] * s4 + a[15] * s3) * factor;
+    inverse[3] = (-a[9] * s5 + a[10] * s4 - a[11] * s3) * factor;
+    inverse[4] = (-a[4] * c5 + a[6] * c2 - a[7] * c1) * factor;
+    inverse[5] = (a[0] * c5 - a[2] * c2 + a[3] * c1) * factor;
+    inverse[6] = (-a[12] * s5 + a[14] * s2 - a[15] * s1) * factor;
+    inverse[7] = (a[8] * s5 - a[10] * s2 + a[11] * s1) * factor;
+    inverse[8] = (a[4] * c4 - a[5] * c2 + a[7] * c0) * factor;
+    inverse[9] = (-a[0] * c4 + a[1] * c2 - a[3] * c0) * factor;
+    inverse[10] = (a[12] * s4 - a[13] * s2 + a[15] * s0) * factor;
+    inverse[11] = (-a[8] * s4 + a[9] * s2 - a[11] * s0) * factor;
+    inverse[12] = (-a[4] * c3 + a[5] * c1 - a[6] * c0) * factor;
+    inverse[13] = (a[0] * c3 - a[1] * c1 + a[2] * c0) * factor;
+    inverse[14] = (-a[12] * s3 + a[13] * s1 - a[14] * s0) * factor;
+    inverse[15] = (a[8] * s3 - a[9] * s1 + a[10] * s0) * factor;
+    if(determinant != NULL){
+        *determinant = det;
+    }
+    return regular;
+}
+
+/*
+ * Function: (bool) invertSmallBatched
+ * --------------------
+ * Inverts batch_count 2 x 2, 3 x 3 or 4 x 4 matrices laid out as in
+ * multiplyMatricesStridedBatched with the closed forms above. The size is
+ * switched on once per batch, each size has its own loop calling its
+ * inlined kernel, and the loops take no data dependent branches; near
+ * singular matrices are only reported in the flags
+ *
+ *  matrix (pointer): shape and first element of the batch
+ *  stride (int): number of doubles between consecutive matrices
+ *  result (pointer): first inverse, data must be preallocated, may be matrix
+ *  stride_result (int): number of doubles between consecutive inverses
+ *  batch_count (int): number of matrices
+ *  determinants (pointer): receives one determinant per matrix, may be NULL
+ *  near_singular (pointer): receives one flag per matrix, may be NULL
+ *
+ *  Returns true if successful, false if the size is not 2, 3 or 4
+*/
+bool invertSmallBatched(const Matrix *matrix, int stride, Matrix *result, int stride_result, int batch_count,
+                        double *determinants, bool *near_singular){
+    int n = matrix->rows;
+    if(!isSquare(matrix) || n < 2 || n > 4){
+        printf("Closed form inverses need 2x2, 3x3 or 4x4 matrices\n");
+        return false;
+    }
+    const double *source = matrix->data;
+    double *target = result->data;
+    double determinant;
+    bool regular;
+    int batch;
+    result->rows = n;
+    result->cols = n;
+    /* One loop per size so each kernel is inlined into its loop */
+    switch(n){
+        case 2:
+            for(batch = 0; batch < batch_count; batch++){
+                regular = invert2x2(source + (size_t)batch * stride, target + (size_t)batch * stride_result, &determinant);
+                if(determinants != NULL){
+                    determinants[batch] = determinant;
+                }
+                if(near_singular != NULL){
+                    near_singular[batch] = !regular;
+                }
+            }
+            break;
+        case 3:
+            for(batch = 0; batch < batch_count; batch++){
+                regular = invert3x3(source + (size_t)batch * stride, target + (size_t)batch * stride_result, &determinant);
+                if(determinants != NULL){
+                    determinants[batch] = determinant;
+                }
+                if(near_singular != NULL){
+                    near_singular[batch] = !regular;
+                }
+            }
+            break;
+        default:
+            for(batch = 0; batch < batch_count; batch++){
+                regular = invert4x4(source + (size_t)batch * stride, target + (size_t)batch * stride_result, &determinant);
+                if(determinants != NULL){
+                    determinants[batch] = determinant;
+                }
+                if(near_singular != NULL){
+                    near_singular[batch] = !regular;
+                }
+            }
+            break;
+    }
+    return true;
+}
+
+/*
+ * Struct: AccumulatorTask
+ * --------------------
+ * Work of one thread in the concurrent accumulator demo: add a block at a
+ * position of the target repeat times, flushing after every addition
+ *
+ *  accumulator (pointer): the shared accumulator
+ *  thread_id (int): the thread's slot
+ *  block (pointer): the block to add
+ *  row, col (int): where the block goes
+ *  repeat (int): number of additions
+*/
+typedef struct{
+    ConcurrentAccumulator *accumulator;
+    int thread_id;
+    const Matrix *block;
+    int row;
+    int col;
+    int repeat;
+} AccumulatorTask;
+
+/*
+ * Function: (void *) runAccumulatorTask
+ * --------------------
+ * pthread entry point running an AccumulatorTask
+ *
+ *  argument (pointer): the AccumulatorTask
+ *
+ *  Returns NULL
+*/
+void *runAccumulatorTask(void *argument){
+    AccumulatorTask *task = (AccumulatorTask *)argument;
+    int i;
+    for(i = 0; i < task->repeat; i++){
+        accumulatorAddBlock(task->accumulator, task->thread_id, task->block, task->row, task->col);
+        accumulatorFlush(task->accumulator, task->thread_id);
+    }
+    return NULL;
+}
+
+/*
+ * Function: (void) printMatrix
+ * --------------------
+ *  Prints a matrix in a 2D fashion
+ *  Useful for debugging
+ *
+ *  matrix (pointer): a pointer to a Matrix struct
+*/
+void printMatrix(const Matrix *matrix){
+    int r;
+    int c;
+    for(r = 0; r < matrix->rows;r++){
+        for(c=0;c < matrix->cols;c++){
+            /*Print corresponding element*/
+            printf("%f ", *(matrix->data + r * matrix->cols + c));
+        }
+        /*Skip a line*/
+        printf("\n");
+    }
+}
+
+/*
+ * Function: (int) main
+ * --------------------
+ *  Executes the routine of summing two matrices
+ *  Placeholder values for now
+ *
+ *  No arguments
+*/
+int main(){
+    /* Define data for example */
+    double matrixAData[2][3] = {{1.1,2.2,3.3},{4.3,5.2,6.1}};
+    double matrixBData[2][3] = {{0.4,3.7,8.9},{4.5,2.7,6.9}};
+    double matrixCData[3][2] = {{1.3,4.3},{5.2,0.0},{6.7,8.8}};
+    /* Initialize result matrix */
+    double resultData[2][3];
+    double resultMultData[2][2];
+    /* Generate matrix structs */
+    Matrix matrixA = {2,3, (double *)matrixAData};
+    Matrix matrixB = {2,3, (double *)matrixBData};
+    Matrix matrixC = {3,2, (double *)matrixCData};
+    Matrix resultSum = {2,3, (double *)resultData};
+    Matrix resultMinus = {2,3, (double *)resultData};
+    Matrix resultMult = {2,2, (double *)resultMultData};
+    /* Perform sum */
+    if (sumMatrices(&matrixA, &matrixB, false, &resultSum)) {
+        printf("Sum of matrices:\n");
+        printMatrix(&resultSum);
+    }
+    if (sumMatrices(&matrixA, &matrixB, true, &resultMinus)) {
+        printf("Subtraction of matrices:\n");
+        printMatrix(&resultMinus);
+    }
+    /* Perform multiplication */
+    if (multiplyMatrices(&matrixA, &matrixC, &resultMult)) {
+        printf("Multiplication of matrices:\n");
+        printMatrix(&resultMinus);
+    }
+    /* Test cases for transposing */
+    // Define a result matrix for the transpose
+    double vectorData[1][3] = {1.1,2.2,3.3};
+    Matrix vector = {1,3,(double *)vectorData};
+    Matrix resultTrans;
+    Matrix vectorTrans;
+
+    // Transpose the matrix
+    if (transposeMatrix(&matrixA, &resultTrans)) {
+        printf("Original matrix:\n");
+        printMatrix(&matrixA);
+        printf("Transposed matrix:\n");
+        printMatrix(&resultTrans);
+        
+        // Free memory if the transpose was out-of-place (rectangular)
+        if (matrixA.data != resultTrans.data) {
+            free(resultTrans.data);
+        }
+    }
+    
+    // Transpose the vector
+    if (transposeMatrix(&vector, &vectorTrans)) {
+        printf("Original vectpr:\n");
+        printMatrix(&vector);
+        printf("Transposed vector:\n");
+        printMatrix(&vectorTrans);
+        
+        // Free memory if the transpose was out-of-place (rectangular)
+        if (vector.data != vectorTrans.data) {
+            free(vectorTrans.data);
+        }
+    }
+    /* Test cases for batched multiplication and attention */
+    // Two heads of 2x3 queries/keys/values stored back to back
+    double headQData[2][2][3] = {{{1.0,0.0,1.0},{0.5,0.5,0.0}},{{0.0,1.0,0.0},{1.0,1.0,1.0}}};
+    double headKData[2][2][3] = {{{1.0,0.0,0.0},{0.0,1.0,1.0}},{{0.3,0.2,0.1},{0.0,0.0,1.0}}};
+    double headVData[2][2][3] = {{{1.0,2.0,3.0},{4.0,5.0,6.0}},{{0.0,1.0,0.0},{1.0,0.0,1.0}}};
+    double headOutData[2][2][3];
+    double batchedProductData[2][2][2];
+    Matrix headQ = {2,3,(double *)headQData};
+    Matrix headK = {2,3,(double *)headKData};
+    Matrix headV = {2,3,(double *)headVData};
+    Matrix headOut = {2,3,(double *)headOutData};
+    Matrix batchedProduct = {2,2,(double *)batchedProductData};
+    Matrix headKT = {3,2,(double *)headKData};
+    // Q K for each head (reading K as 3x2 just to exercise the batch)
+    if (multiplyMatricesStridedBatched(&headQ, 6, &headKT, 6, &batchedProduct, 4, 2)) {
+        printf("Second batched product:\n");
+        Matrix second = {2,2,(double *)batchedProductData[1]};
+        printMatrix(&second);
+    }
+    if (attentionHeadsStridedBatched(&headQ, 6, &headK, 6, &headV, 6, 1.0 / sqrt(3.0),
+                                     &headOut, 6, 2)) {
+        printf("Attention output of the first head:\n");
+        printMatrix(&headOut);
+    }
+    /* Test cases for elementwise functions */
+    double activationData[2][3] = {{-2.0,0.0,0.5},{1.0,3.0,10.0}};
+    double activatedData[2][3];
+    Matrix activationInput = {2,3,(double *)activationData};
+    Matrix activated = {2,3,(double *)activatedData};
+    if (applyElementwise(&activationInput, ELEMENTWISE_SIGMOID, 1, &activated)) {
+        printf("Sigmoid of matrix:\n");
+        printMatrix(&activated);
+    }
+    if (multiplyMatricesActivation(&matrixA, &matrixC, ELEMENTWISE_TANH, &resultMult)) {
+        printf("Tanh of product:\n");
+        printMatrix(&resultMult);
+    }
+    /* Test cases for fused epilogues */
+    // ReLU(A C + bias) clamped to 40 in a single pass
+    double layerBias[2] = {-20.0, 1.0};
+    GemmEpilogue layerEpilogue = {1.0, NULL, layerBias, ELEMENTWISE_RELU, true, 0.0, 40.0, NULL, NULL};
+    if (multiplyMatricesEpilogue(&matrixA, &matrixC, &layerEpilogue, &resultMult)) {
+        printf("Fused layer output:\n");
+        printMatrix(&resultMult);
+    }
+    /* Test cases for Hadamard and Kronecker products */
+    double smallAData[2][2] = {{1.0,2.0},{3.0,4.0}};
+    double smallBData[2][2] = {{0.0,1.0},{1.0,0.0}};
+    double kronData[4][4];
+    double kronVecData[4] = {1.0,2.0,3.0,4.0};
+    double kronOutData[4];
+    double kronCheckData[4];
+    Matrix smallA = {2,2,(double *)smallAData};
+    Matrix smallB = {2,2,(double *)smallBData};
+    Matrix kron = {4,4,(double *)kronData};
+    Matrix kronVec = {4,1,kronVecData};
+    Matrix kronOut = {4,1,kronOutData};
+    Matrix kronCheck = {4,1,kronCheckData};
+    if (hadamardProduct(&matrixA, &matrixB, &resultSum)) {
+        printf("Hadamard product:\n");
+        printMatrix(&resultSum);
+    }
+    if (kroneckerProduct(&smallA, &smallB, &kron)) {
+        printf("Kronecker product:\n");
+        printMatrix(&kron);
+        // The implicit product must agree with the explicit one
+        if (multiplyMatricesEpilogue(&kron, &kronVec, NULL, &kronCheck) &&
+            kroneckerMatVec(&smallA, &smallB, &kronVec, &kronOut)) {
+            printf("Explicit and implicit Kronecker matrix-vector products:\n");
+            printMatrix(&kronCheck);
+            printMatrix(&kronOut);
+        }
+    }
+    /* Test cases for covariance and correlation */
+    double observationData[4][2] = {{1.0,2.0},{2.0,4.1},{3.0,5.9},{4.0,8.0}};
+    double covarianceData[2][2];
+    Matrix observations = {4,2,(double *)observationData};
+    Matrix covariance = {2,2,(double *)covarianceData};
+    if (covarianceMatrix(&observations, false, 1, &covariance)) {
+        printf("Covariance matrix:\n");
+        printMatrix(&covariance);
+    }
+    if (covarianceMatrix(&observations, true, 1, &covariance)) {
+        printf("Correlation matrix:\n");
+        printMatrix(&covariance);
+    }
+    /* Test cases for sketching */
+    // Every sketch of the same seed is reproducible
+    double sketchData[2][2];
+    Matrix sketch = {2,2,(double *)sketchData};
+    if (sketchMatrix(&observations, SKETCH_SRHT, 2, 42, &sketch)) {
+        printf("SRHT sketch of the observations:\n");
+        printMatrix(&sketch);
+    }
+    if (sketchMatrix(&observations, SKETCH_COUNTSKETCH, 2, 42, &sketch)) {
+        printf("CountSketch of the observations:\n");
+        printMatrix(&sketch);
+    }
+    /* Test cases for pairwise distances */
+    double distanceData[4][4];
+    Matrix distances = {4,4,(double *)distanceData};
+    if (pairwiseDistances(&observations, &observations, DISTANCE_EUCLIDEAN, &distances)) {
+        printf("Pairwise Euclidean distances:\n");
+        printMatrix(&distances);
+    }
+    /* Test cases for nearest neighbors */
+    int neighborIndices[4][2];
+    int query;
+    double neighborDistances[4][2];
+    if (knnSearch(&observations, &observations, 2, DISTANCE_EUCLIDEAN,
+                  (int *)neighborIndices, (double *)neighborDistances)) {
+        printf("Nearest neighbor of each observation other than itself:\n");
+        for (query = 0; query < 4; query++) {
+            printf("%d %f\n", neighborIndices[query][1], neighborDistances[query][1]);
+        }
+    }
+    /* Test cases for k-means */
+    double clusterData[6][2] = {{0.0,0.1},{0.2,0.0},{0.1,0.2},{5.0,5.1},{5.2,4.9},{4.9,5.0}};
+    double centroidData[2][2];
+    int clusterAssignments[6];
+    double clusterInertia;
+    Matrix clusterPoints = {6,2,(double *)clusterData};
+    Matrix clusterCentroids = {2,2,(double *)centroidData};
+    if (kmeans(&clusterPoints, 2, 20, 1e-9, 7, 1, &clusterCentroids, clusterAssignments, &clusterInertia)) {
+        printf("K-means centroids (inertia %f):\n", clusterInertia);
+        printMatrix(&clusterCentroids);
+    }
+    /* Test cases for nonnegative matrix factorization */
+    double nmfWData[2][1];
+    double nmfHData[1][2];
+    double nmfProductData[2][2];
+    Matrix nmfW = {2,1,(double *)nmfWData};
+    Matrix nmfH = {1,2,(double *)nmfHData};
+    Matrix nmfProduct = {2,2,(double *)nmfProductData};
+    // Rank one nonnegative approximation of a 2x2 matrix
+    if (nmfFactorize(&smallA, NULL, 1, NMF_HALS, 50, 1, &nmfW, &nmfH) &&
+        multiplyMatricesEpilogue(&nmfW, &nmfH, NULL, &nmfProduct)) {
+        printf("Rank one NMF approximation:\n");
+        printMatrix(&nmfProduct);
+    }
+    /* Test cases for semiring products */
+    // Shortest paths of length at most two in a weighted graph
+    double graphData[3][3] = {{0.0,4.0,INFINITY},{INFINITY,0.0,1.0},{2.0,INFINITY,0.0}};
+    double pathData[3][3];
+    Matrix graph = {3,3,(double *)graphData};
+    Matrix paths = {3,3,(double *)pathData};
+    if (multiplySemiring(&graph, &graph, SEMIRING_MIN_PLUS, &paths)) {
+        printf("Min-plus square of the graph:\n");
+        printMatrix(&paths);
+    }
+    /* Test cases for Boolean matrices */
+    // Reachability in the graph above, ignoring the weights
+    double edgeData[3][3] = {{0.0,1.0,0.0},{0.0,0.0,1.0},{0.0,0.0,0.0}};
+    double reachData[3][3];
+    Matrix edges = {3,3,(double *)edgeData};
+    Matrix reach = {3,3,(double *)reachData};
+    BitMatrix adjacency;
+    if (bitMatrixFromThreshold(&edges, 0.5, &adjacency)) {
+        if (transitiveClosure(&adjacency) && bitMatrixToDense(&adjacency, &reach)) {
+            printf("Transitive closure of a path:\n");
+            printMatrix(&reach);
+        }
+        freeBitMatrix(&adjacency);
+    }
+    /* Test cases for modular arithmetic */
+    double modularData[3][3] = {{1.0,2.0,3.0},{4.0,5.0,6.0},{7.0,8.0,0.0}};
+    double modularSquareData[3][3];
+    ModularMatrix modular = {3,3,7,(double *)modularData};
+    ModularMatrix modularSquare = {3,3,7,(double *)modularSquareData};
+    if (multiplyModular(&modular, &modular, &modularSquare)) {
+        Matrix squareView = {3,3,modularSquare.data};
+        printf("Square modulo 7 (rank %d):\n", modularRank(&modular));
+        printMatrix(&squareView);
+    }
+    // A singular matrix has no LU factorization, only its rank is reported
+    double singularModularData[3][3] = {{0.0,1.0,1.0},{0.0,1.0,2.0},{0.0,0.0,0.0}};
+    ModularMatrix singularModular = {3,3,7,(double *)singularModularData};
+    int singularPermutation[3];
+    int singularRank;
+    if (!modularLU(&singularModular, singularPermutation, &singularRank)) {
+        printf("Modular LU refused a matrix of rank %d\n", singularRank);
+    }
+    /* Test cases for double-double arithmetic */
+    // Cancellation that loses the answer entirely in double precision
+    double cancelX[3] = {1e16, 1.0, -1e16};
+    double cancelY[3] = {1.0, 1.0, 1.0};
+    DoubleDouble exactDot = dotDoubleDouble(cancelX, cancelY, 3);
+    printf("Double-double dot product: %f (plain: %f)\n", exactDot.hi + exactDot.lo,
+           cancelX[0] + cancelX[1] + cancelX[2]);
+    /* Test cases for sparse semiring operations */
+    // One BFS step from vertex 0, skipping vertices already visited
+    SparseMatrix sparseEdges;
+    double frontier[3] = {1.0, 0.0, 0.0};
+    double nextFrontier[3];
+    bool visited[3] = {true, false, false};
+    if (sparseFromDense(&edges, &sparseEdges)) {
+        if (sparseVecMatSemiring(&sparseEdges, NULL, frontier, SEMIRING_OR_AND, visited, true,
+                                 TRAVERSAL_AUTO, nextFrontier)) {
+            printf("Next BFS frontier: %f %f %f\n", nextFrontier[0], nextFrontier[1], nextFrontier[2]);
+        }
+        freeSparseMatrix(&sparseEdges);
+    }
+    // One Bellman-Ford step from vertex 0, the zero weight self loops keep the known distances
+    SparseMatrix sparseGraph;
+    double graphDistances[3] = {0.0, INFINITY, INFINITY};
+    double nextGraphDistances[3];
+    if (sparseFromDenseWithZero(&graph, semiringZero(SEMIRING_MIN_PLUS), &sparseGraph)) {
+        if (sparseVecMatSemiring(&sparseGraph, NULL, graphDistances, SEMIRING_MIN_PLUS, NULL, false,
+                                 TRAVERSAL_PUSH, nextGraphDistances)) {
+            printf("Distances after one step: %f %f %f\n",
+                   nextGraphDistances[0], nextGraphDistances[1], nextGraphDistances[2]);
+        }
+        freeSparseMatrix(&sparseGraph);
+    }
+    /* Test cases for embedding lookups */
+    // Two bags over the rows of the observations: {0, 3} and {1, 1, 2}
+    int bagIndices[5] = {0, 3, 1, 1, 2};
+    int bagOffsets[3] = {0, 2, 5};
+    double bagData[2][2];
+    Matrix bags = {2,2,(double *)bagData};
+    if (embeddingBag(&observations, bagIndices, bagOffsets, 2, NULL, EMBEDDING_MEAN, 2, &bags)) {
+        printf("Mean embedding of each bag:\n");
+        printMatrix(&bags);
+    }
+    // Scatter the rows of the observations back over two threads, rows 1 and 2 collide
+    double scatteredData[4][2] = {{0}};
+    Matrix scattered = {4,2,(double *)scatteredData};
+    if (scatterAddRows(&observations, bagIndices + 1, 2, &scattered)) {
+        printf("Observations scattered to rows 3, 1, 1, 2:\n");
+        printMatrix(&scattered);
+    }
+    /* Test cases for the N-ary sum */
+    // Average of three matrices in one pass
+    const Matrix *sumOperands[3] = {&smallA, &smallB, &smallA};
+    double sumWeights[3] = {1.0 / 3, 1.0 / 3, 1.0 / 3};
+    double averageData[2][2];
+    Matrix average = {2,2,(double *)averageData};
+    if (sumMatricesN(sumOperands, sumWeights, 3, 1, &average)) {
+        printf("Average of three matrices:\n");
+        printMatrix(&average);
+    }
+    /* Test cases for the concurrent accumulator */
+    // Two workers each add a partial sum, then flush into the shared matrix
+    double sharedData[2][2] = {{0,0},{0,0}};
+    Matrix shared = {2,2,(double *)sharedData};
+    ConcurrentAccumulator accumulator;
+    if (accumulatorInit(&accumulator, &shared, 2)) {
+        accumulatorAdd(&accumulator, 0, &smallA);
+        accumulatorAdd(&accumulator, 1, &smallB);
+        accumulatorAdd(&accumulator, 0, &smallA);
+        accumulatorFlush(&accumulator, 0);
+        accumulatorFlush(&accumulator, 1);
+        accumulatorDestroy(&accumulator);
+        printf("Accumulated 2A + B:\n");
+        printMatrix(&shared);
+    }
+    // Four threads add overlapping 2x2 blocks of ones into a 3x3 matrix
+    double overlapData[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+    double onesData[2][2] = {{1,1},{1,1}};
+    Matrix overlap = {3,3,(double *)overlapData};
+    Matrix ones = {2,2,(double *)onesData};
+    ConcurrentAccumulator sharedAccumulator;
+    AccumulatorTask tasks[4];
+    pthread_t threads[4];
+    int task;
+    if (accumulatorInit(&sharedAccumulator, &overlap, 4)) {
+        for (task = 0; task < 4; task++) {
+            AccumulatorTask setup = {&sharedAccumulator, task, &ones, task / 2, task % 2, 1000};
+            tasks[task] = setup;
+            pthread_create(&threads[task], NULL, runAccumulatorTask, &tasks[task]);
+        }
+        for (task = 0; task < 4; task++) {
+            pthread_join(threads[task], NULL);
+        }
+        accumulatorDestroy(&sharedAccumulator);
+        // Corners get 1000, edges 2000, the center 4000
+        printf("Concurrent sums correct: %s\n",
+               overlapData[0][0] == 1000 && overlapData[0][1] == 2000 &&
+               overlapData[1][1] == 4000 && overlapData[2][2] == 1000 ? "yes" : "no");
+        printMatrix(&overlap);
+    }
+    /* Test cases for prefix sums */
+    // Running totals down each column, then the integral image of smallA
+    double scanData[4][2];
+    Matrix scanned = {4,2,(double *)scanData};
+    if (scanMatrix(&observations, SCAN_COLUMNS, false, 2, &scanned)) {
+        printf("Cumulative sums down the columns:\n");
+        printMatrix(&scanned);
+    }
+    double tableData[2][2];
+    Matrix table = {2,2,(double *)tableData};
+    if (summedAreaTable(&smallA, &table)) {
+        printf("Summed-area table:\n");
+        printMatrix(&table);
+        printf("Sum of the bottom row: %f\n", summedAreaSum(&table, 1, 0, 1, 1));
+    }
+    /* Test cases for tall and skinny QR */
+    // Q R = observations, with orthonormal columns in Q
+    double tallQData[4][2];
+    double tallRData[2][2];
+    Matrix tallQ = {4,2,(double *)tallQData};
+    Matrix tallR = {2,2,(double *)tallRData};
+    if (choleskyQR2(&observations, 1, &tallQ, &tallR)) {
+        printf("CholeskyQR2 R factor:\n");
+        printMatrix(&tallR);
+    }
+    if (tallSkinnyQR(&observations, 1, &tallQ, &tallR)) {
+        printf("TSQR R factor:\n");
+        printMatrix(&tallR);
+    }
+    // 2500 rows span three blocks of TSQR_BLOCK_ROWS, so the reduction tree is built
+    int tallRows = 2500;
+    double tallRLargeData[3][3];
+    double tallGramData[3][3];
+    Matrix tallA = {tallRows,3,(double *)malloc(sizeof(double) * 3 * tallRows)};
+    Matrix tallQLarge = {tallRows,3,(double *)malloc(sizeof(double) * 3 * tallRows)};
+    Matrix tallProduct = {tallRows,3,(double *)malloc(sizeof(double) * 3 * tallRows)};
+    Matrix tallRLarge = {3,3,(double *)tallRLargeData};
+    Matrix tallGram = {3,3,(double *)tallGramData};
+    if (tallA.data != NULL && tallQLarge.data != NULL && tallProduct.data != NULL) {
+        for (int i = 0; i < tallRows; i++) {
+            tallA.data[3 * i] = 1.0;
+            tallA.data[3 * i + 1] = (double)i / tallRows;
+            tallA.data[3 * i + 2] = sin(0.01 * i);
+        }
+        if (tallSkinnyQR(&tallA, 2, &tallQLarge, &tallRLarge) &&
+            multiplyMatricesEpilogue(&tallQLarge, &tallRLarge, NULL, &tallProduct) &&
+            multiplyMatricesTransposed(&tallQLarge, true, &tallQLarge, false, &tallGram)) {
+            double tallError = 0.0;
+            double tallOrthogonality = 0.0;
+            for (int i = 0; i < 3 * tallRows; i++) {
+                double difference = fabs(tallProduct.data[i] - tallA.data[i]);
+                tallError = difference > tallError ? difference : tallError;
+            }
+            for (int i = 0; i < 9; i++) {
+                double difference = fabs(tallGram.data[i] - (i % 4 == 0 ? 1.0 : 0.0));
+                tallOrthogonality = difference > tallOrthogonality ? difference : tallOrthogonality;
+            }
+            printf("TSQR of %d rows: largest error of Q R %e, of Q^T Q %e\n",
+                   tallRows, tallError, tallOrthogonality);
+        }
+    }
+    free(tallA.data);
+    free(tallQLarge.data);
+    free(tallProduct.data);
+    /* Test cases for rank revealing decompositions */
+    // The columns of observations are nearly dependent, the numerical rank is one
+    double pivotedRData[2][2];
+    Matrix pivotedR = {2,2,(double *)pivotedRData};
+    int pivots[2];
+    int numericalRank;
+    if (pivotedQR(&observations, 1e-2, 2, NULL, &pivotedR, pivots, &numericalRank)) {
+        printf("Numerical rank %d, first pivot column %d\n", numericalRank, pivots[0]);
+    }
+    // One column of observations expresses the other
+    int skeleton[1];
+    double interpolationData[2];
+    Matrix interpolation = {1,2,interpolationData};
+    if (interpolativeDecomposition(&observations, 1, 7, skeleton, &interpolation)) {
+        printf("Skeleton column %d, coefficients:\n", skeleton[0]);
+        printMatrix(&interpolation);
+    }
+    // Rank two matrix, C U R must rebuild it from two of its columns and rows
+    double lowRankData[4][4] = {{1,2,3,4},{2,4,6,8},{1,0,1,0},{3,2,5,4}};
+    double curCData[4][2];
+    double curUData[2][2];
+    double curRData[2][4];
+    double curCUData[4][2];
+    double curProductData[4][4];
+    Matrix lowRank = {4,4,(double *)lowRankData};
+    Matrix curC = {4,2,(double *)curCData};
+    Matrix curU = {2,2,(double *)curUData};
+    Matrix curR = {2,4,(double *)curRData};
+    Matrix curCU = {4,2,(double *)curCUData};
+    Matrix curProduct = {4,4,(double *)curProductData};
+    int curColumns[2];
+    int curRows[2];
+    if (curDecomposition(&lowRank, 2, 7, curColumns, curRows, &curC, &curU, &curR) &&
+        multiplyMatricesEpilogue(&curC, &curU, NULL, &curCU) &&
+        multiplyMatricesEpilogue(&curCU, &curR, NULL, &curProduct)) {
+        double curError = 0.0;
+        for (int i = 0; i < 16; i++) {
+            double difference = fabs(curProduct.data[i] - lowRank.data[i]);
+            curError = difference > curError ? difference : curError;
+        }
+        printf("CUR columns %d %d, rows %d %d, largest error %e\n",
+               curColumns[0], curColumns[1], curRows[0], curRows[1], curError);
+    }
+    /* Test cases for Sylvester and Lyapunov equations */
+    // X solves smallA X + X smallA^T = matrix with ones everywhere
+    double lyapunovQData[2][2] = {{1,1},{1,1}};
+    double lyapunovXData[2][2];
+    Matrix lyapunovQ = {2,2,(double *)lyapunovQData};
+    Matrix lyapunovX = {2,2,(double *)lyapunovXData};
+    if (solveLyapunov(&smallA, &lyapunovQ, &lyapunovX)) {
+        printf("Lyapunov solution:\n");
+        printMatrix(&lyapunovX);
+    }
+    // 8x8 Sylvester equation, both matrices have complex eigenvalue pairs so the Schur forms
+    // have 2x2 blocks and the recursive solver splits several times
+    double sylvesterAData[8][8];
+    double sylvesterBData[8][8];
+    double sylvesterCData[8][8];
+    double sylvesterXData[8][8];
+    double sylvesterRData[8][8];
+    Matrix sylvesterA = {8,8,(double *)sylvesterAData};
+    Matrix sylvesterB = {8,8,(double *)sylvesterBData};
+    Matrix sylvesterC = {8,8,(double *)sylvesterCData};
+    Matrix sylvesterX = {8,8,(double *)sylvesterXData};
+    Matrix sylvesterR = {8,8,(double *)sylvesterRData};
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 8; j++) {
+            sylvesterAData[i][j] = i == j ? -1.0 - 0.25 * i : 0.1 / (1 + i + j);
+            sylvesterBData[i][j] = i == j ? -0.5 - 0.1 * j : 0.2 / (1 + (i + 2 * j) % 5);
+            sylvesterCData[i][j] = 1.0 + (i + j) % 3;
+        }
+        sylvesterAData[i][i ^ 1] += (i % 2 == 0 ? 2.0 : -2.0);
+        sylvesterBData[i][i ^ 1] += (i % 2 == 0 ? 1.5 : -1.5);
+    }
+    if (solveSylvester(&sylvesterA, &sylvesterB, &sylvesterC, &sylvesterX) &&
+        multiplyMatricesEpilogue(&sylvesterA, &sylvesterX, NULL, &sylvesterR)) {
+        double sylvesterResidual = 0.0;
+        for (int i = 0; i < 8; i++) {
+            for (int j = 0; j < 8; j++) {
+                double entry = sylvesterRData[i][j] - sylvesterCData[i][j];
+                for (int k = 0; k < 8; k++) {
+                    entry += sylvesterXData[i][k] * sylvesterBData[k][j];
+                }
+                sylvesterResidual += entry * entry;
+            }
+        }
+        printf("8x8 Sylvester residual: %e\n", sqrt(sylvesterResidual));
+    }
+    // Low rank ADI on the 1D Laplacian, stable and sparse, with one right-hand side of ones
+    int adiSize = 64;
+    int adiSteps = 80;
+    double adiShifts[8];
+    Matrix laplacian = {adiSize,adiSize,(double *)calloc((size_t)adiSize * adiSize, sizeof(double))};
+    Matrix adiB = {adiSize,1,(double *)malloc(sizeof(double) * adiSize)};
+    Matrix adiZ = {adiSize,adiSteps,(double *)malloc(sizeof(double) * adiSize * adiSteps)};
+    SparseMatrix sparseLaplacian;
+    for (int i = 0; i < 8; i++) {
+        adiShifts[i] = -4.0 * pow(1e-3, i / 7.0);
+    }
+    if (laplacian.data != NULL && adiB.data != NULL && adiZ.data != NULL) {
+        for (int i = 0; i < adiSize; i++) {
+            laplacian.data[(size_t)i * adiSize + i] = -2.0;
+            if (i > 0) {
+                laplacian.data[(size_t)i * adiSize + i - 1] = 1.0;
+                laplacian.data[(size_t)(i - 1) * adiSize + i] = 1.0;
+            }
+            adiB.data[i] = 1.0;
+        }
+        if (sparseFromDense(&laplacian, &sparseLaplacian)) {
+            if (lowRankADI(&sparseLaplacian, &adiB, adiShifts, 8, adiSteps, 1e-8, &adiZ)) {
+                // Residual of A Z Z^T + Z Z^T A^T + B B^T relative to ||B B^T|| = n, A symmetric
+                Matrix adiAZ = {adiSize,adiZ.cols,(double *)malloc(sizeof(double) * adiSize * adiZ.cols)};
+                double adiResidual = 0.0;
+                if (adiAZ.data != NULL && multiplyMatricesEpilogue(&laplacian, &adiZ, NULL, &adiAZ)) {
+                    for (int i = 0; i < adiSize; i++) {
+                        for (int j = 0; j < adiSize; j++) {
+                            double entry = adiB.data[i] * adiB.data[j];
+                            for (int k = 0; k < adiZ.cols; k++) {
+                                entry += adiAZ.data[(size_t)i * adiZ.cols + k] * adiZ.data[(size_t)j * adiZ.cols + k] +
+                                         adiZ.data[(size_t)i * adiZ.cols + k] * adiAZ.data[(size_t)j * adiZ.cols + k];
+                            }
+                            adiResidual += entry * entry;
+                        }
+                    }
+                    printf("Low rank ADI: rank %d, relative Lyapunov residual %e\n", adiZ.cols, sqrt(adiResidual) / adiSize);
+                }
+                free(adiAZ.data);
+            }
+            freeSparseMatrix(&sparseLaplacian);
+        }
+    }
+    free(laplacian.data);
+    free(adiB.data);
+    free(adiZ.data);
+    /* Test cases for the generalized symmetric eigenproblem */
+    // A x = lambda B x with a diagonal B, the eigenvalues are 1/2 and 3
+    double pencilAData[2][2] = {{1,0},{0,3}};
+    double pencilBData[2][2] = {{2,0},{0,1}};
+    double pencilVectorsData[2][2];
+    double pencilValues[2];
+    Matrix pencilA = {2,2,(double *)pencilAData};
+    Matrix pencilB = {2,2,(double *)pencilBData};
+    Matrix pencilVectors = {2,2,(double *)pencilVectorsData};
+    if (generalizedSymmetricEigen(&pencilA, &pencilB, pencilValues, &pencilVectors)) {
+        printf("Generalized eigenvalues: %f %f\n", pencilValues[0], pencilValues[1]);
+    }
+    // 40x40 pencil with a dense B = M M^T + 40 I, large enough for two reduction blocks
+    double denseAData[40][40];
+    double denseBData[40][40];
+    double denseFactorData[40][40];
+    double denseVectorsData[40][40];
+    double denseValues[40];
+    Matrix denseA = {40,40,(double *)denseAData};
+    Matrix denseB = {40,40,(double *)denseBData};
+    Matrix denseVectors = {40,40,(double *)denseVectorsData};
+    for (int i = 0; i < 40; i++) {
+        for (int j = 0; j < 40; j++) {
+            denseAData[i][j] = 1.0 / (1 + i + j) + (i == j ? 0.1 * i : 0.0);
+            denseFactorData[i][j] = cos(0.7 * i + 0.3 * j * j);
+        }
+    }
+    for (int i = 0; i < 40; i++) {
+        for (int j = 0; j < 40; j++) {
+            denseBData[i][j] = i == j ? 40.0 : 0.0;
+            for (int k = 0; k < 40; k++) {
+                denseBData[i][j] += denseFactorData[i][k] * denseFactorData[j][k];
+            }
+        }
+    }
+    if (generalizedSymmetricEigen(&denseA, &denseB, denseValues, &denseVectors)) {
+        // Frobenius norm of A X - B X Lambda
+        double pencilResidual = 0.0;
+        for (int i = 0; i < 40; i++) {
+            for (int j = 0; j < 40; j++) {
+                double entry = 0.0;
+                for (int k = 0; k < 40; k++) {
+                    entry += (denseAData[i][k] - denseBData[i][k] * denseValues[j]) * denseVectorsData[k][j];
+                }
+                pencilResidual += entry * entry;
+            }
+        }
+        printf("Dense pencil eigenvalues: %f ... %f, residual ||AX - BXL||: %e\n", denseValues[0], denseValues[39], sqrt(pencilResidual));
+    }
+    /* Test cases for batched solvers */
+    // Two 2x2 systems stored one after the other, each with right-hand side (1, 1)
+    double systemsData[2][4] = {{4,1,1,3},{2,0,0,5}};
+    double systemsRhsData[2][2] = {{1,1},{1,1}};
+    Matrix systems = {2,2,(double *)systemsData};
+    Matrix systemsRhs = {2,1,(double *)systemsRhsData};
+    if (choleskyFactorBatched(&systems, 4, 2, NULL) &&
+        choleskySolveBatched(&systems, 4, &systemsRhs, 2, 2)) {
+        printf("Batched solutions: (%f, %f) (%f, %f)\n", systemsRhsData[0][0], systemsRhsData[0][1],
+               systemsRhsData[1][0], systemsRhsData[1][1]);
+    }
+    // Two 6x6 systems through the unrolled LU kernel, both solved by x = (1, ..., 1)
+    // The largest entry of every row sits on the antidiagonal, so rows get swapped
+    double luBatchData[2][36];
+    double luBatchRhsData[2][6];
+    int luBatchPivots[12];
+    Matrix luBatch = {6,6,(double *)luBatchData};
+    Matrix luBatchRhs = {6,1,(double *)luBatchRhsData};
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < 6; i++) {
+            luBatchRhsData[b][i] = 0.0;
+            for (int j = 0; j < 6; j++) {
+                luBatchData[b][6 * i + j] = j == 5 - i ? 8.0 + b : 1.0 / (1 + i + j);
+                luBatchRhsData[b][i] += luBatchData[b][6 * i + j];
+            }
+        }
+    }
+    if (luFactorBatched(&luBatch, 36, 2, luBatchPivots, NULL) &&
+        luSolveBatched(&luBatch, 36, luBatchPivots, &luBatchRhs, 6, 2)) {
+        double luBatchError = 0.0;
+        for (int i = 0; i < 12; i++) {
+            double difference = fabs(luBatchRhsData[i / 6][i % 6] - 1.0);
+            luBatchError = difference > luBatchError ? difference : luBatchError;
+        }
+        printf("Batched 6x6 LU, largest error %e\n", luBatchError);
+    }
+    // Two dense positive definite 32x32 systems through the largest unrolled kernels, solved by ones
+    double *spd32Data = (double *)malloc(sizeof(double) * 2 * 32 * 32);
+    double spd32RhsData[2][32];
+    Matrix spd32 = {32,32,spd32Data};
+    Matrix spd32Rhs = {32,1,(double *)spd32RhsData};
+    if (spd32Data != NULL) {
+        for (int b = 0; b < 2; b++) {
+            for (int i = 0; i < 32; i++) {
+                spd32RhsData[b][i] = 0.0;
+                for (int j = 0; j < 32; j++) {
+                    spd32Data[b * 1024 + 32 * i + j] = i == j ? 32.0 + b : 1.0 / (1 + i + j);
+                    spd32RhsData[b][i] += spd32Data[b * 1024 + 32 * i + j];
+                }
+            }
+        }
+        if (choleskyFactorBatched(&spd32, 1024, 2, NULL) &&
+            choleskySolveBatched(&spd32, 1024, &spd32Rhs, 32, 2)) {
+            double spd32Error = 0.0;
+            for (int i = 0; i < 64; i++) {
+                double difference = fabs(spd32RhsData[i / 32][i % 32] - 1.0);
+                spd32Error = difference > spd32Error ? difference : spd32Error;
+            }
+            printf("Batched 32x32 Cholesky, largest error %e\n", spd32Error);
+        }
+        free(spd32Data);
+    }
+    // Two tridiagonal positive definite 6x6 systems in the interleaved layout, also solved by ones
+    double spdBatchData[2][36];
+    double interleavedFactor[72];
+    double interleavedRhs[12];
+    int interleavedInfo[2];
+    Matrix spdBatch = {6,6,(double *)spdBatchData};
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < 6; i++) {
+            for (int j = 0; j < 6; j++) {
+                spdBatchData[b][6 * i + j] = i == j ? 4.0 + b : (i - j == 1 || j - i == 1 ? -1.0 : 0.0);
+            }
+            interleavedRhs[i * 2 + b] = 2.0 + b + (i == 0 || i == 5 ? 1.0 : 0.0);
+        }
+    }
+    interleaveBatch(&spdBatch, 36, 2, interleavedFactor);
+    choleskyFactorInterleaved(interleavedFactor, 6, 2, interleavedInfo);
+    choleskySolveInterleaved(interleavedFactor, 6, 2, interleavedRhs);
+    double interleavedError = 0.0;
+    for (int i = 0; i < 12; i++) {
+        double difference = fabs(interleavedRhs[i] - 1.0);
+        interleavedError = difference > interleavedError ? difference : interleavedError;
+    }
+    printf("Interleaved 6x6 Cholesky, info %d %d, largest error %e\n",
+           interleavedInfo[0], interleavedInfo[1], interleavedError);
+    /* Test cases for closed form inverses */
+    // smallA is invertible, [[1,2],[2,4]] is flagged instead of failing loudly
+    double closedFormData[2][4] = {{1,2,3,4},{1,2,2,4}};
+    double closedInverseData[2][4];
+    double closedDeterminants[2];
+    bool closedSingular[2];
+    Matrix closedForm = {2,2,(double *)closedFormData};
+    Matrix closedInverse = {2,2,(double *)closedInverseData};
+    if (invertSmallBatched(&closedForm, 4, &closedInverse, 4, 2, closedDeterminants, closedSingular)) {
+        printf("Inverse of smallA (det %f):\n", closedDeterminants[0]);
+        printMatrix(&closedInverse);
+        printf("Second matrix near singular: %s\n", closedSingular[1] ? "yes" : "no");
+    }
+    // Two well conditioned matrices each of size 3 and 4, checked by the largest entry of A A^-1 - I
+    double smallBatchData[2][16];
+    double smallInverseData[2][16];
+    for (int size = 3; size <= 4; size++) {
+        Matrix smallBatch = {size,size,(double *)smallBatchData};
+        Matrix smallInverse = {size,size,(double *)smallInverseData};
+        for (int b = 0; b < 2; b++) {
+            for (int i = 0; i < size; i++) {
+                for (int j = 0; j < size; j++) {
+                    smallBatchData[b][size * i + j] = i == j ? 3.0 + b : 1.0 / (2 + i + 2 * j + b);
+                }
+            }
+        }
+        if (invertSmallBatched(&smallBatch, 16, &smallInverse, 16, 2, NULL, NULL)) {
+            double smallInverseError = 0.0;
+            for (int b = 0; b < 2; b++) {
+                for (int i = 0; i < size; i++) {
+                    for (int j = 0; j < size; j++) {
+                        double entry = i == j ? -1.0 : 0.0;
+                        for (int k = 0; k < size; k++) {
+                            entry += smallBatchData[b][size * i + k] * smallInverseData[b][size * k + j];
+                        }
+                        smallInverseError = fabs(entry) > smallInverseError ? fabs(entry) : smallInverseError;
+                    }
+                }
+            }
+            printf("Closed form %dx%d inverses, largest entry of A A^-1 - I: %e\n", size, size, smallInverseError);
         }
     }
     return 0;